@@ -159,7 +159,9 @@ function clean(){
         sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
     else
         echo "目标设备 $USER_DEV_PATH"
-        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        # 打洞清零, 文件系统不支持时退回写0
+        fallocate --punch-hole --offset 0 --length "$(stat -c %s "$USER_DEV_PATH")" "$USER_DEV_PATH" 2>/dev/null || \
+        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT conv=notrunc
     fi 
 }
 
@@ -4,6 +4,17 @@
 #include <linux/fs.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "ddriver_ctl.h"
 /******************************************************************************
 * SECTION: Macro definitions
@@ -29,6 +40,8 @@
 
 #define CONFIG_DISK_SZ  (4 * 1024 * 1024)
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_MAX_IO_SZ (1024 * 1024)                /* Largest single read/write */
+#define CONFIG_SECTOR_NR (CONFIG_DISK_SZ / CONFIG_BLOCK_SZ)
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
@@ -36,14 +49,12 @@
 #define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
 #define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
 
-#define GET_HEAD_POS(disk)      (disk.head - disk.layout)
-#define FORWARD_HEAD(disk, dis) (disk.head += dis)
-#define SET_HEAD(disk, ofs)     (disk.head = disk.layout + ofs)
-#define RESET_HEAD(disk)        (SET_HEAD(disk, 0))
+/* Every open file has its own head: the head position is file->f_pos */
+#define GET_HEAD_POS(file)      ((file)->f_pos)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define ADD_READCNT(disk, blks) (atomic_add((blks), &disk.read_cnt))
+#define ADD_WRITECNT(disk, blks)(atomic_add((blks), &disk.write_cnt))
+#define INC_SEEKCNT(disk)       (atomic_inc(&disk.seek_cnt))
 /******************************************************************************
 * SECTION: Kernel Module Template
 *******************************************************************************/
@@ -56,58 +67,144 @@ MODULE_VERSION(DRIVER_VERSION);
 *******************************************************************************/
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
-    char *head;                                       /* Disk Head */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
+    char *layout;                                     /* Disk Layout, vmalloc_user()ed so it can be mmap()ed */
+    struct rw_semaphore layout_sem;                   /* Reads share, writes and discards exclude */
+    atomic_t read_cnt;
+    atomic_t write_cnt;
+    atomic_t seek_cnt;
     int  major_num;
-    int  open_count;
+    atomic_t open_count;
     int  layout_size;
     int  iounit_size;
+    spinlock_t stats_lock;                            /* Protects stats */
+    struct ddriver_stats_ex stats;                    /* No latency model: model_* stay 0 */
+    atomic_t *heat[DDRIVER_STAT_NR];                  /* Per-sector read/write counts */
+    struct dentry *debugfs;                           /* /sys/kernel/debug/ddriver */
 };
 
 static struct ddriver disk = {
-    .head        = NULL,
-    .read_cnt    = 0,
-    .write_cnt   = 0,
-    .seek_cnt    = 0,
+    .layout      = NULL,
+    .layout_sem  = __RWSEM_INITIALIZER(disk.layout_sem),
+    .read_cnt    = ATOMIC_INIT(0),
+    .write_cnt   = ATOMIC_INIT(0),
+    .seek_cnt    = ATOMIC_INIT(0),
     .major_num   = 0,
-    .open_count  = 0,
+    .open_count  = ATOMIC_INIT(0),
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .stats_lock  = __SPIN_LOCK_UNLOCKED(disk.stats_lock)
 };
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
-        kernel_alert("disk head reach the end");
+/**
+ * @brief Check that [pos, pos + size) is block aligned and inside the disk
+ * 
+ * @param pos           Start offset
+ * @param size          A multiple of @CONFIG_BLOCK_SZ, at most @CONFIG_MAX_IO_SZ
+ * @return int          0 or negative errno
+ */
+static int check_valid(loff_t pos, size_t size){
+    if (pos < 0 || !IS_ADDR_ALIGN(pos)) {
+        kernel_alert("offset %lld must be aligned to block size %d", pos, CONFIG_BLOCK_SZ);
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (size == 0 || !IS_ADDR_ALIGN(size) || size > CONFIG_MAX_IO_SZ) {
+        kernel_alert("io size %zu should be a multiple of %d up to %d", 
+                     size, CONFIG_BLOCK_SZ, CONFIG_MAX_IO_SZ);
         return -EIO;
     }
+    if (pos + size > CONFIG_DISK_SZ) {
+        kernel_alert("io [%lld, %lld) out of disk", pos, pos + (loff_t)size);
+        return -EINVAL;
+    }
     return 0;
 }
+/**
+ * @brief Account one read or write in the extended statistics
+ * 
+ * @param op            DDRIVER_STAT_READ or DDRIVER_STAT_WRITE
+ * @param bytes         Bytes transferred
+ * @param start_ns      ktime_get_ns() when the request began
+ */
+static void stat_account_io(int op, size_t bytes, u64 start_ns) {
+    u64 wall_us = (ktime_get_ns() - start_ns) / NSEC_PER_USEC;
+    int bucket = wall_us <= 1 ? 0 : fls64(wall_us) - 1;
+
+    if (bucket >= DDRIVER_HIST_BUCKETS)
+        bucket = DDRIVER_HIST_BUCKETS - 1;
+    spin_lock(&disk.stats_lock);
+    if (op == DDRIVER_STAT_WRITE) {
+        disk.stats.write_ops++;
+        disk.stats.write_bytes += bytes;
+    }
+    else {
+        disk.stats.read_ops++;
+        disk.stats.read_bytes += bytes;
+    }
+    disk.stats.model_hist[op][0]++;
+    disk.stats.wall_hist[op][bucket]++;
+    spin_unlock(&disk.stats_lock);
+}
+
+static void stat_account_seek(long long from, long long to) {
+    if (from == to)
+        return;
+    spin_lock(&disk.stats_lock);
+    disk.stats.seek_ops++;
+    disk.stats.seek_dist += from < to ? to - from : from - to;
+    spin_unlock(&disk.stats_lock);
+}
+/**
+ * @brief Count a transfer in the per-sector heat map
+ * 
+ * @param op            DDRIVER_STAT_READ or DDRIVER_STAT_WRITE
+ * @param pos           Start offset, block aligned
+ * @param size          Bytes, a multiple of the block size
+ */
+static void stat_account_heat(int op, loff_t pos, size_t size) {
+    int sector = pos / CONFIG_BLOCK_SZ;
+    int end = sector + size / CONFIG_BLOCK_SZ;
+
+    for (; sector < end; sector++)
+        atomic_inc(&disk.heat[op][sector]);
+}
+/**
+ * @brief Reset every counter, the disk content is kept
+ * 
+ */
+static void stat_reset(void) {
+    int op, sector;
+
+    for (op = 0; op < DDRIVER_STAT_NR; op++)
+        for (sector = 0; sector < CONFIG_SECTOR_NR; sector++)
+            atomic_set(&disk.heat[op][sector], 0);
+    atomic_set(&disk.read_cnt, 0);
+    atomic_set(&disk.write_cnt, 0);
+    atomic_set(&disk.seek_cnt, 0);
+    spin_lock(&disk.stats_lock);
+    memset(&disk.stats, 0, sizeof(struct ddriver_stats_ex));
+    spin_unlock(&disk.stats_lock);
+}
 /******************************************************************************
 * SECTION: Function definitions
 *******************************************************************************/
 static int      device_open(struct inode *, struct file *);
 static int      device_release(struct inode *, struct file *);
-static ssize_t  device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t  device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  device_write_iter(struct kiocb *, struct iov_iter *);
 static loff_t   device_seek(struct file *, loff_t, int);
+static int      device_mmap(struct file *, struct vm_area_struct *);
 static long     device_ioctl(struct file *, unsigned int, unsigned long);
 /******************************************************************************
 * SECTION: Global var or structure definitions
 *******************************************************************************/
 static struct file_operations file_ops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
     .open = device_open,
     .llseek = device_seek,
+    .mmap = device_mmap,
     .unlocked_ioctl = device_ioctl,
     .release = device_release
 };
@@ -115,61 +212,82 @@ static struct file_operations file_ops = {
 * SECTION: Function Implementation
 *******************************************************************************/
 /**
- * @brief Disk Read
+ * @brief Count a seek if a transfer of this file starts away from its head,
+ * i.e. pread(2)/pwrite(2) elsewhere. read(2)/write(2) start at the head
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param file          Whose head
+ * @param pos           Where the transfer starts
+ */
+static void head_to(struct file *file, loff_t pos) {
+    stat_account_seek(GET_HEAD_POS(file), pos);
+}
+/**
+ * @brief Disk Read. Reads iov_iter_count(to) bytes at iocb->ki_pos in one copy,
+ * which is the file position for read(2) and the given offset for pread(2)
+ * 
+ * @param iocb          ki_pos: start offset, aligned to @CONFIG_BLOCK_SZ
+ * @param to            User buffers, a multiple of @CONFIG_BLOCK_SZ in total
  * @return ssize_t      Bytes have been read 
  */
 static ssize_t 
-device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
+device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    u64 start = ktime_get_ns();
+    loff_t pos = iocb->ki_pos;
+    size_t size = iov_iter_count(to);
+    int res = check_valid(pos, size);
     if(res < 0)
         return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    head_to(iocb->ki_filp, pos);
+    down_read(&disk.layout_sem);
+    res = copy_to_iter(disk.layout + pos, size, to) != size ? -EFAULT : 0;
+    up_read(&disk.layout_sem);
+    if (res < 0)
+        return res;
+    iocb->ki_pos = pos + size;                        /* Written back to f_pos by read(2) */
+    ADD_READCNT(disk, size / CONFIG_BLOCK_SZ);
+    stat_account_heat(DDRIVER_STAT_READ, pos, size);
+    stat_account_io(DDRIVER_STAT_READ, size, start);
+    return size;
 }
 /**
- * @brief Disk Write
+ * @brief Disk Write. Same rules as device_read_iter
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param iocb          ki_pos: start offset, aligned to @CONFIG_BLOCK_SZ
+ * @param from          User buffers, a multiple of @CONFIG_BLOCK_SZ in total
  * @return ssize_t      Bytes have been written
  */
 static ssize_t 
-device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
+device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    u64 start = ktime_get_ns();
+    loff_t pos = iocb->ki_pos;
+    size_t size = iov_iter_count(from);
+    int res = check_valid(pos, size);
     if(res < 0)
         return res;
-
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
-        return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    head_to(iocb->ki_filp, pos);
+    down_write(&disk.layout_sem);
+    res = copy_from_iter(disk.layout + pos, size, from) != size ? -EFAULT : 0;
+    up_write(&disk.layout_sem);
+    if (res < 0)
+        return res;
+    iocb->ki_pos = pos + size;                        /* Written back to f_pos by write(2) */
+    ADD_WRITECNT(disk, size / CONFIG_BLOCK_SZ);
+    stat_account_heat(DDRIVER_STAT_WRITE, pos, size);
+    stat_account_io(DDRIVER_STAT_WRITE, size, start);
+    return size;
 }
 /**
- * @brief Disk Seek
+ * @brief Disk Seek. Moves the head of this open file only
  * 
- * @param file          Ignored
+ * @param file          f_pos is the head
  * @param offset        Aligned to @CONFIG_BLOCK_SZ
  * @param whence        SEEK_CUR, SEEK_SET
  * @return loff_t       cur pos
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
-    IGNORE_ARG(file);
+    long long from = GET_HEAD_POS(file);
+    loff_t pos;
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
                       offset, CONFIG_BLOCK_SZ);
@@ -178,16 +296,38 @@ device_seek(struct file *file, loff_t offset, int whence) {
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = from + offset;
         break;
     default:
-        break;
+        return -EINVAL;
     }
+    pos = vfs_setpos(file, pos, CONFIG_DISK_SZ);     /* -EINVAL outside [0, disk size] */
+    if (pos < 0)
+        return pos;
     INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    stat_account_seek(from, pos);
+    return pos;
+}
+/**
+ * @brief Disk mmap. Maps the layout itself, so loads and stores through the
+ * mapping bypass read/write and are not counted in the statistics
+ * 
+ * @param file          Ignored
+ * @param vma           vm_pgoff: page offset into the disk
+ * @return int          state
+ */
+static int 
+device_mmap(struct file *file, struct vm_area_struct *vma) {
+    int ret;
+    IGNORE_ARG(file);
+    ret = remap_vmalloc_range(vma, disk.layout, vma->vm_pgoff);
+    if (ret < 0)
+        kernel_alert("mmap [%lu, %lu) pages out of disk", vma->vm_pgoff, 
+                     vma->vm_pgoff + vma_pages(vma));
+    return ret;
 }
 /**
  * @brief Disk ioctl
@@ -199,9 +339,12 @@ device_seek(struct file *file, loff_t offset, int whence) {
  */
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    IGNORE_ARG(file);
     int ret;
+    int sched;
+    long long size64;
+    struct ddriver_range range;
     struct ddriver_state state;
+    struct ddriver_stats_ex *stats;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
@@ -209,47 +352,89 @@ device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size in 64 bits */
+        size64 = disk.layout_size;
+        ret = copy_to_user((long long __user *)arg, &size64, sizeof(long long));
+        if (ret) 
+            return -EFAULT;
+        break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        memset(&state, 0, sizeof(struct ddriver_state));
+        state.sched = DDRIVER_SCHED_NOOP;
+        state.read_cnt = atomic_read(&disk.read_cnt);
+        state.write_cnt = atomic_read(&disk.write_cnt);
+        state.seek_cnt = atomic_read(&disk.seek_cnt);
         ret = copy_to_user((int __user *)arg, &state, sizeof(struct ddriver_state));
         if (ret) 
             return -EFAULT;
         break;
-    case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        disk.head = disk.layout;
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+    case IOC_REQ_DEVICE_RESET:                        /* Reset the caller's head and counters */
+        vfs_setpos(file, 0, CONFIG_DISK_SZ);
+        stat_reset();
+        break;
+    case IOC_REQ_DEVICE_STATS_EX:                     /* Extended Statistics */
+        stats = kmalloc(sizeof(struct ddriver_stats_ex), GFP_KERNEL);
+        if (!stats)
+            return -ENOMEM;
+        spin_lock(&disk.stats_lock);                  /* Consistent snapshot */
+        memcpy(stats, &disk.stats, sizeof(struct ddriver_stats_ex));
+        spin_unlock(&disk.stats_lock);
+        ret = copy_to_user((struct ddriver_stats_ex __user *)arg, stats, 
+                           sizeof(struct ddriver_stats_ex));
+        kfree(stats);
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_STATS_RESET:                  /* Reset Statistics Only */
+        stat_reset();
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discarded blocks read back as zero */
+        ret = copy_from_user(&range, (struct ddriver_range __user *)arg, sizeof(struct ddriver_range));
+        if (ret) 
+            return -EFAULT;
+        if (!IS_ADDR_ALIGN(range.offset) || !IS_ADDR_ALIGN(range.len) || range.len <= 0 ||
+            range.offset < 0 || range.offset + range.len > disk.layout_size) {
+            kernel_alert("discard [%lld, %lld) is invalid", range.offset, range.offset + range.len);
+            return -EINVAL;
+        }
+        down_write(&disk.layout_sem);
+        memset(disk.layout + range.offset, 0, range.len);
+        up_write(&disk.layout_sem);
+        spin_lock(&disk.stats_lock);
+        disk.stats.discard_ops++;
+        disk.stats.discard_bytes += range.len;
+        spin_unlock(&disk.stats_lock);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
         ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_SCHED:                        /* Requests are served synchronously */
+        ret = copy_from_user(&sched, (int __user *)arg, sizeof(int));
+        if (ret) 
+            return -EFAULT;
+        if (sched != DDRIVER_SCHED_NOOP)
+            return -EINVAL;
+        break;
     default:
         break;
     }
     return 0;
 }
 /**
- * @brief Disk Open
+ * @brief Disk Open. Any number of openers, each with its own head
  * 
  * @param inode         Ignored
- * @param file          Ignored
+ * @param file          f_pos starts at 0
  * @return int          state
  */
 static int 
 device_open(struct inode *inode, struct file *file) {
     IGNORE_ARG(inode);
-    IGNORE_ARG(file);
     
-    if (disk.open_count) {                            /* If device is open, return busy */
-        return -EBUSY;
-    }
-    RESET_HEAD(disk);                                 /* Everytime close device, reset head */
-    disk.open_count++;
+    file->f_pos = 0;                                  /* Every open starts with its head at 0 */
+    atomic_inc(&disk.open_count);
     try_module_get(THIS_MODULE);
     return 0;
 }
@@ -266,26 +451,116 @@ device_release(struct inode *inode, struct file *file) {
                                                          Without this, the module would not unload. */
     IGNORE_ARG(inode);
     IGNORE_ARG(file);
-    disk.open_count--;
+    atomic_dec(&disk.open_count);
     module_put(THIS_MODULE);
     return 0;
 }
 /******************************************************************************
+* SECTION: Debugfs
+*******************************************************************************/
+/**
+ * @brief /sys/kernel/debug/ddriver/stats, one "name value" per line
+ * 
+ * @param m             seq_file
+ * @param v             Ignored
+ * @return int          state
+ */
+static int stats_show(struct seq_file *m, void *v) {
+    struct ddriver_stats_ex *stats;
+    IGNORE_ARG(v);
+
+    stats = kmalloc(sizeof(struct ddriver_stats_ex), GFP_KERNEL);
+    if (!stats)
+        return -ENOMEM;
+    spin_lock(&disk.stats_lock);
+    memcpy(stats, &disk.stats, sizeof(struct ddriver_stats_ex));
+    spin_unlock(&disk.stats_lock);
+    seq_printf(m, "open_count    %d\n", atomic_read(&disk.open_count));
+    seq_printf(m, "read_cnt      %d\n", atomic_read(&disk.read_cnt));
+    seq_printf(m, "write_cnt     %d\n", atomic_read(&disk.write_cnt));
+    seq_printf(m, "seek_cnt      %d\n", atomic_read(&disk.seek_cnt));
+    seq_printf(m, "read_ops      %lld\n", stats->read_ops);
+    seq_printf(m, "write_ops     %lld\n", stats->write_ops);
+    seq_printf(m, "seek_ops      %lld\n", stats->seek_ops);
+    seq_printf(m, "read_bytes    %lld\n", stats->read_bytes);
+    seq_printf(m, "write_bytes   %lld\n", stats->write_bytes);
+    seq_printf(m, "seek_dist     %lld\n", stats->seek_dist);
+    seq_printf(m, "discard_ops   %lld\n", stats->discard_ops);
+    seq_printf(m, "discard_bytes %lld\n", stats->discard_bytes);
+    kfree(stats);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+/**
+ * @brief /sys/kernel/debug/ddriver/heatmap, "sector reads writes" for every
+ * sector touched since load or the last reset
+ * 
+ * @param m             seq_file
+ * @param v             Ignored
+ * @return int          state
+ */
+static int heatmap_show(struct seq_file *m, void *v) {
+    int sector, reads, writes;
+    IGNORE_ARG(v);
+
+    seq_puts(m, "sector reads writes\n");
+    for (sector = 0; sector < CONFIG_SECTOR_NR; sector++) {
+        reads = atomic_read(&disk.heat[DDRIVER_STAT_READ][sector]);
+        writes = atomic_read(&disk.heat[DDRIVER_STAT_WRITE][sector]);
+        if (reads || writes)
+            seq_printf(m, "%d %d %d\n", sector, reads, writes);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(heatmap);
+
+static void ddriver_debugfs_init(void) {
+    disk.debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_atomic_t("read_cnt", 0444, disk.debugfs, &disk.read_cnt);
+    debugfs_create_atomic_t("write_cnt", 0444, disk.debugfs, &disk.write_cnt);
+    debugfs_create_atomic_t("seek_cnt", 0444, disk.debugfs, &disk.seek_cnt);
+    debugfs_create_file("stats", 0444, disk.debugfs, NULL, &stats_fops);
+    debugfs_create_file("heatmap", 0444, disk.debugfs, NULL, &heatmap_fops);
+}
+/******************************************************************************
 * SECTION: Module Register and Unregister
 *******************************************************************************/
+static void ddriver_free(void) {
+    int op;
+
+    for (op = 0; op < DDRIVER_STAT_NR; op++) {
+        vfree(disk.heat[op]);
+        disk.heat[op] = NULL;
+    }
+    vfree(disk.layout);
+    disk.layout = NULL;
+}
+
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int major_num;
+    int op;
+
+    disk.layout = vmalloc_user(CONFIG_DISK_SZ);      /* Zeroed, page aligned */
+    for (op = 0; op < DDRIVER_STAT_NR; op++)
+        disk.heat[op] = vzalloc(CONFIG_SECTOR_NR * sizeof(atomic_t));
+    if (!disk.layout || !disk.heat[DDRIVER_STAT_READ] || !disk.heat[DDRIVER_STAT_WRITE]) {
+        kernel_alert("Can't allocate %d bytes of disk", CONFIG_DISK_SZ);
+        ddriver_free();
+        return -ENOMEM;
+    }
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
+        ddriver_free();
         return major_num;
     } 
     else {                                            /* Register success */                                                  
         kernel_info("module loaded with device major number %d", major_num);
         disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
+        ddriver_debugfs_init();                       /* Optional, failures are ignored */
         return 0;
     }
     return 0;
@@ -299,6 +574,8 @@ ddriver_exit(void)
     if(major_num != 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    debugfs_remove_recursive(disk.debugfs);
+    ddriver_free();
 }
 
 module_init(ddriver_init);
@@ -1,166 +1,715 @@
-#include "stdio.h"
-#include "stdlib.h"
-#include <unistd.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include "string.h"
-#include <linux/fs.h>
-#include "ddriver_ctl.h"
-#include "stdio.h"
-#include "errno.h"
-#include <pwd.h>
-#include <time.h>
-
-extern int errno;
-
-#define USER_INFO     "INFO: "
-#define USER_ALERT    "WARNING: "
-
-#define USER_PANIC    "PANIC: "
-/******************************************************************************
-* SECTION: Macro definitions
-*******************************************************************************/   
-#define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
-
-#define user_info(fmt, ...)\
-	do {\
-		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
-
-#define user_alert(fmt, ...)\
-	do {\
-		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-	} while(0)\
-
-#define user_panic(fmt, ...)\
-    do {\
-        printf(USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
-    } while (0)\
-
-#define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
-#define DRIVER_DESC     "A Fake disk driver in user space"
-#define DRIVER_VERSION  "0.1.0"
-
-#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
-#define CONFIG_BLOCK_SZ (512)
-/******************************************************************************
-* SECTION: Macro Functions 
-*******************************************************************************/
-#define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
-
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
-
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
-/******************************************************************************
-* SECTION: Type definitions
-*******************************************************************************/
-struct ddriver
-{
-    int  ddriver_fd;                                 /* Disk ddriver_fd */
-    int  read_cnt;
-    int  write_cnt;
-    int  seek_cnt;
-    int  read_lat;
-    int  write_lat;
-    int  seek_lat;
-    int  track_num;
-    int  major_num;
-    int  layout_size;
-    int  iounit_size;
-};
+#include "ddriver_dev.h"
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
 /* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
+/* 新打开的设备以此为模板, 再按配置覆盖几何与延迟 */
+const struct ddriver ddriver_default = {
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
-    .read_lat    = 2,       /* 2ms */       
-    .write_lat   = 1,       /* 1ms */
-    .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .read_lat    = 2000,    /* 2ms */       
+    .write_lat   = 1000,    /* 1ms */
+    .seek_lat    = 4000,    /* 4.17ms per 360 degree */
     .major_num   = 0,
     .track_num   = 100,
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .sched       = DDRIVER_SCHED_NOOP,
+    .emulate     = 1,
+    .map         = NULL,
+    .log         = NULL,
+    .trace       = NULL,
+    .image       = NULL
 };
 
-FILE *debugf = NULL;
+/* 按文件描述符索引的设备表, 打开时发布, 关闭时先摘下 */
+static struct ddriver *devs[DEVICE_MAX_FD];
+static __thread struct ddriver_thread_head thread_heads[THREAD_HEAD_SLOTS];
+static __thread unsigned trace_tag;                  /* ddriver_trace_tag设置的调用者标签 */
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+/**
+ * @brief 由文件描述符找到设备
+ * 
+ * @param fd 
+ * @return struct ddriver* 不是ddriver_open打开的设备时返回NULL
+ */
+struct ddriver *ddriver_get(int fd) {
+    if (fd < 0 || fd >= DEVICE_MAX_FD)
+        return NULL;
+    return __atomic_load_n(&devs[fd], __ATOMIC_ACQUIRE);
+}
+
+int check_valid(struct ddriver *dev, size_t size) {
+    if (size != dev->iounit_size){
+        user_alert(dev, "io size %ld should align to %d", size, dev->iounit_size);
         return -EIO;
     }
     return 0;
 }
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
+/**
+ * @brief 校验向量IO: 起始偏移与每一段长度都必须按块对齐, 且整体不越过磁盘末尾
+ * 
+ * @param dev 
+ * @param offset 起始偏移
+ * @param iov 
+ * @param iovcnt 
+ * @param total 返回总字节数
+ * @return int 
+ */
+int check_vec_valid(struct ddriver *dev, off_t offset, const struct iovec *iov, int iovcnt,
+                    size_t *total) {
+    size_t size = 0;
+    int i;
+
+    if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+        user_alert(dev, "iovcnt %d should be in [1, %d]", iovcnt, IOV_MAX);
+        return -EINVAL;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0 || !IS_ADDR_ALIGN(dev, iov[i].iov_len)) {
+            user_alert(dev, "iov[%d] size %ld should align to %d", 
+                       i, iov[i].iov_len, dev->iounit_size);
+            return -EIO;
+        }
+        size += iov[i].iov_len;
+    }
+    *total = size;
+    return check_range_valid(dev, offset, size);
+}
+/**
+ * @brief 校验[offset, offset + size)是否是一段按块对齐且在磁盘内的区域
+ * 
+ * @param dev 
+ * @param offset 
+ * @param size 
+ * @return int 
+ */
+int check_range_valid(struct ddriver *dev, off_t offset, size_t size) {
+    if (!IS_ADDR_ALIGN(dev, offset)) {
+        user_alert(dev, "offset %ld must be aligned to block size %d", 
+                      offset, dev->iounit_size);
+        return -EINVAL;
+    }
+    if (size == 0 || !IS_ADDR_ALIGN(dev, size)) {
+        user_alert(dev, "io size %ld should align to %d", size, dev->iounit_size);
+        return -EIO;
+    }
+    if (offset < 0 || offset + size > dev->layout_size) {
+        user_alert(dev, "io [%ld, %ld) out of disk size %lld", 
+                   offset, offset + size, dev->layout_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 磁头从start转到end的模拟延迟(us)
+ * 
+ * @param dev 
+ * @param start 
+ * @param end 
+ * @return long 
+ */
+long rotate_lat_us(struct ddriver *dev, off_t start, off_t end) {
+    long long bytes_per_track = dev->layout_size / dev->track_num;
+    long long distance = llabs(end - start) % bytes_per_track; 
+
+    return distance * dev->seek_lat / bytes_per_track;
+}
+/**
+ * @brief 磁头顺序扫过size字节的模拟延迟(us), 与rotate_lat_us同一模型
+ * 
+ * @param dev 
+ * @param size 
+ * @return long 
+ */
+long transfer_lat_us(struct ddriver *dev, size_t size) {
+    long long bytes_per_track = dev->layout_size / dev->track_num;
+
+    return (long long)size * dev->seek_lat / bytes_per_track;
+}
+
+int emulate_rotate(struct ddriver *dev, off_t start, off_t end) {
+    long lat = rotate_lat_us(dev, start, end);
     
-    if (distance == 0) {
+    if (lat == 0 || !dev->emulate) {
         return 0;
     }
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    usleep(lat);
     return 0;
 }
+/**
+ * @brief 单调时钟(us)
+ * 
+ * @return long long 
+ */
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+/**
+ * @brief 模拟连续传输: 磁头顺序扫过size字节所需的时间
+ * 
+ * @param dev 
+ * @param size 
+ * @return int 
+ */
+int emulate_transfer(struct ddriver *dev, size_t size) {
+    long lat = transfer_lat_us(dev, size);
+
+    if (lat == 0 || !dev->emulate) {
+        return 0;
+    }
+
+    usleep(lat);
+    return 0;
+}
+/**
+ * @brief 环境变量是否被设置为非0
+ * 
+ * @param name 
+ * @param def 未设置时的默认值
+ * @return int 
+ */
+int env_enabled(const char *name, int def) {
+    char *val = getenv(name);
+
+    if (val == NULL || *val == '\0')
+        return def;
+    return strcmp(val, "0") != 0;
+}
+/**
+ * @brief 延迟所在的log2桶: 第i个桶为[2^i, 2^(i+1)) us, 0落入第0个桶
+ * 
+ * @param us 
+ * @return int 
+ */
+static int stat_bucket(long long us) {
+    int bucket;
+
+    if (us <= 1)
+        return 0;
+    bucket = 63 - __builtin_clzll(us);
+    return bucket < DDRIVER_HIST_BUCKETS ? bucket : DDRIVER_HIST_BUCKETS - 1;
+}
+/**
+ * @brief 记录一次读写: 字节数, 模拟延迟(含定位)和实际耗时
+ * 
+ * @param dev 
+ * @param is_write 
+ * @param bytes 
+ * @param model_us 
+ * @param wall_us 
+ */
+void stat_account_io(struct ddriver *dev, int is_write, size_t bytes, long model_us,
+                     long long wall_us) {
+    struct ddriver_stats_ex *st = &dev->stats;
+    int op = is_write ? DDRIVER_STAT_WRITE : DDRIVER_STAT_READ;
+
+    __atomic_add_fetch(is_write ? &st->write_ops : &st->read_ops, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(is_write ? &st->write_bytes : &st->read_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->model_lat_us, model_us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->model_hist[op][stat_bucket(model_us)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->wall_hist[op][stat_bucket(wall_us)], 1, __ATOMIC_RELAXED);
+}
+/**
+ * @brief 记录一次磁头移动. 读写自带的定位把延迟算进该次读写, 这里传0
+ * 
+ * @param dev 
+ * @param from 
+ * @param to 
+ * @param model_us 单独SEEK的模拟延迟
+ */
+void stat_account_seek(struct ddriver *dev, off_t from, off_t to, long model_us) {
+    struct ddriver_stats_ex *st = &dev->stats;
+
+    if (from == to)
+        return;
+    __atomic_add_fetch(&st->seek_ops, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->seek_dist, llabs(to - from), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&st->model_lat_us, model_us, __ATOMIC_RELAXED);
+}
+/**
+ * @brief 清零所有统计, 不动磁盘内容
+ * 
+ * @param dev 
+ */
+void stat_reset(struct ddriver *dev) {
+    dev->read_cnt = 0;
+    dev->write_cnt = 0;
+    dev->seek_cnt = 0;
+    memset(dev->sched_stat, 0, sizeof(dev->sched_stat));
+    memset(&dev->stats, 0, sizeof(dev->stats));
+}
+/**
+ * @brief 创建跟踪文件并写入文件头, 之后的IO由trace_record追加
+ * 
+ * @param dev 
+ * @param path 
+ * @return int 
+ */
+static int trace_open(struct ddriver *dev, const char *path) {
+    struct ddriver_trace_hdr hdr = {
+        .magic      = DDRIVER_TRACE_MAGIC,
+        .version    = DDRIVER_TRACE_VERSION,
+        .block_size = dev->iounit_size,
+        .disk_size  = dev->layout_size,
+    };
+    FILE *trace;
+    int ret;
+
+    if (dev->trace != NULL)
+        return -EBUSY;
+    trace = fopen(path, "w");
+    if (trace == NULL) {
+        ret = -errno;
+        user_alert(dev, "can't open trace [%s]: %s", path, strerror(-ret));
+        return ret;
+    }
+    setvbuf(trace, NULL, _IOFBF, TRACE_BUF_SZ);
+    if (fwrite(&hdr, sizeof(hdr), 1, trace) != 1) {
+        fclose(trace);
+        return -EIO;
+    }
+    dev->trace_start = now_us();
+    __atomic_store_n(&dev->trace, trace, __ATOMIC_RELEASE);
+    user_info(dev, "trace to %s", path);
+    return 0;
+}
+/**
+ * @brief 停止跟踪, 刷出缓冲并关闭跟踪文件
+ * 
+ * @param dev 
+ * @return int 
+ */
+static int trace_close(struct ddriver *dev) {
+    FILE *trace = __atomic_exchange_n(&dev->trace, NULL, __ATOMIC_ACQ_REL);
+
+    if (trace == NULL)
+        return 0;
+    return fclose(trace) == 0 ? 0 : -EIO;
+}
+/**
+ * @brief 跟踪开启时追加一条记录. 在IO发出前调用, 时间戳是发出时刻;
+ * offset小于0表示fd的当前位置(ddriver_read/ddriver_write).
+ * 单条记录一次fwrite, 由stdio的流锁保证多线程下不交错.
+ * 
+ * @param dev 
+ * @param op DDRIVER_OP_*
+ * @param offset 
+ * @param size 
+ */
+void trace_record(struct ddriver *dev, int op, off_t offset, size_t size) {
+    FILE *trace = __atomic_load_n(&dev->trace, __ATOMIC_ACQUIRE);
+    struct ddriver_trace_rec rec;
+
+    if (trace == NULL)
+        return;
+    if (offset < 0)
+        offset = lseek(dev->ddriver_fd, 0, SEEK_CUR);
+    rec.ts_us  = now_us() - dev->trace_start;
+    rec.offset = offset;
+    rec.size   = size;
+    rec.op     = op;
+    rec.tag    = trace_tag;
+    fwrite(&rec, sizeof(rec), 1, trace);
+}
+/**
+ * @brief 把[offset, offset + len)清零并尽量把宿主文件上的空间还回去.
+ * 字符设备交给内核ddriver的DISCARD; 普通文件优先打洞, 文件系统不支持时,
+ * 整盘用ftruncate截断再扩回, 否则退回写0.
+ * 
+ * @param dev 
+ * @param offset 
+ * @param len 
+ * @return int 
+ */
+int discard_range(struct ddriver *dev, off_t offset, off_t len) {
+    static const char zero[DISCARD_ZERO_SZ];
+    struct ddriver_range range = { .offset = offset, .len = len };
+    int fd = dev->ddriver_fd;
+    off_t pos;
+    ssize_t ret;
+
+    if (dev->chrdev)
+        return ioctl(fd, IOC_REQ_DEVICE_DISCARD, &range) < 0 ? -errno : 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        user_alert(dev, "punch hole [%ld, %ld) failed: %s", offset, offset + len, strerror(errno));
+        return -errno;
+    }
+    if (offset == 0 && len == dev->layout_size && dev->map == NULL &&
+        ftruncate(fd, 0) == 0 && ftruncate(fd, len) == 0)
+        return 0;
+
+    for (pos = offset; pos < offset + len; pos += ret) {
+        ret = pwrite(fd, zero, MIN(DISCARD_ZERO_SZ, offset + len - pos), pos);
+        if (ret <= 0) {
+            user_alert(dev, "zero [%ld, %ld) failed: %s", pos, offset + len, strerror(errno));
+            return -EIO;
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 开启写回缓存时先交给缓存. 由缓存完成的请求没有设备延迟,
+ * 在这里计数后调用者直接返回; 被注入丢弃/撕裂的写不经过缓存,
+ * 先写回区间内缓存的块, 免得之后的读和刷出把注入的结果盖掉
+ * 
+ * @param dev 
+ * @param is_write 
+ * @param iov 
+ * @param iovcnt 
+ * @param offset 小于0表示fd的当前位置
+ * @param size 
+ * @param len fault_inject给出的落盘字节数
+ * @param start 请求开始的时刻
+ * @return int 1: 已由缓存完成; 0: 照常访问磁盘
+ */
+static int cache_try(struct ddriver *dev, int is_write, const struct iovec *iov, int iovcnt,
+                     off_t offset, size_t size, size_t len, long long start) {
+    if (dev->cache == NULL)
+        return 0;
+    if (offset < 0)
+        offset = lseek(dev->ddriver_fd, 0, SEEK_CUR);
+    if (len < size) {
+        cache_writeback(dev, offset, size);
+        return 0;
+    }
+    if (cache_rw(dev, iov, iovcnt, offset, size, is_write) == 0)
+        return 0;
+
+    if (is_write)
+        ADD_WRITECNT(dev, size / dev->iounit_size);
+    else
+        ADD_READCNT(dev, size / dev->iounit_size);
+    stat_account_io(dev, is_write, size, 0, now_us() - start);
+    return 1;
+}
+/**
+ * @brief 只写出iov的前len字节, 用于注入的撕裂写
+ * 
+ * @param fd 
+ * @param iov 
+ * @param iovcnt 
+ * @param len 
+ * @return ssize_t 
+ */
+static ssize_t writev_prefix(int fd, const struct iovec *iov, int iovcnt, size_t len) {
+    size_t done = 0;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < iovcnt && done < len; i++) {
+        ret = write(fd, iov[i].iov_base, MIN(iov[i].iov_len, len - done));
+        if (ret < 0)
+            return ret;
+        done += ret;
+    }
+    return done;
+}
+/**
+ * @brief 一次定位 + 一次readv/writev完成多块传输.
+ * 延迟只计一次寻道和一次读写延迟, 其余块按顺序传输计时.
+ * 
+ * @param fd 
+ * @param offset 
+ * @param iov 
+ * @param iovcnt 
+ * @param is_write 
+ * @return int 传输的字节数
+ */
+int ddriver_rwv(int fd, off_t offset, const struct iovec *iov, int iovcnt, int is_write) {
+    struct ddriver *dev = ddriver_get(fd);
+    long long start = now_us();
+    size_t size, len;
+    ssize_t ret;
+    off_t cur;
+    long model;
+    int res;
+
+    if (dev == NULL)
+        return -EBADF;
+    res = check_vec_valid(dev, offset, iov, iovcnt, &size);
+    if (res < 0)
+        return res;
+
+    trace_record(dev, is_write ? DDRIVER_OP_WRITE : DDRIVER_OP_READ, offset, size);
+    res = fault_inject(dev, is_write, offset, size, &len);
+    if (res < 0)
+        return res;
+    if (cache_try(dev, is_write, iov, iovcnt, offset, size, len, start)) {
+        lseek(fd, offset + size, SEEK_SET);
+        return size;
+    }
+    INC_SEEKCNT(dev);
+    cur = lseek(fd, 0, SEEK_CUR);
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        user_panic("seek error: %s", strerror(errno));
+        return -errno;
+    }
+    emulate_rotate(dev, cur, offset);
+    stat_account_seek(dev, cur, offset, 0);
+    model = rotate_lat_us(dev, cur, offset) + transfer_lat_us(dev, size - dev->iounit_size) +
+            (is_write ? dev->write_lat : dev->read_lat);
+
+    if (is_write) {
+        RW_DELAY(dev, write);
+        emulate_transfer(dev, size - dev->iounit_size);
+        ret = len == size ? writev(fd, iov, iovcnt) : writev_prefix(fd, iov, iovcnt, len);
+    }
+    else {
+        RW_DELAY(dev, read);
+        emulate_transfer(dev, size - dev->iounit_size);
+        ret = readv(fd, iov, iovcnt);
+    }
+    if (ret != (ssize_t)len) {
+        user_alert(dev, "%s [%ld, %ld) returns %ld", is_write ? "writev" : "readv",
+                   offset, offset + size, ret);
+        return -EIO;
+    }
+    if (len < size)                                  /* 被丢弃或撕裂的写, 位置照常前移 */
+        lseek(fd, offset + size, SEEK_SET);
+
+    if (is_write)
+        ADD_WRITECNT(dev, size / dev->iounit_size);
+    else
+        ADD_READCNT(dev, size / dev->iounit_size);
+    stat_account_io(dev, is_write, size, model, now_us() - start);
+    return size;
+}
+/**
+ * @brief 调用线程在dev上的磁头位置. 槽位被别的设备占用时从0开始重新模拟
+ * 
+ * @param dev 
+ * @return off_t* 
+ */
+static off_t *thread_head(struct ddriver *dev) {
+    struct ddriver_thread_head *th = &thread_heads[dev->ddriver_fd % THREAD_HEAD_SLOTS];
+
+    if (th->dev != dev) {
+        th->dev = dev;
+        th->head = 0;
+    }
+    return &th->head;
+}
+/**
+ * @brief 按位置读写: 用pread/pwrite, 不碰fd的文件位置, 磁头按线程各自模拟,
+ * 因此可以被多个线程并发调用. 延迟模型与ddriver_rwv相同.
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 
+ * @param offset 
+ * @param is_write 
+ * @return int 传输的字节数
+ */
+static int ddriver_prw(int fd, char *buf, size_t size, off_t offset, int is_write) {
+    struct ddriver *dev = ddriver_get(fd);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    long long start = now_us();
+    off_t *head;
+    ssize_t ret;
+    size_t len;
+    long model;
+    int res;
+
+    if (dev == NULL)
+        return -EBADF;
+    res = check_range_valid(dev, offset, size);
+    if (res < 0)
+        return res;
+
+    trace_record(dev, is_write ? DDRIVER_OP_WRITE : DDRIVER_OP_READ, offset, size);
+    res = fault_inject(dev, is_write, offset, size, &len);
+    if (res < 0)
+        return res;
+    if (cache_try(dev, is_write, &iov, 1, offset, size, len, start))
+        return size;
+    INC_SEEKCNT(dev);
+    head = thread_head(dev);
+    emulate_rotate(dev, *head, offset);
+    stat_account_seek(dev, *head, offset, 0);
+    model = rotate_lat_us(dev, *head, offset) + transfer_lat_us(dev, size - dev->iounit_size) +
+            (is_write ? dev->write_lat : dev->read_lat);
+
+    if (is_write) {
+        RW_DELAY(dev, write);
+        emulate_transfer(dev, size - dev->iounit_size);
+        ret = pwrite(fd, buf, len, offset);
+    }
+    else {
+        RW_DELAY(dev, read);
+        emulate_transfer(dev, size - dev->iounit_size);
+        ret = pread(fd, buf, size, offset);
+    }
+    if (ret != (ssize_t)len) {
+        user_alert(dev, "%s [%ld, %ld) returns %ld", is_write ? "pwrite" : "pread",
+                   offset, offset + size, ret);
+        return -EIO;
+    }
+    *head = offset + size;
+
+    if (is_write)
+        ADD_WRITECNT(dev, size / dev->iounit_size);
+    else
+        ADD_READCNT(dev, size / dev->iounit_size);
+    stat_account_io(dev, is_write, size, model, now_us() - start);
+    return size;
+}
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 按配置打开驱动. 每次打开都有独立的设备状态(几何, 延迟, 统计, 日志),
+ * 同一进程可以同时打开多个磁盘镜像. 日志写在镜像路径加DEVICE_LOG后缀处.
  * 
+ * @param path 磁盘镜像路径, 不存在时创建
+ * @param profile 磁盘配置, NULL时读取环境变量
  * @return int 文件描述符
  */
-int ddriver_open(char *path) {
-    int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
-    
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
+int ddriver_open_ex(char *path, const struct ddriver_profile *profile) {
+    struct ddriver_profile prof;
+    struct ddriver *dev;
+    long long dev_size;
+    struct stat st;
+    int fd, ret = 0, chunked = 0;
+    char log_path[PATH_MAX] = {0};
+    char trace_path[PATH_MAX] = {0};
+
+    if (snprintf(log_path, sizeof(log_path), "%s" DEVICE_LOG, path) >= (int)sizeof(log_path)) {
+        user_panic("path [%s] is too long", path);
+        return -ENAMETOOLONG;
     }
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
+    if (profile) {
+        prof = *profile;
     }
     else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+        ret = profile_from_env(&prof);
+        if (ret < 0)
+            return ret;
     }
+    ret = profile_check(&prof);
+    if (ret < 0)
+        return ret;
+
+    fd = open(path, O_CREAT | O_RDWR, 0644);
     if (fd < 0) {
-        user_panic("can't open device: %d", fd);
-        return fd;
+        ret = -errno;
+        user_panic("can't open device [%s]: %s", path, strerror(-ret));
+        return ret;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
-    if (ret < 0) {
-        user_panic("low space");
+    if (fd >= DEVICE_MAX_FD) {
+        user_panic("too many open files, fd %d exceeds %d", fd, DEVICE_MAX_FD);
+        close(fd);
+        return -EMFILE;
+    }
+    if (fstat(fd, &st) < 0) {
+        ret = -errno;
+        user_panic("can't stat device [%s]: %s", path, strerror(-ret));
+        close(fd);
+        return ret;
+    }
+    if (S_ISCHR(st.st_mode)) {
+        /* 内核ddriver: 大小固定, 读写与mmap都由内核模块提供 */
+        if (ioctl(fd, IOC_REQ_DEVICE_SIZE64, &dev_size) < 0 || dev_size < (long long)prof.disk_size) {
+            user_panic("device [%s] is smaller than %llu bytes", path,
+                       (unsigned long long)prof.disk_size);
+            close(fd);
+            return -ENOSPC;
+        }
+    }
+    /* 分块镜像的长度与磁盘大小无关, 打开后读写落在解出的工作文件上 */
+    else if (image_probe(fd, &st, &prof)) {
+        chunked = 1;
+    }
+    /* 只扩展文件长度, 不预留空间, 未写过和丢弃过的块在宿主上保持稀疏 */
+    else if (st.st_size < (off_t)prof.disk_size && ftruncate(fd, prof.disk_size) < 0) {
+        ret = -errno;
+        user_panic("low space: %s", strerror(-ret));
+        close(fd);
         return ret;
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
+    dev = (struct ddriver *)malloc(sizeof(struct ddriver));
+    if (dev == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+    *dev = ddriver_default;
+    dev->log = fopen(log_path, "w+");
+    if (dev->log == NULL) {
         user_panic("can't init log: %s", log_path);
+        free(dev);
+        close(fd);
         return -1;
     }
+    ret = fault_from_env(dev);
+    if (ret < 0) {
+        log_flush();
+        fclose(dev->log);
+        free(dev);
+        close(fd);
+        return ret;
+    }
+
+    dev->ddriver_fd  = fd;
+    dev->layout_size = prof.disk_size;
+    dev->iounit_size = prof.block_size;
+    dev->track_num   = prof.track_num;
+    dev->read_lat    = prof.read_lat_us;
+    dev->write_lat   = prof.write_lat_us;
+    dev->seek_lat    = prof.seek_lat_us;
+    dev->emulate     = !(prof.flags & DDRIVER_PROFILE_NO_LATENCY);
+    dev->chrdev      = S_ISCHR(st.st_mode);
+    if (chunked) {
+        ret = image_open(dev, fd, path);
+        if (ret < 0) {
+            log_flush();
+            fclose(dev->log);
+            free(dev);
+            close(fd);
+            return ret;
+        }
+        fd = ret;
+    }
+    if (prof.flags & DDRIVER_PROFILE_MMAP) {
+        dev->map = mmap(NULL, dev->layout_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (dev->map == MAP_FAILED) {
+            user_alert(dev, "mmap device failed: %s, fall back to read/write", strerror(errno));
+            dev->map = NULL;
+        }
+    }
+    /* 映射出去的块不经过读写接口, 与写回缓存不能同时使用 */
+    if (prof.cache_size && dev->map)
+        user_alert(dev, "write-back cache is ignored in mmap mode");
+    else if (prof.cache_size && cache_init(dev, prof.cache_size, prof.flush_ms) < 0)
+        user_alert(dev, "can't allocate %llu bytes of cache, write through",
+                   (unsigned long long)prof.cache_size);
+
+    if (env_enabled(ENV_TRACE, 0) &&
+        snprintf(trace_path, sizeof(trace_path), "%s" DEVICE_TRACE, path) < (int)sizeof(trace_path))
+        trace_open(dev, trace_path);
 
+    /* fd在close之前不会被复用, 设备表的同一项不会被并发写 */
+    __atomic_store_n(&devs[fd], dev, __ATOMIC_RELEASE);
     return fd;
 }
+/**
+ * @brief 打开驱动
+ * 
+ * @return int 文件描述符
+ */
+int ddriver_open(char *path) {
+    return ddriver_open_ex(path, NULL);
+}
 /**
  * @brief 关闭驱动
  * 
@@ -168,7 +717,27 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    struct ddriver *dev = ddriver_get(fd);
+    int ret;
+
+    if (dev == NULL)
+        return -EBADF;
+    /* 先从设备表摘下再close, 否则fd可能被并发的open复用后又被清掉 */
+    __atomic_store_n(&devs[fd], NULL, __ATOMIC_RELEASE);
+    if (dev->map) {
+        msync(dev->map, dev->layout_size, MS_SYNC);
+        munmap(dev->map, dev->layout_size);
+        dev->map = NULL;
+    }
+    cache_exit(dev);
+    trace_close(dev);
+    ret = image_close(dev);                          /* 要读工作文件, 在close之前 */
+    if (close(fd) < 0 && ret == 0)
+        ret = -errno;
+    log_flush();                                     /* 队列里可能还有写往dev->log的日志 */
+    fclose(dev->log);
+    free(dev);
+    return ret;
 }
 /**
  * @brief 磁盘头SEEK
@@ -179,24 +748,30 @@ int ddriver_close(int fd) {
  * @return int 
  */
 int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+    struct ddriver *dev = ddriver_get(fd);
+    off_t ret = 0;
+    off_t cur = 0;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+    if (dev == NULL)
+        return -EBADF;
+    if (!IS_ADDR_ALIGN(dev, offset)) {
+        user_alert(dev, "offset %ld must be aligned to block size %d", 
+                      offset, dev->iounit_size);
         return -EINVAL;
     }
 
-    INC_SEEKCNT(disk);
+    INC_SEEKCNT(dev);
     cur = lseek(fd, 0, SEEK_CUR);
     ret = lseek(fd, offset, whence);
     if (ret < 0) {
         user_panic("seek error: %s", strerror(errno));
         return ret;
     }
-    emulate_rotate(fd, cur, ret);
-    return ret;
+    trace_record(dev, DDRIVER_OP_SEEK, ret, 0);
+    emulate_rotate(dev, cur, ret);
+    stat_account_seek(dev, cur, ret, rotate_lat_us(dev, cur, ret));
+    /* 超过2GiB的位置int装不下, 只报告成功 */
+    return ret > INT_MAX ? 0 : ret;
 }
 /**
  * @brief 磁盘写入，写入大小可通过IOCTL查询
@@ -207,15 +782,34 @@ int ddriver_seek(int fd, off_t offset, int whence){
  * @return int 
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *dev = ddriver_get(fd);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    long long start = now_us();
+    size_t len;
+    int res;
+
+    if (dev == NULL)
+        return -EBADF;
+    res = check_valid(dev, size);
     if(res < 0)
         return res;
         
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
+    trace_record(dev, DDRIVER_OP_WRITE, -1, size);
+    res = fault_inject(dev, 1, -1, size, &len);
+    if (res < 0)
+        return res;
+    if (cache_try(dev, 1, &iov, 1, -1, size, len, start)) {
+        lseek(fd, size, SEEK_CUR);
+        return dev->iounit_size;
+    }
+    RW_DELAY(dev, write);
+    write(fd, buf, len);
+    if (len < size)
+        lseek(fd, size - len, SEEK_CUR);
 
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    INC_WRITECNT(dev);
+    stat_account_io(dev, 1, size, dev->write_lat, now_us() - start);
+    return dev->iounit_size;
 }
 /**
  * @brief 
@@ -226,15 +820,107 @@ int ddriver_write(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
+    struct ddriver *dev = ddriver_get(fd);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    long long start = now_us();
+    size_t len;
+    int res;
+
+    if (dev == NULL)
+        return -EBADF;
+    res = check_valid(dev, size);
     if(res < 0)
         return res;
 
-    RW_DELAY(disk, read);
+    trace_record(dev, DDRIVER_OP_READ, -1, size);
+    res = fault_inject(dev, 0, -1, size, &len);
+    if (res < 0)
+        return res;
+    if (cache_try(dev, 0, &iov, 1, -1, size, len, start)) {
+        lseek(fd, size, SEEK_CUR);
+        return dev->iounit_size;
+    }
+    RW_DELAY(dev, read);
     read(fd, buf, size);
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    INC_READCNT(dev);
+    stat_account_io(dev, 0, size, dev->read_lat, now_us() - start);
+    return dev->iounit_size;
+}
+/**
+ * @brief 向量读: 从块对齐的offset开始, 连续读入iov描述的多个块
+ * 
+ * @param fd 
+ * @param offset 起始偏移, 按块对齐
+ * @param iov 每段长度都需是块大小的整数倍
+ * @param iovcnt 
+ * @return int 读出的字节数, 失败返回负的错误码
+ */
+int ddriver_readv(int fd, off_t offset, const struct iovec *iov, int iovcnt) {
+    return ddriver_rwv(fd, offset, iov, iovcnt, 0);
+}
+/**
+ * @brief 向量写: 从块对齐的offset开始, 连续写入iov描述的多个块
+ * 
+ * @param fd 
+ * @param offset 起始偏移, 按块对齐
+ * @param iov 每段长度都需是块大小的整数倍
+ * @param iovcnt 
+ * @return int 写入的字节数, 失败返回负的错误码
+ */
+int ddriver_writev(int fd, off_t offset, const struct iovec *iov, int iovcnt) {
+    return ddriver_rwv(fd, offset, iov, iovcnt, 1);
+}
+/**
+ * @brief 按位置读: 线程安全, 不改变ddriver_seek设置的位置
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 块大小的整数倍
+ * @param offset 起始偏移, 按块对齐
+ * @return int 读出的字节数, 失败返回负的错误码
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset) {
+    return ddriver_prw(fd, buf, size, offset, 0);
+}
+/**
+ * @brief 按位置写: 线程安全, 不改变ddriver_seek设置的位置
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size 块大小的整数倍
+ * @param offset 起始偏移, 按块对齐
+ * @return int 写入的字节数, 失败返回负的错误码
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset) {
+    return ddriver_prw(fd, buf, size, offset, 1);
+}
+/**
+ * @brief mmap模式下返回第blkno个块在映射中的地址, 之后的块在映射中连续存放.
+ * 通过指针的访问不经过read/write, 只在取地址时按一次块读计数和计延迟.
+ * 
+ * @param fd 
+ * @param blkno 块号, 以设备IO单位为单位
+ * @return void* 未开启mmap模式或越界时返回NULL
+ */
+void *ddriver_map_block(int fd, int blkno) {
+    struct ddriver *dev = ddriver_get(fd);
+    long long start = now_us();
+    size_t len;
+
+    if (dev == NULL || dev->map == NULL)
+        return NULL;
+    if (blkno < 0 || blkno >= dev->layout_size / dev->iounit_size) {
+        user_alert(dev, "block %d out of disk", blkno);
+        return NULL;
+    }
+    trace_record(dev, DDRIVER_OP_READ, (off_t)blkno * dev->iounit_size, dev->iounit_size);
+    if (fault_inject(dev, 0, (off_t)blkno * dev->iounit_size, dev->iounit_size, &len) < 0)
+        return NULL;
+    RW_DELAY(dev, read);
+    INC_READCNT(dev);
+    stat_account_io(dev, 0, dev->iounit_size, dev->read_lat, now_us() - start);
+    return dev->map + (off_t)blkno * dev->iounit_size;
 }
 /**
  * @brief 
@@ -245,35 +931,137 @@ int ddriver_read(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
+    struct ddriver *dev = ddriver_get(fd);
     struct ddriver_state state;
+    struct ddriver_range range;
+    struct ddriver_fault fault;
+    struct ddriver_cache_state cache;
+    int sched;
+    int size;
+    int ret;
+
+    if (dev == NULL)
+        return -EBADF;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+        if (dev->layout_size > INT_MAX) {
+            /* int装不下时给出按块对齐的截断值, 完整大小走IOC_REQ_DEVICE_SIZE64 */
+            size = ADDR_ROUND_UP(dev, INT_MAX);
+            memcpy(arg, &size, sizeof(int));
+            return -EOVERFLOW;
+        }
+        size = dev->layout_size;
+        memcpy(arg, &size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size in 64 bits */
+        memcpy(arg, &dev->layout_size, sizeof(long long));
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        memset(&state, 0, sizeof(struct ddriver_state));
+        state.read_cnt = dev->read_cnt;
+        state.write_cnt = dev->write_cnt;
+        state.seek_cnt = dev->seek_cnt;
+        state.sched = dev->sched;
+        memcpy(state.sched_stat, dev->sched_stat, sizeof(dev->sched_stat));
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
+        cache_drop(dev, 0, dev->layout_size);
+        ret = discard_range(dev, 0, dev->layout_size);
+        if (ret < 0)
+            return ret;
         lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
-        }
-        lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        stat_reset(dev);
+        break;
+    case IOC_REQ_DEVICE_STATS_EX:                     /* Extended Statistics */
+        memcpy(arg, &dev->stats, sizeof(struct ddriver_stats_ex));
+        break;
+    case IOC_REQ_DEVICE_STATS_RESET:                  /* Reset Statistics Only */
+        stat_reset(dev);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard Blocks */
+        memcpy(&range, arg, sizeof(struct ddriver_range));
+        ret = check_range_valid(dev, range.offset, range.len);
+        if (ret < 0)
+            return ret;
+        cache_drop(dev, range.offset, range.len);
+        ret = discard_range(dev, range.offset, range.len);
+        if (ret < 0)
+            return ret;
+        __atomic_add_fetch(&dev->stats.discard_ops, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dev->stats.discard_bytes, range.len, __ATOMIC_RELAXED);
         break;
     case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+        memcpy(arg, &dev->iounit_size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SCHED:                        /* Select I/O Scheduler */
+        memcpy(&sched, arg, sizeof(int));
+        if (sched < 0 || sched >= DDRIVER_SCHED_NR) {
+            user_alert(dev, "unknown scheduler %d", sched);
+            return -EINVAL;
+        }
+        __atomic_store_n(&dev->sched, sched, __ATOMIC_RELAXED);
+        user_info(dev, "scheduler switched to %s", ddriver_scheds[sched].name);
+        break;
+    case IOC_REQ_DEVICE_FAULT:                        /* Fault Injection */
+        memcpy(&fault, arg, sizeof(struct ddriver_fault));
+        return fault_set(dev, &fault);
+    case IOC_REQ_DEVICE_FAULT_STATE:                  /* Fault Injection State */
+        fault_get(dev, &fault);
+        memcpy(arg, &fault, sizeof(struct ddriver_fault));
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* Flush Write-back Cache */
+        cache_flush(dev);
+        return image_sync(dev);                       /* 分块镜像同时写回镜像文件 */
+    case IOC_REQ_DEVICE_CACHE_STATE:                  /* Write-back Cache State */
+        cache_state(dev, &cache);
+        memcpy(arg, &cache, sizeof(struct ddriver_cache_state));
+        break;
+    case IOC_REQ_DEVICE_CACHE_DROP:                   /* Drop Dirty Blocks (Power Loss) */
+        cache_drop(dev, 0, dev->layout_size);
         break;
     default:
         break;
     }
     return 0;
-}
\ No newline at end of file
+}
+/**
+ * @brief 开始跟踪: 之后该设备上的每次SEEK/读/写都追加一条记录到path
+ * 
+ * @param fd 
+ * @param path 跟踪文件路径, 已存在时覆盖
+ * @return int 已在跟踪时返回-EBUSY
+ */
+int ddriver_trace_start(int fd, const char *path) {
+    struct ddriver *dev = ddriver_get(fd);
+
+    if (dev == NULL)
+        return -EBADF;
+    return trace_open(dev, path);
+}
+/**
+ * @brief 停止跟踪. 不能与该设备上的IO并发调用
+ * 
+ * @param fd 
+ * @return int 
+ */
+int ddriver_trace_stop(int fd) {
+    struct ddriver *dev = ddriver_get(fd);
+
+    if (dev == NULL)
+        return -EBADF;
+    return trace_close(dev);
+}
+/**
+ * @brief 设置调用线程的跟踪标签, 对之后该线程在所有设备上的IO生效
+ * 
+ * @param tag 
+ * @return unsigned 之前的标签
+ */
+unsigned ddriver_trace_tag(unsigned tag) {
+    unsigned old = trace_tag;
+
+    trace_tag = tag & 0xffff;
+    return old;
+}
@@ -0,0 +1,519 @@
+#include "ddriver_dev.h"
+#include <pthread.h>
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+/*
+ * 易失的写回缓存: 只缓存被写过的块, 因此缓存中的块都是脏块.
+ *
+ *   hash    按块号找到缓存项
+ *   lru     最近访问的在表头, 缓存满时写回表尾的块腾出位置
+ *   free    空闲项, 用hnext串起来
+ *
+ * 所有操作都在lock下进行, 写回时的模拟延迟也在锁内睡, 相当于设备忙于刷盘.
+ */
+struct cache_entry
+{
+    long long          blkno;
+    struct cache_entry *hnext;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    char               *data;
+};
+
+struct ddriver_cache
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           flusher;
+    int                 flush_ms;                    /* 0表示没有定时刷出线程 */
+    int                 stop;
+    int                 nr;                          /* 容量(块) */
+    unsigned            hmask;
+    struct cache_entry  **hash;
+    struct cache_entry  *entries;
+    struct cache_entry  **sorted;                    /* 刷出时按块号排序用 */
+    struct iovec        *iov;                        /* 写回连续块用, iov_nr项 */
+    int                 iov_nr;                      /* MIN(nr, IOV_MAX) */
+    struct cache_entry  lru;                         /* 哨兵 */
+    struct cache_entry  *free;
+    char                *buf;
+    off_t               head;                        /* 写回时模拟的磁头 */
+    struct ddriver_cache_state stat;
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static struct cache_entry **hash_slot(struct ddriver_cache *cache, long long blkno) {
+    return &cache->hash[(unsigned)(blkno * 0x9e3779b1u) & cache->hmask];
+}
+
+static struct cache_entry *cache_lookup(struct ddriver_cache *cache, long long blkno) {
+    struct cache_entry *entry;
+
+    for (entry = *hash_slot(cache, blkno); entry != NULL; entry = entry->hnext) {
+        if (entry->blkno == blkno)
+            return entry;
+    }
+    return NULL;
+}
+
+static void lru_del(struct cache_entry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+}
+
+static void lru_add(struct ddriver_cache *cache, struct cache_entry *entry) {
+    entry->next = cache->lru.next;
+    entry->prev = &cache->lru;
+    cache->lru.next->prev = entry;
+    cache->lru.next = entry;
+}
+/**
+ * @brief 把缓存项从hash和LRU中摘下, 放回空闲链
+ *
+ * @param cache
+ * @param entry
+ */
+static void cache_release(struct ddriver_cache *cache, struct cache_entry *entry) {
+    struct cache_entry **pp = hash_slot(cache, entry->blkno);
+
+    while (*pp != entry)
+        pp = &(*pp)->hnext;
+    *pp = entry->hnext;
+    lru_del(entry);
+    entry->blkno = -1;
+    entry->hnext = cache->free;
+    cache->free = entry;
+    cache->stat.dirty--;
+}
+/**
+ * @brief 把nr个块号连续的缓存项用一次pwritev写回盘上, 按一次定位加一次写计延迟.
+ * 超过IOV_MAX块时分成几次pwritev, 延迟照旧按一次计
+ *
+ * @param dev
+ * @param run
+ * @param nr
+ * @return long 模拟延迟(us)
+ */
+static long cache_write_run(struct ddriver *dev, struct cache_entry **run, int nr) {
+    struct ddriver_cache *cache = dev->cache;
+    off_t offset = run[0]->blkno * dev->iounit_size;
+    long lat;
+    int i, j, n;
+
+    lat = rotate_lat_us(dev, cache->head, offset) + dev->write_lat +
+          transfer_lat_us(dev, (size_t)(nr - 1) * dev->iounit_size);
+    for (i = 0; i < nr; i += n) {
+        n = MIN(nr - i, cache->iov_nr);
+        for (j = 0; j < n; j++) {
+            cache->iov[j].iov_base = run[i + j]->data;
+            cache->iov[j].iov_len  = dev->iounit_size;
+        }
+        if (pwritev(dev->ddriver_fd, cache->iov, n, offset + (off_t)i * dev->iounit_size) !=
+            (ssize_t)n * dev->iounit_size)
+            user_alert(dev, "cache write back blocks [%lld, %lld) failed",
+                       run[i]->blkno, run[i]->blkno + n);
+    }
+    cache->head = offset + (off_t)nr * dev->iounit_size;
+    return lat;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    long long x = (*(struct cache_entry * const *)a)->blkno;
+    long long y = (*(struct cache_entry * const *)b)->blkno;
+
+    return x < y ? -1 : x > y;
+}
+/**
+ * @brief 写回sorted中的前nr项并释放: 按块号排序后连续的块合并成一次写. 调用者持有锁
+ *
+ * @param dev
+ * @param nr
+ * @return long 模拟延迟(us)
+ */
+static long cache_write_sorted(struct ddriver *dev, int nr) {
+    struct ddriver_cache *cache = dev->cache;
+    long lat = 0;
+    int i, j;
+
+    qsort(cache->sorted, nr, sizeof(struct cache_entry *), entry_cmp);
+    for (i = 0; i < nr; i = j) {
+        for (j = i + 1; j < nr && cache->sorted[j]->blkno == cache->sorted[j - 1]->blkno + 1; j++)
+            ;
+        lat += cache_write_run(dev, &cache->sorted[i], j - i);
+    }
+    for (i = 0; i < nr; i++)
+        cache_release(cache, cache->sorted[i]);
+    return lat;
+}
+/**
+ * @brief 写回全部脏块. 调用者持有锁
+ *
+ * @param dev
+ */
+static void cache_flush_locked(struct ddriver *dev) {
+    struct ddriver_cache *cache = dev->cache;
+    struct cache_entry *entry;
+    int nr = 0;
+    long lat;
+
+    for (entry = cache->lru.next; entry != &cache->lru; entry = entry->next)
+        cache->sorted[nr++] = entry;
+    if (nr == 0)
+        return;
+    lat = cache_write_sorted(dev, nr);
+    cache->stat.flushes++;
+    cache->stat.flushed_blocks += nr;
+    if (lat > 0 && dev->emulate)
+        usleep(lat);
+}
+/**
+ * @brief 取一个空闲项, 没有时写回LRU表尾的块. 调用者持有锁
+ *
+ * @param dev
+ * @return struct cache_entry*
+ */
+static struct cache_entry *cache_alloc(struct ddriver *dev) {
+    struct ddriver_cache *cache = dev->cache;
+    struct cache_entry *entry = cache->free;
+    long lat;
+
+    if (entry == NULL) {
+        entry = cache->lru.prev;
+        lat = cache_write_run(dev, &entry, 1);
+        cache_release(cache, entry);
+        cache->stat.evictions++;
+        if (lat > 0 && dev->emulate)
+            usleep(lat);
+        entry = cache->free;
+    }
+    cache->free = entry->hnext;
+    return entry;
+}
+/**
+ * @brief 在iov描述的缓冲与buf之间拷贝len字节, 从iov的第pos字节开始
+ *
+ * @param iov
+ * @param iovcnt
+ * @param pos
+ * @param buf
+ * @param len
+ * @param to_iov 1: buf -> iov, 0: iov -> buf
+ */
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t pos, char *buf, size_t len,
+                     int to_iov) {
+    size_t n;
+    int i;
+
+    for (i = 0; i < iovcnt && pos >= iov[i].iov_len; i++)
+        pos -= iov[i].iov_len;
+    for (; i < iovcnt && len > 0; i++, pos = 0) {
+        n = MIN(iov[i].iov_len - pos, len);
+        if (to_iov)
+            memcpy((char *)iov[i].iov_base + pos, buf, n);
+        else
+            memcpy(buf, (char *)iov[i].iov_base + pos, n);
+        buf += n;
+        len -= n;
+    }
+}
+/**
+ * @brief 丢弃块号在[first, last)中的缓存项, 不写回. 调用者持有锁
+ *
+ * @param cache
+ * @param first
+ * @param last
+ */
+static void cache_drop_locked(struct ddriver_cache *cache, long long first, long long last) {
+    struct cache_entry *entry;
+    long long blkno;
+    int i;
+
+    if (last - first < cache->nr) {
+        for (blkno = first; blkno < last; blkno++) {
+            entry = cache_lookup(cache, blkno);
+            if (entry)
+                cache_release(cache, entry);
+        }
+        return;
+    }
+    for (i = 0; i < cache->nr; i++) {
+        entry = &cache->entries[i];
+        if (entry->blkno >= first && entry->blkno < last)
+            cache_release(cache, entry);
+    }
+}
+/**
+ * @brief 定时刷出线程
+ *
+ * @param arg
+ * @return void*
+ */
+static void *cache_flusher(void *arg) {
+    struct ddriver *dev = (struct ddriver *)arg;
+    struct ddriver_cache *cache = dev->cache;
+    struct timespec ts;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += cache->flush_ms / 1000;
+        ts.tv_nsec += (cache->flush_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&cache->cond, &cache->lock, &ts) == ETIMEDOUT &&
+            !cache->stop)
+            cache_flush_locked(dev);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 建立size字节的写回缓存, flush_ms不为0时启动定时刷出线程
+ *
+ * @param dev
+ * @param size 块大小的整数倍
+ * @param flush_ms
+ * @return int
+ */
+int cache_init(struct ddriver *dev, size_t size, int flush_ms) {
+    struct ddriver_cache *cache;
+    unsigned hsize = 1;
+    int i;
+
+    cache = calloc(1, sizeof(struct ddriver_cache));
+    if (cache == NULL)
+        return -ENOMEM;
+    cache->nr = size / dev->iounit_size;
+    while (hsize < (unsigned)cache->nr)
+        hsize <<= 1;
+    cache->hmask   = hsize - 1;
+    cache->hash    = calloc(hsize, sizeof(struct cache_entry *));
+    cache->entries = calloc(cache->nr, sizeof(struct cache_entry));
+    cache->sorted  = calloc(cache->nr, sizeof(struct cache_entry *));
+    cache->iov_nr  = MIN(cache->nr, IOV_MAX);
+    cache->iov     = calloc(cache->iov_nr, sizeof(struct iovec));
+    cache->buf     = malloc(size);
+    if (!cache->hash || !cache->entries || !cache->sorted || !cache->iov || !cache->buf) {
+        free(cache->hash);
+        free(cache->entries);
+        free(cache->sorted);
+        free(cache->iov);
+        free(cache->buf);
+        free(cache);
+        return -ENOMEM;
+    }
+    cache->lru.next = cache->lru.prev = &cache->lru;
+    for (i = cache->nr - 1; i >= 0; i--) {
+        cache->entries[i].blkno = -1;
+        cache->entries[i].data  = cache->buf + (size_t)i * dev->iounit_size;
+        cache->entries[i].hnext = cache->free;
+        cache->free = &cache->entries[i];
+    }
+    cache->stat.size = cache->nr;
+    cache->flush_ms = flush_ms;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    dev->cache = cache;
+
+    if (flush_ms && pthread_create(&cache->flusher, NULL, cache_flusher, dev) != 0) {
+        user_alert(dev, "can't start cache flusher, flush on demand only");
+        cache->flush_ms = 0;
+    }
+    user_info(dev, "write-back cache %d blocks, flush every %d ms", cache->nr, flush_ms);
+    return 0;
+}
+/**
+ * @brief 停止定时刷出, 写回全部脏块并释放缓存
+ *
+ * @param dev
+ */
+void cache_exit(struct ddriver *dev) {
+    struct ddriver_cache *cache = dev->cache;
+
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    pthread_cond_signal(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    if (cache->flush_ms)
+        pthread_join(cache->flusher, NULL);
+
+    cache_flush(dev);
+    dev->cache = NULL;
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->cond);
+    free(cache->hash);
+    free(cache->entries);
+    free(cache->sorted);
+    free(cache->iov);
+    free(cache->buf);
+    free(cache);
+}
+/**
+ * @brief 经缓存读写[offset, offset + size).
+ * 写: 全部吸收进缓存, 超过缓存容量的写丢弃区间内的旧缓存后直写.
+ * 读: 整个区间都在缓存中时由缓存完成; 部分命中时先写回区间内的脏块,
+ * 再由调用者照常从盘上读.
+ *
+ * @param dev
+ * @param iov
+ * @param iovcnt
+ * @param offset 按块对齐
+ * @param size 块大小的整数倍
+ * @param is_write
+ * @return int 1: 已由缓存完成; 0: 调用者需要照常访问磁盘
+ */
+int cache_rw(struct ddriver *dev, const struct iovec *iov, int iovcnt, off_t offset,
+             size_t size, int is_write) {
+    struct ddriver_cache *cache = dev->cache;
+    long long first = offset / dev->iounit_size;
+    long long nr = size / dev->iounit_size, i, hits = 0;
+    struct cache_entry *entry, *run[1];
+    long lat = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if (is_write && nr > cache->nr) {
+        cache_drop_locked(cache, first, first + nr);
+        cache->stat.write_bypass++;
+        pthread_mutex_unlock(&cache->lock);
+        return 0;
+    }
+
+    if (is_write) {
+        for (i = 0; i < nr; i++) {
+            entry = cache_lookup(cache, first + i);
+            if (entry == NULL) {
+                entry = cache_alloc(dev);
+                entry->blkno = first + i;
+                entry->hnext = *hash_slot(cache, entry->blkno);
+                *hash_slot(cache, entry->blkno) = entry;
+                cache->stat.dirty++;
+            }
+            else {
+                lru_del(entry);
+            }
+            lru_add(cache, entry);
+            iov_copy(iov, iovcnt, i * dev->iounit_size, entry->data, dev->iounit_size, 0);
+        }
+        cache->stat.write_hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return 1;
+    }
+
+    for (i = 0; i < nr; i++)
+        hits += cache_lookup(cache, first + i) != NULL;
+    if (hits == nr) {
+        for (i = 0; i < nr; i++) {
+            entry = cache_lookup(cache, first + i);
+            lru_del(entry);
+            lru_add(cache, entry);
+            iov_copy(iov, iovcnt, i * dev->iounit_size, entry->data, dev->iounit_size, 1);
+        }
+        cache->stat.read_hits++;
+        pthread_mutex_unlock(&cache->lock);
+        return 1;
+    }
+    for (i = 0; hits > 0 && i < nr; i++) {
+        run[0] = cache_lookup(cache, first + i);
+        if (run[0] == NULL)
+            continue;
+        lat += cache_write_run(dev, run, 1);
+        cache_release(cache, run[0]);
+        hits--;
+    }
+    cache->stat.read_misses++;
+    if (lat > 0 && dev->emulate)
+        usleep(lat);
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
+/**
+ * @brief 写回全部脏块, 之后盘上的内容与缓存一致(IOC_REQ_DEVICE_FLUSH)
+ *
+ * @param dev
+ */
+void cache_flush(struct ddriver *dev) {
+    struct ddriver_cache *cache = dev->cache;
+
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    cache_flush_locked(dev);
+    pthread_mutex_unlock(&cache->lock);
+}
+/**
+ * @brief 写回并丢弃[offset, offset + len)中的脏块. 被注入丢弃/撕裂的写绕过缓存直接落盘,
+ * 之前先调用: 没写到的部分留下的是缓存里已确认的数据, 之后的读和刷出也不会再用旧块
+ *
+ * @param dev
+ * @param offset
+ * @param len
+ */
+void cache_writeback(struct ddriver *dev, off_t offset, off_t len) {
+    struct ddriver_cache *cache = dev->cache;
+    long long first = offset / dev->iounit_size;
+    long long last = (offset + len) / dev->iounit_size;
+    struct cache_entry *entry;
+    long long blkno;
+    int nr = 0, i;
+    long lat;
+
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    if (last - first < cache->nr) {
+        for (blkno = first; blkno < last; blkno++) {
+            entry = cache_lookup(cache, blkno);
+            if (entry)
+                cache->sorted[nr++] = entry;
+        }
+    }
+    else {
+        for (i = 0; i < cache->nr; i++) {
+            entry = &cache->entries[i];
+            if (entry->blkno >= first && entry->blkno < last)
+                cache->sorted[nr++] = entry;
+        }
+    }
+    if (nr > 0) {
+        lat = cache_write_sorted(dev, nr);
+        if (lat > 0 && dev->emulate)
+            usleep(lat);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+/**
+ * @brief 不写回地丢弃[offset, offset + len)中的脏块, 用于DISCARD/RESET和模拟掉电
+ *
+ * @param dev
+ * @param offset
+ * @param len
+ */
+void cache_drop(struct ddriver *dev, off_t offset, off_t len) {
+    struct ddriver_cache *cache = dev->cache;
+
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    cache_drop_locked(cache, offset / dev->iounit_size, (offset + len) / dev->iounit_size);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_state(struct ddriver *dev, struct ddriver_cache_state *out) {
+    struct ddriver_cache *cache = dev->cache;
+
+    memset(out, 0, sizeof(struct ddriver_cache_state));
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    *out = cache->stat;
+    pthread_mutex_unlock(&cache->lock);
+}
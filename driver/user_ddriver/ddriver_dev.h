@@ -0,0 +1,218 @@
+#ifndef _DDRIVER_DEV_H_
+#define _DDRIVER_DEV_H_
+
+#define _GNU_SOURCE
+#include "stdio.h"
+#include "stdlib.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include "string.h"
+#include <linux/fs.h>
+#include "ddriver_ctl.h"
+#include "stdio.h"
+#include "errno.h"
+#include <pwd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include "ddriver.h"
+
+extern int errno;
+
+#define USER_INFO     "INFO: "
+#define USER_ALERT    "WARNING: "
+
+#define USER_PANIC    "PANIC: "
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/   
+#define DEVICE_NAME   "ddriver"
+#define DEVICE_LOG    "_log"                          /* 日志路径: 设备路径 + DEVICE_LOG */
+#define DEVICE_MAX_FD 1024                            /* 设备表按文件描述符索引 */
+#define DEVICE_TRACE  "_trace"                        /* 自动跟踪的路径: 设备路径 + DEVICE_TRACE */
+
+#define ENV_MMAP      "DDRIVER_MMAP"                  /* 非0: 映射整个磁盘 */
+#define ENV_LATENCY   "DDRIVER_LATENCY"               /* 0: 关闭延迟模拟 */
+#define ENV_TRACE     DDRIVER_TRACE_ENV               /* 非0: 打开时开始跟踪 */
+#define ENV_LOG_LEVEL "DDRIVER_LOG_LEVEL"             /* panic/alert/info/off, 默认info */
+#define ENV_FAULT     "DDRIVER_FAULT"                 /* 打开时设置的故障注入, 见fault_from_env */
+
+#define LOG_PANIC     0
+#define LOG_ALERT     1
+#define LOG_INFO      2
+#define LOG_LEVEL_NR  3
+#define LOG_RING_SZ   1024                            /* 日志队列深度, 2的幂 */
+#define LOG_MSG_SZ    160                             /* 单条日志的最大长度, 超出截断 */
+#define LOG_FLUSH_US  10000                           /* 后台线程的刷出周期 */
+
+/* 
+ * 日志先格式化进无锁队列(ddriver_log.c), 由后台线程写到stdout和设备日志;
+ * dev为NULL时只打印. 低于DDRIVER_LOG_LEVEL的日志连参数都不求值
+ */
+#define user_log(dev, level, fmt, ...)\
+    do {\
+        if ((level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))\
+            log_emit((dev), (level), fmt, ##__VA_ARGS__);\
+    } while (0)\
+
+#define user_info(dev, fmt, ...)    user_log(dev, LOG_INFO, fmt, ##__VA_ARGS__)
+#define user_alert(dev, fmt, ...)   user_log(dev, LOG_ALERT, fmt, ##__VA_ARGS__)
+#define user_panic(fmt, ...)        user_log(NULL, LOG_PANIC, fmt, ##__VA_ARGS__)
+
+#define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
+#define DRIVER_DESC     "A Fake disk driver in user space"
+#define DRIVER_VERSION  "0.1.0"
+
+/* 默认配置, 运行时的大小以各设备的layout_size/iounit_size为准 */
+#define CONFIG_DISK_SZ  (4 * 1024 * 1024)
+#define CONFIG_BLOCK_SZ (512)
+
+#define DISCARD_ZERO_SZ (64 * 1024)                  /* 不能打洞时每次写0的大小 */
+#define THREAD_HEAD_SLOTS 16                         /* 每个线程记录磁头位置的设备数 */
+#define TRACE_BUF_SZ    (64 * 1024)                  /* 跟踪文件的stdio缓冲 */
+/******************************************************************************
+* SECTION: Macro Functions 
+*******************************************************************************/
+#define IGNORE_ARG(arg)         ((void)arg)
+#define MIN(a, b)               ((a) < (b) ? (a) : (b))
+#define IS_ADDR_ALIGN(dev, addr)    ((addr) % (dev)->iounit_size == 0)
+#define ADDR_ROUND_UP(dev, addr)    (((addr) / (dev)->iounit_size) * (dev)->iounit_size)
+
+/* 计数器可能被设备线程(ddriver_ring.c)并发更新, 统一用原子加 */
+#define INC_READCNT(dev)        ADD_READCNT(dev, 1)
+#define INC_WRITECNT(dev)       ADD_WRITECNT(dev, 1)
+#define INC_SEEKCNT(dev)        (__atomic_add_fetch(&(dev)->seek_cnt, 1, __ATOMIC_RELAXED))
+#define ADD_READCNT(dev, blks)  (__atomic_add_fetch(&(dev)->read_cnt, (blks), __ATOMIC_RELAXED))
+#define ADD_WRITECNT(dev, blks) (__atomic_add_fetch(&(dev)->write_cnt, (blks), __ATOMIC_RELAXED))
+
+#define RW_DELAY(dev, rw_ops)   ((dev)->emulate ? usleep((dev)->rw_ops##_lat) : 0)
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+struct ddriver_cache;
+struct ddriver_image;
+
+struct ddriver
+{
+    int  ddriver_fd;                                 /* Disk ddriver_fd */
+    int  read_cnt;
+    int  write_cnt;
+    int  seek_cnt;
+    int  read_lat;                                   /* us */
+    int  write_lat;                                  /* us */
+    int  seek_lat;                                   /* us, 转一圈 */
+    int  track_num;
+    int  major_num;
+    long long layout_size;
+    int  iounit_size;
+    int  sched;                                      /* 异步队列使用的调度器 */
+    int  emulate;                                    /* 是否模拟延迟 */
+    char *map;                                       /* mmap模式下整个磁盘的映射 */
+    int  chrdev;                                     /* 后端是字符设备(内核ddriver) */
+    struct ddriver_sched_state sched_stat[DDRIVER_SCHED_NR];
+    struct ddriver_stats_ex stats;                   /* IOC_REQ_DEVICE_STATS_EX */
+    FILE *log;                                       /* 本设备的日志 */
+    FILE *trace;                                     /* 块IO跟踪, NULL表示未开启 */
+    long long trace_start;                           /* 开始跟踪的时刻(us) */
+    struct ddriver_fault fault;                      /* IOC_REQ_DEVICE_FAULT, flags为0时不注入 */
+    unsigned long long fault_rng;                    /* 注入用的随机数状态 */
+    struct ddriver_cache *cache;                     /* 写回缓存, NULL表示直写 */
+    struct ddriver_image *image;                     /* 分块压缩镜像, NULL表示裸镜像 */
+};
+
+/* ddriver_pread/ddriver_pwrite按线程模拟的磁头, 按fd直接映射到槽位 */
+struct ddriver_thread_head
+{
+    struct ddriver     *dev;
+    off_t              head;
+};
+
+/* 调度器看到的一个待派发请求 */
+struct ddriver_sched_rq
+{
+    struct ddriver_sqe sqe;
+    long long          submit_us;                    /* 提交时刻 */
+    long long          key;                          /* 调度器内部的排序键 */
+    unsigned           seq;                          /* 在本批中的到达顺序 */
+    long               model_us;                     /* 执行时算出的模拟延迟 */
+    int                expired;
+};
+
+struct ddriver_sched_ops
+{
+    const char *name;
+    /* 把一批按到达顺序排列的请求原地重排为派发顺序 */
+    void (*dispatch)(struct ddriver *dev, struct ddriver_sched_rq *rqs, int nr, off_t head,
+                     long long now_us, struct ddriver_sched_state *stat);
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+extern const struct ddriver ddriver_default;
+extern int log_level;
+/******************************************************************************
+* SECTION: ddriver.c
+*******************************************************************************/
+struct ddriver *ddriver_get(int fd);
+int  check_valid(struct ddriver *dev, size_t size);
+int  check_range_valid(struct ddriver *dev, off_t offset, size_t size);
+int  check_vec_valid(struct ddriver *dev, off_t offset, const struct iovec *iov, int iovcnt,
+                     size_t *total);
+long rotate_lat_us(struct ddriver *dev, off_t start, off_t end);
+long transfer_lat_us(struct ddriver *dev, size_t size);
+int  emulate_rotate(struct ddriver *dev, off_t start, off_t end);
+int  emulate_transfer(struct ddriver *dev, size_t size);
+int  env_enabled(const char *name, int def);
+int  discard_range(struct ddriver *dev, off_t offset, off_t len);
+long long now_us(void);
+void stat_account_io(struct ddriver *dev, int is_write, size_t bytes, long model_us,
+                     long long wall_us);
+void stat_account_seek(struct ddriver *dev, off_t from, off_t to, long model_us);
+void stat_reset(struct ddriver *dev);
+void trace_record(struct ddriver *dev, int op, off_t offset, size_t size);
+/******************************************************************************
+* SECTION: ddriver_cache.c
+*******************************************************************************/
+int  cache_init(struct ddriver *dev, size_t size, int flush_ms);
+void cache_exit(struct ddriver *dev);
+int  cache_rw(struct ddriver *dev, const struct iovec *iov, int iovcnt, off_t offset,
+              size_t size, int is_write);
+void cache_flush(struct ddriver *dev);
+void cache_writeback(struct ddriver *dev, off_t offset, off_t len);
+void cache_drop(struct ddriver *dev, off_t offset, off_t len);
+void cache_state(struct ddriver *dev, struct ddriver_cache_state *out);
+/******************************************************************************
+* SECTION: ddriver_fault.c
+*******************************************************************************/
+int  fault_set(struct ddriver *dev, const struct ddriver_fault *cfg);
+void fault_get(struct ddriver *dev, struct ddriver_fault *out);
+int  fault_from_env(struct ddriver *dev);
+int  fault_inject(struct ddriver *dev, int is_write, off_t offset, size_t size, size_t *len);
+/******************************************************************************
+* SECTION: ddriver_image.c
+*******************************************************************************/
+int  image_probe(int fd, const struct stat *st, const struct ddriver_profile *profile);
+int  image_open(struct ddriver *dev, int fd, const char *path);
+int  image_sync(struct ddriver *dev);
+int  image_close(struct ddriver *dev);
+/******************************************************************************
+* SECTION: ddriver_log.c
+*******************************************************************************/
+void log_emit(struct ddriver *dev, int level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+void log_flush(void);
+/******************************************************************************
+* SECTION: ddriver_profile.c
+*******************************************************************************/
+int  parse_size(const char *val, unsigned long long *out);
+int  profile_check(const struct ddriver_profile *profile);
+int  profile_from_env(struct ddriver_profile *profile);
+/******************************************************************************
+* SECTION: ddriver_sched.c
+*******************************************************************************/
+extern const struct ddriver_sched_ops ddriver_scheds[DDRIVER_SCHED_NR];
+void sched_account_seek(struct ddriver *dev, int sched, off_t from, off_t to, long lat_us);
+
+#endif /* _DDRIVER_DEV_H_ */
\ No newline at end of file
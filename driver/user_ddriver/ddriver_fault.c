@@ -0,0 +1,307 @@
+#include "ddriver_dev.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define FAULT_DELIMS            ", \t\r\n;"
+#define FAULT_GOLDEN            0x9e3779b97f4a7c15ULL
+#define FAULT_LN2               0.69314718055994530942
+#define FAULT_READ_COUNTER(dev, field) \
+    __atomic_load_n(&(dev)->fault.field, __ATOMIC_RELAXED)
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+static const char *spike_names[DDRIVER_SPIKE_NR] = { "fixed", "uniform", "exp", "pareto" };
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief splitmix64: 每次调用原子地推进一次状态, 多线程下不加锁,
+ * 同一种子下整体序列固定
+ *
+ * @param dev
+ * @return unsigned long long
+ */
+static unsigned long long fault_rand(struct ddriver *dev) {
+    unsigned long long x = __atomic_add_fetch(&dev->fault_rng, FAULT_GOLDEN, __ATOMIC_RELAXED);
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+/**
+ * @brief (0, 1]上的均匀分布
+ *
+ * @param dev
+ * @return double
+ */
+static double fault_uniform(struct ddriver *dev) {
+    return ((fault_rand(dev) >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+/**
+ * @brief (0, 1]上的自然对数. 库不链接libm, 用atanh级数, 精度对延迟采样足够
+ *
+ * @param x
+ * @return double
+ */
+static double fault_ln(double x) {
+    double y, y2, term, sum;
+    int k = 0, i;
+
+    while (x < 0.5) {
+        x *= 2;
+        k++;
+    }
+    y = (x - 1) / (x + 1);
+    y2 = y * y;
+    term = sum = y;
+    for (i = 3; i <= 21; i += 2) {
+        term *= y2;
+        sum += term / i;
+    }
+    return 2 * sum - k * FAULT_LN2;
+}
+
+static double fault_sqrt(double x) {
+    double r = x > 1 ? x : 1;
+    int i;
+
+    for (i = 0; i < 64; i++)
+        r = 0.5 * (r + x / r);
+    return r;
+}
+/**
+ * @brief 按配置的分布采样一次尖刺延迟, 各分布的均值都是spike_us
+ *
+ * @param dev
+ * @return long long
+ */
+static long long fault_spike_us(struct ddriver *dev) {
+    double mean = dev->fault.spike_us;
+
+    switch (dev->fault.spike_dist)
+    {
+    case DDRIVER_SPIKE_UNIFORM:
+        return 2 * mean * fault_uniform(dev);
+    case DDRIVER_SPIKE_EXP:
+        return -mean * fault_ln(fault_uniform(dev));
+    case DDRIVER_SPIKE_PARETO:
+        /* x_m / U^(1/alpha), alpha = 2时均值为2 * x_m */
+        return mean / 2 / fault_sqrt(fault_uniform(dev));
+    default:
+        return mean;
+    }
+}
+/**
+ * @brief 解析一个DDRIVER_FAULT配置项
+ *
+ * @param tok
+ * @param fault
+ * @return int
+ */
+static int fault_parse_token(char *tok, struct ddriver_fault *fault) {
+    unsigned long long num = 0, len = 0;
+    char *val = strchr(tok, '=');
+    char *sep;
+    int ret = -EINVAL, i;
+
+    if (val == NULL) {
+        user_panic("bad fault item [%s]", tok);
+        return -EINVAL;
+    }
+    *val++ = '\0';
+    if (strcmp(tok, "drop") == 0) {
+        ret = parse_size(val, &num);
+        fault->drop_after = num;
+        fault->flags |= DDRIVER_FAULT_DROP;
+    }
+    else if (strcmp(tok, "torn") == 0) {
+        ret = parse_size(val, &num);
+        fault->torn_at = num;
+        fault->flags |= DDRIVER_FAULT_TORN;
+    }
+    else if (strcmp(tok, "eio") == 0) {
+        /* eio=偏移+长度, 默认读写都出错 */
+        sep = strchr(val, '+');
+        if (sep) {
+            *sep = '\0';
+            ret = parse_size(val, &num);
+            if (ret == 0)
+                ret = parse_size(sep + 1, &len);
+            fault->eio_offset = num;
+            fault->eio_len = len;
+            if (!(fault->flags & (DDRIVER_FAULT_EIO_READ | DDRIVER_FAULT_EIO_WRITE)))
+                fault->flags |= DDRIVER_FAULT_EIO_READ | DDRIVER_FAULT_EIO_WRITE;
+            *sep = '+';
+        }
+    }
+    else if (strcmp(tok, "eio_ops") == 0) {
+        ret = 0;
+        fault->flags &= ~(DDRIVER_FAULT_EIO_READ | DDRIVER_FAULT_EIO_WRITE);
+        if (strchr(val, 'r'))
+            fault->flags |= DDRIVER_FAULT_EIO_READ;
+        if (strchr(val, 'w'))
+            fault->flags |= DDRIVER_FAULT_EIO_WRITE;
+    }
+    else if (strcmp(tok, "spike") == 0) {
+        ret = parse_size(val, &num);
+        if (num > 1000)
+            ret = -EINVAL;
+        fault->spike_permille = num;
+        fault->flags |= DDRIVER_FAULT_SPIKE;
+    }
+    else if (strcmp(tok, "spike_us") == 0) {
+        ret = parse_size(val, &num);
+        fault->spike_us = num;
+    }
+    else if (strcmp(tok, "dist") == 0) {
+        for (i = 0; i < DDRIVER_SPIKE_NR; i++) {
+            if (strcmp(val, spike_names[i]) == 0) {
+                fault->spike_dist = i;
+                ret = 0;
+            }
+        }
+    }
+    else if (strcmp(tok, "seed") == 0) {
+        ret = parse_size(val, &num);
+        fault->seed = num;
+    }
+
+    if (ret < 0)
+        user_panic("bad fault item [%s=%s]", tok, val);
+    return ret;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 设置注入配置并清零命中计数. 先关掉注入再改配置, 最后发布flags,
+ * 与之并发的IO要么看到旧的关闭状态, 要么看到完整的新配置
+ *
+ * @param dev
+ * @param cfg flags为0时关闭注入
+ * @return int
+ */
+int fault_set(struct ddriver *dev, const struct ddriver_fault *cfg) {
+    if (cfg->spike_dist < 0 || cfg->spike_dist >= DDRIVER_SPIKE_NR ||
+        cfg->spike_permille < 0 || cfg->spike_permille > 1000 || cfg->spike_us < 0 ||
+        cfg->eio_offset < 0 || cfg->eio_len < 0) {
+        user_alert(dev, "bad fault config");
+        return -EINVAL;
+    }
+
+    __atomic_store_n(&dev->fault.flags, 0, __ATOMIC_RELEASE);
+    dev->fault = *cfg;
+    dev->fault.flags = 0;
+    dev->fault.write_cnt = 0;
+    dev->fault.dropped = 0;
+    dev->fault.torn = 0;
+    dev->fault.eio = 0;
+    dev->fault.spikes = 0;
+    dev->fault_rng = cfg->seed;
+    __atomic_store_n(&dev->fault.flags, cfg->flags, __ATOMIC_RELEASE);
+    if (cfg->flags)
+        user_info(dev, "fault injection 0x%x enabled", cfg->flags);
+    return 0;
+}
+/**
+ * @brief 读回注入配置与命中计数
+ *
+ * @param dev
+ * @param out
+ */
+void fault_get(struct ddriver *dev, struct ddriver_fault *out) {
+    *out = dev->fault;
+    out->flags     = __atomic_load_n(&dev->fault.flags, __ATOMIC_ACQUIRE);
+    out->write_cnt = FAULT_READ_COUNTER(dev, write_cnt);
+    out->dropped   = FAULT_READ_COUNTER(dev, dropped);
+    out->torn      = FAULT_READ_COUNTER(dev, torn);
+    out->eio       = FAULT_READ_COUNTER(dev, eio);
+    out->spikes    = FAULT_READ_COUNTER(dev, spikes);
+}
+/**
+ * @brief 按环境变量DDRIVER_FAULT设置注入, 如"drop=100,spike=10,spike_us=5000,dist=exp"
+ *
+ * @param dev
+ * @return int 未设置时返回0
+ */
+int fault_from_env(struct ddriver *dev) {
+    struct ddriver_fault fault;
+    char *spec = getenv(ENV_FAULT);
+    char *dup, *tok, *save = NULL;
+    int ret = 0;
+
+    if (spec == NULL || *spec == '\0')
+        return 0;
+    dup = strdup(spec);
+    if (dup == NULL)
+        return -ENOMEM;
+    memset(&fault, 0, sizeof(fault));
+    for (tok = strtok_r(dup, FAULT_DELIMS, &save); tok != NULL && ret == 0;
+         tok = strtok_r(NULL, FAULT_DELIMS, &save))
+        ret = fault_parse_token(tok, &fault);
+    free(dup);
+    return ret < 0 ? ret : fault_set(dev, &fault);
+}
+/**
+ * @brief 在一次IO真正发出前决定要注入的故障: 先按概率睡一次尖刺,
+ * 再检查出错区间, 写请求最后决定丢弃或撕裂.
+ *
+ * @param dev
+ * @param is_write
+ * @param offset IO起始偏移, 小于0表示fd的当前位置
+ * @param size IO字节数
+ * @param len 返回真正要落盘的字节数: 正常为size, 丢弃为0, 撕裂时为非空的真前缀:
+ * 多扇区写为开头若干扇区, 单扇区写为扇区内的开头若干字节
+ * @return int 注入出错时返回-EIO
+ */
+int fault_inject(struct ddriver *dev, int is_write, off_t offset, size_t size, size_t *len) {
+    int flags = __atomic_load_n(&dev->fault.flags, __ATOMIC_ACQUIRE);
+    long long cnt;
+    size_t sectors;
+
+    *len = size;
+    if (flags == 0)
+        return 0;
+
+    if ((flags & DDRIVER_FAULT_SPIKE) && fault_rand(dev) % 1000 < dev->fault.spike_permille) {
+        __atomic_add_fetch(&dev->fault.spikes, 1, __ATOMIC_RELAXED);
+        usleep(fault_spike_us(dev));
+    }
+    if (flags & (is_write ? DDRIVER_FAULT_EIO_WRITE : DDRIVER_FAULT_EIO_READ)) {
+        if (offset < 0)
+            offset = lseek(dev->ddriver_fd, 0, SEEK_CUR);
+        if (offset < dev->fault.eio_offset + dev->fault.eio_len &&
+            dev->fault.eio_offset < offset + (off_t)size) {
+            __atomic_add_fetch(&dev->fault.eio, 1, __ATOMIC_RELAXED);
+            user_alert(dev, "inject EIO on [%ld, %ld)", offset, offset + size);
+            return -EIO;
+        }
+    }
+    if (!is_write)
+        return 0;
+
+    cnt = __atomic_add_fetch(&dev->fault.write_cnt, 1, __ATOMIC_RELAXED);
+    if ((flags & DDRIVER_FAULT_DROP) && cnt > dev->fault.drop_after) {
+        __atomic_add_fetch(&dev->fault.dropped, 1, __ATOMIC_RELAXED);
+        *len = 0;
+    }
+    else if ((flags & DDRIVER_FAULT_TORN) && cnt == dev->fault.torn_at) {
+        /* 落盘的前缀不能为0也不能是全部, 否则就成了丢弃或正常写:
+           多扇区写取[1, n - 1]个扇区, 单扇区写取扇区内的[1, size - 1]字节 */
+        sectors = size / DDRIVER_SECTOR_SZ;
+        if (sectors > 1)
+            *len = (1 + fault_rand(dev) % (sectors - 1)) * DDRIVER_SECTOR_SZ;
+        else if (size > 1)
+            *len = 1 + fault_rand(dev) % (size - 1);
+        else
+            *len = 0;
+        if (*len == 0) {
+            __atomic_add_fetch(&dev->fault.dropped, 1, __ATOMIC_RELAXED);
+        }
+        else {
+            __atomic_add_fetch(&dev->fault.torn, 1, __ATOMIC_RELAXED);
+            user_alert(dev, "inject torn write, %ld of %ld bytes persisted", *len, size);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,569 @@
+#include "ddriver_dev.h"
+#include <pthread.h>
+#include <libgen.h>
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define IMAGE_MAGIC             0x49434444           /* "DDCI" */
+#define IMAGE_VERSION           1
+#define IMAGE_CHUNK_SZ          (64 * 1024)          /* 不小于最大块大小, 保证块不跨分片 */
+#define IMAGE_TMP               ".tmp"               /* 写回时的临时镜像: 镜像路径 + IMAGE_TMP */
+
+#define IMAGE_CODEC_ZERO        0                    /* 全0分片, 不占空间 */
+#define IMAGE_CODEC_RAW         1                    /* 压不下去, 原样存放 */
+#define IMAGE_CODEC_LZ4         2                    /* LZ4块格式 */
+
+#define LZ4_HASH_BITS           12
+#define LZ4_MIN_MATCH           4
+#define LZ4_LAST_LITERALS       5                    /* 末尾至少这么多字节是字面量 */
+#define LZ4_MF_LIMIT            12                   /* 离末尾不足这么多字节不再找匹配 */
+#define LZ4_MAX_OFFSET          65535
+#define LZ4_BOUND(n)            ((n) + (n) / 255 + 16)
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+/*
+ * 分块压缩镜像:
+ *
+ *   | image_hdr | 分片数据 ... | image_chunk[nr_chunks] |
+ *                                ^ index_off
+ *
+ * 磁盘按chunk_size切片, 全0分片只在索引里占一项. 打开时把镜像解到同目录下
+ * 一个匿名的稀疏工作文件, 之后所有读写照常落在工作文件上; 写回时重新生成
+ * 整个镜像再rename覆盖, 内容哈希没变的分片直接拷贝旧的压缩数据.
+ */
+struct image_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t disk_size;
+    uint64_t nr_chunks;
+    uint64_t index_off;
+};
+
+struct image_chunk
+{
+    uint64_t offset;                                 /* 压缩数据在镜像中的位置 */
+    uint32_t clen;                                   /* 压缩后的字节数 */
+    uint32_t codec;                                  /* IMAGE_CODEC_* */
+    uint64_t hash;                                   /* 解压后内容的哈希 */
+};
+
+struct ddriver_image
+{
+    pthread_mutex_t     lock;
+    char                *path;
+    int                 fd;                          /* 镜像文件, 工作文件是dev->ddriver_fd */
+    uint32_t            chunk_size;
+    uint64_t            nr_chunks;
+    struct image_chunk  *index;
+    char                *buf;                        /* 一个分片 */
+    char                *cbuf;                       /* 一个分片压缩后的最坏大小 */
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint8_t *lz4_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+/**
+ * @brief 按LZ4块格式压缩, 贪心匹配, 单个哈希表
+ *
+ * @param src
+ * @param n
+ * @param dst 至少LZ4_BOUND(n)字节
+ * @return size_t 压缩后的字节数
+ */
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst) {
+    int table[1 << LZ4_HASH_BITS];
+    size_t ip = 0, anchor = 0, ref, lit, mlen;
+    uint8_t *op = dst, *token;
+    uint32_t seq, h;
+
+    memset(table, 0xff, sizeof(table));
+    while (n > LZ4_MF_LIMIT && ip < n - LZ4_MF_LIMIT) {
+        seq = read32(src + ip);
+        h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        ref = table[h];
+        table[h] = ip;
+        if (ref == (size_t)-1 || ip - ref > LZ4_MAX_OFFSET || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        for (mlen = LZ4_MIN_MATCH; ip + mlen < n - LZ4_LAST_LITERALS &&
+             src[ref + mlen] == src[ip + mlen]; mlen++)
+            ;
+
+        lit = ip - anchor;
+        token = op++;
+        *token = (lit >= 15 ? 15 : lit) << 4;
+        if (lit >= 15)
+            op = lz4_put_len(op, lit - 15);
+        memcpy(op, src + anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+        *token |= mlen - LZ4_MIN_MATCH >= 15 ? 15 : mlen - LZ4_MIN_MATCH;
+        if (mlen - LZ4_MIN_MATCH >= 15)
+            op = lz4_put_len(op, mlen - LZ4_MIN_MATCH - 15);
+        ip += mlen;
+        anchor = ip;
+    }
+
+    lit = n - anchor;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15)
+        op = lz4_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    return op + lit - dst;
+}
+/**
+ * @brief 解压LZ4块, 对损坏的输入做越界检查
+ *
+ * @param src
+ * @param n
+ * @param dst
+ * @param cap
+ * @return long 解压后的字节数, 数据损坏时返回-1
+ */
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    size_t ip = 0, op = 0, lit, mlen, off;
+    uint8_t token, b;
+
+    while (ip < n) {
+        token = src[ip++];
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > n - ip || lit > cap - op)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n)                                 /* 最后一段只有字面量 */
+            break;
+
+        if (n - ip < 2)
+            return -1;
+        off = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (off == 0 || off > op)
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= n)
+                    return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > cap - op)
+            return -1;
+        for (; mlen > 0; mlen--, op++)               /* 允许与输出重叠 */
+            dst[op] = dst[op - off];
+    }
+    return op;
+}
+/**
+ * @brief 分片内容的64位哈希, 按8字节一次混合
+ *
+ * @param buf
+ * @param len 8的倍数
+ * @return uint64_t
+ */
+static uint64_t chunk_hash(const char *buf, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len, w;
+    size_t i;
+
+    for (i = 0; i < len; i += sizeof(w)) {
+        memcpy(&w, buf + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static int chunk_is_zero(const char *buf, size_t len) {
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i < len; i += sizeof(w)) {
+        memcpy(&w, buf + i, sizeof(w));
+        if (w)
+            return 0;
+    }
+    return 1;
+}
+/**
+ * @brief 工作文件上[offset, offset + len)是否整段是洞. 不支持SEEK_DATA时返回0
+ *
+ * @param fd
+ * @param offset
+ * @param len
+ * @return int
+ */
+static int chunk_is_hole(int fd, off_t offset, size_t len) {
+    off_t data = lseek(fd, offset, SEEK_DATA);
+
+    if (data < 0)
+        return errno == ENXIO;
+    return data >= offset + (off_t)len;
+}
+
+static size_t chunk_len(struct ddriver_image *img, uint64_t idx, off_t disk_size) {
+    return MIN((off_t)img->chunk_size, disk_size - (off_t)(idx * img->chunk_size));
+}
+/**
+ * @brief 把镜像解到工作文件上, 全0分片留成洞
+ *
+ * @param dev
+ * @param img
+ * @param hdr
+ * @param wfd
+ * @return int
+ */
+static int image_load(struct ddriver *dev, struct ddriver_image *img, struct image_hdr *hdr,
+                      int wfd) {
+    struct image_chunk *chunk;
+    size_t len;
+    uint64_t i;
+    long ret;
+
+    for (i = 0; i < hdr->nr_chunks; i++) {
+        chunk = &img->index[i];
+        if (chunk->codec == IMAGE_CODEC_ZERO)
+            continue;
+        len = chunk_len(img, i, hdr->disk_size);
+        if (chunk->clen > LZ4_BOUND(img->chunk_size) ||
+            pread(img->fd, img->cbuf, chunk->clen, chunk->offset) != (ssize_t)chunk->clen) {
+            user_alert(dev, "can't read chunk %lu of image [%s]", (unsigned long)i, img->path);
+            return -EIO;
+        }
+        if (chunk->codec == IMAGE_CODEC_RAW && chunk->clen == len)
+            memcpy(img->buf, img->cbuf, len);
+        else if (chunk->codec != IMAGE_CODEC_LZ4 ||
+                 (ret = lz4_decompress((uint8_t *)img->cbuf, chunk->clen, (uint8_t *)img->buf,
+                                       img->chunk_size)) != (long)len) {
+            user_alert(dev, "chunk %lu of image [%s] is corrupted", (unsigned long)i, img->path);
+            return -EIO;
+        }
+        if (chunk_hash(img->buf, len) != chunk->hash) {
+            user_alert(dev, "chunk %lu of image [%s] fails checksum", (unsigned long)i, img->path);
+            return -EIO;
+        }
+        if (pwrite(wfd, img->buf, len, i * img->chunk_size) != (ssize_t)len)
+            return -errno;
+    }
+    return 0;
+}
+/**
+ * @brief 读入镜像头和索引. 空文件是新镜像, 索引为空
+ *
+ * @param dev
+ * @param img
+ * @param hdr
+ * @return int
+ */
+static int image_read_index(struct ddriver *dev, struct ddriver_image *img,
+                            struct image_hdr *hdr) {
+    struct stat st;
+    size_t size;
+
+    if (fstat(img->fd, &st) < 0)
+        return -errno;
+    if (st.st_size == 0) {
+        memset(hdr, 0, sizeof(*hdr));
+        return 0;
+    }
+    if (pread(img->fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) || hdr->magic != IMAGE_MAGIC ||
+        hdr->version != IMAGE_VERSION || hdr->chunk_size != IMAGE_CHUNK_SZ ||
+        hdr->nr_chunks != (hdr->disk_size + hdr->chunk_size - 1) / hdr->chunk_size ||
+        hdr->index_off + hdr->nr_chunks * sizeof(struct image_chunk) > (uint64_t)st.st_size) {
+        user_alert(dev, "bad chunked image [%s]", img->path);
+        return -EINVAL;
+    }
+    size = hdr->nr_chunks * sizeof(struct image_chunk);
+    img->index = malloc(size ? size : 1);
+    if (img->index == NULL)
+        return -ENOMEM;
+    if (pread(img->fd, img->index, size, hdr->index_off) != (ssize_t)size)
+        return -EIO;
+    img->nr_chunks = hdr->nr_chunks;
+    return 0;
+}
+/**
+ * @brief 在镜像所在目录创建匿名工作文件, 关闭后自动删除
+ *
+ * @param path 镜像路径
+ * @return int
+ */
+static int image_work_file(const char *path) {
+    char *dup = strdup(path), *tmpl;
+    int fd;
+
+    if (dup == NULL)
+        return -ENOMEM;
+    fd = open(dirname(dup), O_TMPFILE | O_RDWR, 0600);
+    free(dup);
+    if (fd >= 0 || asprintf(&tmpl, "%s.XXXXXX", path) < 0)
+        return fd >= 0 ? fd : -ENOMEM;
+    /* 不支持O_TMPFILE的文件系统退回到建好就删的临时文件 */
+    fd = mkstemp(tmpl);
+    if (fd >= 0)
+        unlink(tmpl);
+    free(tmpl);
+    return fd >= 0 ? fd : -errno;
+}
+
+static void image_free(struct ddriver_image *img) {
+    pthread_mutex_destroy(&img->lock);
+    free(img->path);
+    free(img->index);
+    free(img->buf);
+    free(img->cbuf);
+    free(img);
+}
+/**
+ * @brief 写回一个分片到新镜像的pos处: 洞或全0只记索引, 内容没变时拷贝
+ * 旧的压缩数据, 否则重新压缩, 压不下去就原样存放
+ *
+ * @param dev
+ * @param img
+ * @param i
+ * @param tfd 新镜像
+ * @param pos
+ * @param out 新的索引项
+ * @return int
+ */
+static int image_save_chunk(struct ddriver *dev, struct ddriver_image *img, uint64_t i,
+                            int tfd, off_t pos, struct image_chunk *out) {
+    size_t len = chunk_len(img, i, dev->layout_size), clen;
+    off_t offset = i * img->chunk_size;
+    struct image_chunk *old = i < img->nr_chunks ? &img->index[i] : NULL;
+    const char *data;
+
+    memset(out, 0, sizeof(*out));
+    if (chunk_is_hole(dev->ddriver_fd, offset, len))
+        return 0;
+    if (pread(dev->ddriver_fd, img->buf, len, offset) != (ssize_t)len)
+        return -EIO;
+    if (chunk_is_zero(img->buf, len))
+        return 0;
+
+    out->hash = chunk_hash(img->buf, len);
+    out->offset = pos;
+    if (old && old->codec != IMAGE_CODEC_ZERO && old->hash == out->hash &&
+        (old->codec != IMAGE_CODEC_RAW || old->clen == len) &&
+        pread(img->fd, img->cbuf, old->clen, old->offset) == (ssize_t)old->clen) {
+        out->codec = old->codec;
+        out->clen = old->clen;
+        data = img->cbuf;
+    }
+    else {
+        clen = lz4_compress((uint8_t *)img->buf, len, (uint8_t *)img->cbuf);
+        out->codec = clen < len ? IMAGE_CODEC_LZ4 : IMAGE_CODEC_RAW;
+        out->clen = clen < len ? clen : len;
+        data = clen < len ? img->cbuf : img->buf;
+    }
+    return pwrite(tfd, data, out->clen, pos) == (ssize_t)out->clen ? 0 : -EIO;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 是否按分块压缩镜像打开: 文件以镜像头开始, 或配置要求且文件为空
+ *
+ * @param fd
+ * @param st
+ * @param profile
+ * @return int
+ */
+int image_probe(int fd, const struct stat *st, const struct ddriver_profile *profile) {
+    uint32_t magic;
+
+    if (!S_ISREG(st->st_mode))
+        return 0;
+    if (st->st_size == 0)
+        return !!(profile->flags & DDRIVER_PROFILE_CHUNKED);
+    return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == IMAGE_MAGIC;
+}
+/**
+ * @brief 打开分块压缩镜像: 解到工作文件后, 设备的读写都落在工作文件上.
+ * 新镜像立刻写出一份空镜像, 下次打开时不用再指定格式.
+ *
+ * @param dev layout_size已按配置设置好
+ * @param fd 镜像文件, 成功后归dev所有
+ * @param path
+ * @return int 工作文件的描述符
+ */
+int image_open(struct ddriver *dev, int fd, const char *path) {
+    struct ddriver_image *img = calloc(1, sizeof(struct ddriver_image));
+    struct image_hdr hdr;
+    int wfd = -1, ret;
+
+    if (img == NULL)
+        return -ENOMEM;
+    pthread_mutex_init(&img->lock, NULL);
+    img->fd = fd;
+    img->chunk_size = IMAGE_CHUNK_SZ;
+    img->path = strdup(path);
+    img->buf = malloc(IMAGE_CHUNK_SZ);
+    img->cbuf = malloc(LZ4_BOUND(IMAGE_CHUNK_SZ));
+    if (img->path == NULL || img->buf == NULL || img->cbuf == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    ret = image_read_index(dev, img, &hdr);
+    if (ret < 0)
+        goto err;
+    if (hdr.disk_size % dev->iounit_size) {
+        ret = -EINVAL;
+        goto err;
+    }
+    /* 配置的磁盘比镜像小时保留镜像的大小, 不丢数据 */
+    if ((long long)hdr.disk_size > dev->layout_size)
+        dev->layout_size = hdr.disk_size;
+
+    ret = wfd = image_work_file(path);
+    if (ret < 0)
+        goto err;
+    if (wfd >= DEVICE_MAX_FD) {
+        ret = -EMFILE;
+        goto err;
+    }
+    if (ftruncate(wfd, dev->layout_size) < 0) {
+        ret = -errno;
+        goto err;
+    }
+    ret = image_load(dev, img, &hdr, wfd);
+    if (ret < 0)
+        goto err;
+
+    dev->image = img;
+    dev->ddriver_fd = wfd;
+    if (hdr.magic == 0)
+        image_sync(dev);
+    user_info(dev, "chunked image %s: %lu chunks of %u bytes", path,
+              (unsigned long)img->nr_chunks, img->chunk_size);
+    return wfd;
+
+err:
+    user_panic("can't open chunked image [%s]: %s", path, strerror(-ret));
+    if (wfd >= 0)
+        close(wfd);
+    image_free(img);
+    return ret;
+}
+/**
+ * @brief 把工作文件写回镜像: 先写到临时文件, fsync后rename覆盖旧镜像,
+ * 中途失败时旧镜像保持完整. 不是分块镜像时什么也不做
+ *
+ * @param dev
+ * @return int
+ */
+int image_sync(struct ddriver *dev) {
+    struct ddriver_image *img = dev->image;
+    struct image_chunk *index;
+    struct image_hdr hdr = {
+        .magic      = IMAGE_MAGIC,
+        .version    = IMAGE_VERSION,
+        .chunk_size = IMAGE_CHUNK_SZ,
+        .disk_size  = dev->layout_size,
+    };
+    uint64_t i, stored = 0;
+    char *tmp = NULL;
+    off_t pos = sizeof(hdr), head;
+    int tfd = -1, ret = 0;
+
+    if (img == NULL)
+        return 0;
+    if (dev->map)
+        msync(dev->map, dev->layout_size, MS_SYNC);
+    hdr.nr_chunks = (hdr.disk_size + img->chunk_size - 1) / img->chunk_size;
+    index = malloc(hdr.nr_chunks * sizeof(struct image_chunk));
+    if (index == NULL || asprintf(&tmp, "%s" IMAGE_TMP, img->path) < 0) {
+        free(index);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&img->lock);
+    /* 找洞用的SEEK_DATA会移动文件位置, 也就是ddriver_read/ddriver_write的磁头 */
+    head = lseek(dev->ddriver_fd, 0, SEEK_CUR);
+    tfd = open(tmp, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (tfd < 0) {
+        ret = -errno;
+        goto out;
+    }
+    for (i = 0; i < hdr.nr_chunks && ret == 0; i++) {
+        ret = image_save_chunk(dev, img, i, tfd, pos, &index[i]);
+        pos += index[i].clen;
+        stored += index[i].codec != IMAGE_CODEC_ZERO;
+    }
+    hdr.index_off = pos;
+    if (ret == 0 &&
+        (pwrite(tfd, index, hdr.nr_chunks * sizeof(struct image_chunk), pos) !=
+             (ssize_t)(hdr.nr_chunks * sizeof(struct image_chunk)) ||
+         pwrite(tfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(tfd) < 0))
+        ret = -EIO;
+    if (ret == 0 && rename(tmp, img->path) < 0)
+        ret = -errno;
+    if (ret < 0) {
+        user_alert(dev, "can't write back image [%s]: %s", img->path, strerror(-ret));
+        close(tfd);
+        unlink(tmp);
+        goto out;
+    }
+
+    close(img->fd);
+    img->fd = tfd;
+    free(img->index);
+    img->index = index;
+    img->nr_chunks = hdr.nr_chunks;
+    index = NULL;
+    user_info(dev, "image %s written back, %lu of %lu chunks stored in %ld bytes", img->path,
+              (unsigned long)stored, (unsigned long)hdr.nr_chunks,
+              (long)(pos + hdr.nr_chunks * sizeof(struct image_chunk)));
+out:
+    lseek(dev->ddriver_fd, head, SEEK_SET);
+    pthread_mutex_unlock(&img->lock);
+    free(index);
+    free(tmp);
+    return ret;
+}
+/**
+ * @brief 写回并关闭镜像, 之后由调用者关闭工作文件
+ *
+ * @param dev
+ * @return int
+ */
+int image_close(struct ddriver *dev) {
+    struct ddriver_image *img = dev->image;
+    int ret;
+
+    if (img == NULL)
+        return 0;
+    ret = image_sync(dev);
+    dev->image = NULL;
+    close(img->fd);
+    image_free(img);
+    return ret;
+}
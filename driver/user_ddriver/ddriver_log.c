@@ -0,0 +1,164 @@
+#include "ddriver_dev.h"
+#include <pthread.h>
+#include <stdarg.h>
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define LOG_RING_MASK(idx)      ((idx) & (LOG_RING_SZ - 1))
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+/*
+ * 多生产者单消费者的有界环形队列, 每个槽位带序号:
+ *
+ *   seq == pos              槽位空闲, 等待第pos条日志
+ *   seq == pos + 1          第pos条日志已写好, 等待刷出
+ *   seq == pos + RING_SZ    已刷出, 留给下一圈的第pos + RING_SZ条
+ *
+ * 生产者只用一次CAS抢下标, 写好后发布序号, 队列满时丢弃并计数, 从不阻塞;
+ * 刷出由后台线程或log_flush在log_lock下完成.
+ */
+struct log_entry
+{
+    unsigned  seq;
+    int       level;
+    FILE      *log;                                  /* 设备日志, NULL时只打印 */
+    char      msg[LOG_MSG_SZ];
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+int log_level = LOG_INFO;
+
+static const char *log_prefix[LOG_LEVEL_NR] = { USER_PANIC, USER_ALERT, USER_INFO };
+static const char *log_names[LOG_LEVEL_NR]  = { "panic", "alert", "info" };
+static struct log_entry log_ring[LOG_RING_SZ];
+static unsigned log_tail;                            /* 下一个要抢的下标 */
+static unsigned log_head;                            /* 下一个要刷出的下标, 持log_lock访问 */
+static unsigned log_dropped;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief 解析DDRIVER_LOG_LEVEL: panic/alert/info或0~2, off或-1关闭全部日志
+ *
+ * @param val
+ * @return int
+ */
+static int log_parse_level(const char *val) {
+    int level;
+
+    if (strcmp(val, "off") == 0)
+        return -1;
+    for (level = 0; level < LOG_LEVEL_NR; level++) {
+        if (strcasecmp(val, log_names[level]) == 0)
+            return level;
+    }
+    level = atoi(val);
+    return level < -1 ? -1 : MIN(level, LOG_LEVEL_NR - 1);
+}
+/**
+ * @brief 后台刷出线程: 周期性地把队列中的日志写到stdout和各设备的日志
+ *
+ * @param arg
+ * @return void*
+ */
+static void *log_flusher(void *arg) {
+    IGNORE_ARG(arg);
+    while (1) {
+        usleep(LOG_FLUSH_US);
+        log_flush();
+    }
+    return NULL;
+}
+
+static void log_init(void) {
+    char *val = getenv(ENV_LOG_LEVEL);
+    pthread_t flusher;
+    unsigned i;
+
+    if (val != NULL && *val != '\0')
+        __atomic_store_n(&log_level, log_parse_level(val), __ATOMIC_RELAXED);
+    for (i = 0; i < LOG_RING_SZ; i++)
+        log_ring[i].seq = i;
+    if (pthread_create(&flusher, NULL, log_flusher, NULL) == 0)
+        pthread_detach(flusher);
+    /* 进程退出前刷出还在队列里的日志 */
+    atexit(log_flush);
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 格式化一条日志放入队列, 不做任何IO. 队列满时丢弃
+ *
+ * @param dev 为NULL时只打印到stdout
+ * @param level LOG_*
+ * @param fmt
+ * @param ...
+ */
+void log_emit(struct ddriver *dev, int level, const char *fmt, ...) {
+    struct log_entry *entry;
+    unsigned pos, seq;
+    int saved = errno;
+    va_list ap;
+
+    pthread_once(&log_once, log_init);
+    if (level > __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+        return;
+
+    pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+    while (1) {
+        entry = &log_ring[LOG_RING_MASK(pos)];
+        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if ((int)(seq - pos) < 0) {             /* 上一圈还没刷出 */
+            __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+            errno = saved;
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    entry->level = level;
+    entry->log = dev ? dev->log : NULL;
+    va_start(ap, fmt);
+    vsnprintf(entry->msg, LOG_MSG_SZ, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&entry->seq, pos + 1, __ATOMIC_RELEASE);
+    errno = saved;
+}
+/**
+ * @brief 刷出队列中所有已写好的日志. 关闭设备日志前必须调用,
+ * 否则队列里可能还留着指向它的日志
+ */
+void log_flush(void) {
+    struct log_entry *entry;
+    unsigned dropped;
+
+    pthread_once(&log_once, log_init);
+    pthread_mutex_lock(&log_lock);
+    while (1) {
+        entry = &log_ring[LOG_RING_MASK(log_head)];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+            break;
+        printf("%s" DEVICE_NAME " %s\n", log_prefix[entry->level], entry->msg);
+        if (entry->log)
+            fprintf(entry->log, "%s%s\n", log_prefix[entry->level], entry->msg);
+        __atomic_store_n(&entry->seq, log_head + LOG_RING_SZ, __ATOMIC_RELEASE);
+        log_head++;
+    }
+    dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        printf(USER_ALERT DEVICE_NAME " %u log messages dropped\n", dropped);
+    fflush(stdout);
+    pthread_mutex_unlock(&log_lock);
+}
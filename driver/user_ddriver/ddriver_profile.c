@@ -0,0 +1,303 @@
+#include "ddriver_dev.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define PROFILE_DELIMS          ", \t\r\n;"
+#define PROFILE_MAX_BLOCK_SZ    (64 * 1024)
+#define PROFILE_LINE_SZ         256
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+struct profile_preset
+{
+    const char             *name;
+    struct ddriver_profile profile;
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+/* 预设只描述几何与延迟, 磁盘大小默认都是CONFIG_DISK_SZ, 由size=覆盖 */
+static const struct profile_preset presets[] = {
+    {   /* 与原来编译期写死的参数一致 */
+        .name = "default",
+        .profile = {
+            .disk_size    = CONFIG_DISK_SZ,
+            .block_size   = CONFIG_BLOCK_SZ,
+            .track_num    = 100,
+            .read_lat_us  = 2000,
+            .write_lat_us = 1000,
+            .seek_lat_us  = 4000,
+        },
+    },
+    {   /* 7200rpm机械盘: 转一圈8.33ms */
+        .name = "hdd",
+        .profile = {
+            .disk_size    = CONFIG_DISK_SZ,
+            .block_size   = 512,
+            .track_num    = 1000,
+            .read_lat_us  = 4000,
+            .write_lat_us = 4500,
+            .seek_lat_us  = 8333,
+        },
+    },
+    {   /* 固态盘: 4KiB扇区, 没有寻道与旋转延迟 */
+        .name = "ssd",
+        .profile = {
+            .disk_size    = CONFIG_DISK_SZ,
+            .block_size   = 4096,
+            .track_num    = 1,
+            .read_lat_us  = 80,
+            .write_lat_us = 20,
+            .seek_lat_us  = 0,
+        },
+    },
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief 解析带K/M/G后缀(以1024为底)的非负整数
+ *
+ * @param val
+ * @param out
+ * @return int
+ */
+int parse_size(const char *val, unsigned long long *out) {
+    unsigned long long num;
+    char *end;
+
+    if (*val == '\0' || *val == '-')
+        return -EINVAL;
+    errno = 0;
+    num = strtoull(val, &end, 0);
+    if (errno)
+        return -EINVAL;
+    switch (*end)
+    {
+    case 'g': case 'G': num <<= 10;     /* fall through */
+    case 'm': case 'M': num <<= 10;     /* fall through */
+    case 'k': case 'K': num <<= 10; end++; break;
+    default: break;
+    }
+    if (*end == 'i' || *end == 'B')     /* 允许64MiB, 64MB */
+        end++;
+    if (*end == 'B')
+        end++;
+    if (*end != '\0')
+        return -EINVAL;
+    *out = num;
+    return 0;
+}
+
+static int parse_u32(const char *val, uint32_t *out) {
+    unsigned long long num;
+    int ret = parse_size(val, &num);
+
+    if (ret < 0 || num > UINT32_MAX)
+        return -EINVAL;
+    *out = num;
+    return 0;
+}
+
+static int parse_flag(const char *val, uint32_t *flags, uint32_t flag, int set_on_true) {
+    unsigned long long num;
+
+    if (parse_size(val, &num) < 0)
+        return -EINVAL;
+    if (!!num == set_on_true)
+        *flags |= flag;
+    else
+        *flags &= ~flag;
+    return 0;
+}
+
+static const struct ddriver_profile *find_preset(const char *name) {
+    size_t i;
+
+    for (i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+        if (strcmp(presets[i].name, name) == 0)
+            return &presets[i].profile;
+    }
+    return NULL;
+}
+/**
+ * @brief 解析一个配置项: 预设名(整体替换当前配置)或key=value
+ *
+ * @param tok
+ * @param profile
+ * @return int
+ */
+static int parse_token(char *tok, struct ddriver_profile *profile) {
+    const struct ddriver_profile *preset;
+    unsigned long long size;
+    char *val = strchr(tok, '=');
+    int ret = -EINVAL;
+
+    if (val == NULL) {
+        preset = find_preset(tok);
+        if (preset == NULL) {
+            user_panic("unknown profile preset [%s]", tok);
+            return -EINVAL;
+        }
+        *profile = *preset;
+        return 0;
+    }
+
+    *val++ = '\0';
+    if (strcmp(tok, "size") == 0) {
+        ret = parse_size(val, &size);
+        profile->disk_size = size;
+    }
+    else if (strcmp(tok, "block") == 0)
+        ret = parse_u32(val, &profile->block_size);
+    else if (strcmp(tok, "tracks") == 0)
+        ret = parse_u32(val, &profile->track_num);
+    else if (strcmp(tok, "read_lat") == 0)
+        ret = parse_u32(val, &profile->read_lat_us);
+    else if (strcmp(tok, "write_lat") == 0)
+        ret = parse_u32(val, &profile->write_lat_us);
+    else if (strcmp(tok, "seek_lat") == 0)
+        ret = parse_u32(val, &profile->seek_lat_us);
+    else if (strcmp(tok, "mmap") == 0)
+        ret = parse_flag(val, &profile->flags, DDRIVER_PROFILE_MMAP, 1);
+    else if (strcmp(tok, "latency") == 0)
+        ret = parse_flag(val, &profile->flags, DDRIVER_PROFILE_NO_LATENCY, 0);
+    else if (strcmp(tok, "chunked") == 0)
+        ret = parse_flag(val, &profile->flags, DDRIVER_PROFILE_CHUNKED, 1);
+    else if (strcmp(tok, "cache") == 0) {
+        ret = parse_size(val, &size);
+        profile->cache_size = size;
+    }
+    else if (strcmp(tok, "flush_ms") == 0)
+        ret = parse_u32(val, &profile->flush_ms);
+
+    if (ret < 0)
+        user_panic("bad profile item [%s=%s]", tok, val);
+    return ret;
+}
+
+static int parse_spec(char *spec, struct ddriver_profile *profile) {
+    char *save = NULL;
+    char *tok;
+    int ret;
+
+    for (tok = strtok_r(spec, PROFILE_DELIMS, &save); tok != NULL;
+         tok = strtok_r(NULL, PROFILE_DELIMS, &save)) {
+        ret = parse_token(tok, profile);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+/**
+ * @brief 配置文件: 每行若干配置项, #之后为注释
+ *
+ * @param path
+ * @param profile
+ * @return int
+ */
+static int parse_file(const char *path, struct ddriver_profile *profile) {
+    char line[PROFILE_LINE_SZ];
+    FILE *fp = fopen(path, "r");
+    char *comment;
+    int ret = 0;
+
+    if (fp == NULL) {
+        ret = -errno;
+        user_panic("can't open profile [%s]: %s", path, strerror(-ret));
+        return ret;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        ret = parse_spec(line, profile);
+    }
+    fclose(fp);
+    return ret;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 校验配置是否能描述一个合法的磁盘
+ *
+ * @param profile
+ * @return int
+ */
+int profile_check(const struct ddriver_profile *profile) {
+    uint32_t bsz = profile->block_size;
+
+    if (bsz < CONFIG_BLOCK_SZ || bsz > PROFILE_MAX_BLOCK_SZ || (bsz & (bsz - 1))) {
+        user_panic("block size %u should be a power of 2 in [%d, %d]",
+                   bsz, CONFIG_BLOCK_SZ, PROFILE_MAX_BLOCK_SZ);
+        return -EINVAL;
+    }
+    if (profile->disk_size < bsz || profile->disk_size % bsz ||
+        profile->disk_size > (uint64_t)LLONG_MAX) {
+        user_panic("disk size %llu should be a positive multiple of block size %u",
+                   (unsigned long long)profile->disk_size, bsz);
+        return -EINVAL;
+    }
+    if (profile->track_num == 0 || profile->track_num > profile->disk_size) {
+        user_panic("track number %u should be in [1, %llu]",
+                   profile->track_num, (unsigned long long)profile->disk_size);
+        return -EINVAL;
+    }
+    if (profile->cache_size % bsz || profile->cache_size > profile->disk_size) {
+        user_panic("cache size %llu should be a multiple of block size %u within the disk",
+                   (unsigned long long)profile->cache_size, bsz);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 不指定配置打开设备时使用的配置: 默认预设, 再依次叠加
+ * DDRIVER_PROFILE和旧的DDRIVER_MMAP/DDRIVER_LATENCY开关
+ *
+ * @param profile
+ * @return int
+ */
+int profile_from_env(struct ddriver_profile *profile) {
+    const char *spec = getenv(DDRIVER_PROFILE_ENV);
+    int ret;
+
+    *profile = presets[0].profile;
+    if (spec != NULL && *spec != '\0') {
+        ret = ddriver_profile_parse(spec, profile);
+        if (ret < 0)
+            return ret;
+    }
+    if (env_enabled(ENV_MMAP, profile->flags & DDRIVER_PROFILE_MMAP))
+        profile->flags |= DDRIVER_PROFILE_MMAP;
+    else
+        profile->flags &= ~DDRIVER_PROFILE_MMAP;
+    if (env_enabled(ENV_LATENCY, !(profile->flags & DDRIVER_PROFILE_NO_LATENCY)))
+        profile->flags &= ~DDRIVER_PROFILE_NO_LATENCY;
+    else
+        profile->flags |= DDRIVER_PROFILE_NO_LATENCY;
+    return 0;
+}
+/**
+ * @brief 在profile的基础上叠加spec描述的配置.
+ * spec是以逗号/空白分隔的配置项, 例如"ssd,size=1G,mmap=1";
+ * 含'/'时视为配置文件路径.
+ *
+ * @param spec
+ * @param profile
+ * @return int
+ */
+int ddriver_profile_parse(const char *spec, struct ddriver_profile *profile) {
+    char *dup;
+    int ret;
+
+    if (strchr(spec, '/'))
+        return parse_file(spec, profile);
+
+    dup = strdup(spec);
+    if (dup == NULL)
+        return -ENOMEM;
+    ret = parse_spec(dup, profile);
+    free(dup);
+    return ret;
+}
@@ -0,0 +1,418 @@
+#include "ddriver_dev.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define RING_MAX_ENTRIES        4096
+#define RING_MASK(ring, idx)    ((idx) & ((ring)->sq_entries - 1))
+#define RING_CQ_MASK(ring, idx) ((idx) & ((ring)->cq_entries - 1))
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+/*
+ * 提交队列与完成队列都是环形数组, 下标只增不减, 用掩码取模.
+ *
+ *   sq_head <= sq_tail <= sq_local
+ *   [sq_head, sq_tail)  已提交, 等待设备线程取走
+ *   [sq_tail, sq_local) 已取出但未提交(用户正在填)
+ *
+ * 完成队列的深度是提交队列的两倍, 且在途请求数(inflight)加上未提交的
+ * 请求数不超过完成队列深度, 所以设备线程写完成项时永远不会溢出.
+ *
+ * 设备线程取走的一批请求先交给设备当前的调度器(dev->sched)重排再执行,
+ * 因此同一批内的请求之间没有顺序保证.
+ */
+struct ddriver_ring
+{
+    struct ddriver      *dev;
+    int                 fd;
+    unsigned            flags;
+    unsigned            sq_entries;
+    unsigned            cq_entries;
+    struct ddriver_sqe  *sqes;
+    struct ddriver_cqe  *cqes;
+    long long           *sq_time;                    /* 每个提交项的提交时刻 */
+    struct ddriver_sched_rq *batch;                  /* 设备线程私有的一批请求 */
+    struct ddriver_cqe  *done;                       /* 设备线程私有的一批结果 */
+    unsigned            sq_head;
+    unsigned            sq_tail;
+    unsigned            sq_local;
+    unsigned            cq_head;
+    unsigned            cq_tail;
+    unsigned            inflight;                    /* 已提交但未被收割 */
+    off_t               head;                        /* 设备线程模拟的磁头位置 */
+    int                 event_fd;
+    int                 stop;
+    pthread_t           worker;
+    pthread_mutex_t     lock;
+    pthread_cond_t      sq_cond;
+    pthread_cond_t      cq_cond;
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief 执行一个请求, 返回结果和该请求的模拟延迟
+ *
+ * @param ring
+ * @param sqe
+ * @param lat_us 该请求的模拟延迟
+ * @return int
+ */
+static int ring_exec(struct ddriver_ring *ring, struct ddriver_sqe *sqe, int sched, long *lat_us) {
+    struct ddriver *dev = ring->dev;
+    struct iovec iov;
+    ssize_t ret;
+    size_t len;
+    long lat;
+    int res;
+
+    *lat_us = 0;
+    switch (sqe->opcode)
+    {
+    case DDRIVER_OP_NOP:
+        return 0;
+    case DDRIVER_OP_SEEK:
+        if (!IS_ADDR_ALIGN(dev, sqe->offset) || sqe->offset < 0 ||
+            sqe->offset > dev->layout_size) {
+            user_alert(dev, "ring seek to %ld is invalid", sqe->offset);
+            return -EINVAL;
+        }
+        trace_record(dev, DDRIVER_OP_SEEK, sqe->offset, 0);
+        INC_SEEKCNT(dev);
+        lat = rotate_lat_us(dev, ring->head, sqe->offset);
+        sched_account_seek(dev, sched, ring->head, sqe->offset, lat);
+        stat_account_seek(dev, ring->head, sqe->offset, lat);
+        *lat_us += lat;
+        ring->head = sqe->offset;
+        return sqe->offset;
+    case DDRIVER_OP_READ:
+    case DDRIVER_OP_WRITE:
+        res = check_range_valid(dev, sqe->offset, sqe->size);
+        if (res < 0)
+            return res;
+        trace_record(dev, sqe->opcode, sqe->offset, sqe->size);
+        res = fault_inject(dev, sqe->opcode == DDRIVER_OP_WRITE, sqe->offset, sqe->size, &len);
+        if (res < 0)
+            return res;
+        iov.iov_base = sqe->buf;
+        iov.iov_len = sqe->size;
+        if (len < sqe->size)                         /* 注入的故障绕过缓存, 见cache_try */
+            cache_writeback(dev, sqe->offset, sqe->size);
+        else if (dev->cache &&
+                 cache_rw(dev, &iov, 1, sqe->offset, sqe->size, sqe->opcode == DDRIVER_OP_WRITE))
+            goto cached;
+        lat = rotate_lat_us(dev, ring->head, sqe->offset);
+        sched_account_seek(dev, sched, ring->head, sqe->offset, lat);
+        stat_account_seek(dev, ring->head, sqe->offset, 0);
+        *lat_us += lat;
+        *lat_us += transfer_lat_us(dev, sqe->size - dev->iounit_size);
+        if (sqe->opcode == DDRIVER_OP_WRITE) {
+            *lat_us += dev->write_lat;
+            ret = pwrite(ring->fd, sqe->buf, len, sqe->offset);
+        }
+        else {
+            *lat_us += dev->read_lat;
+            ret = pread(ring->fd, sqe->buf, sqe->size, sqe->offset);
+        }
+        if (ret != (ssize_t)len) {
+            user_alert(dev, "ring %s [%ld, %ld) returns %ld",
+                       sqe->opcode == DDRIVER_OP_WRITE ? "write" : "read",
+                       sqe->offset, sqe->offset + sqe->size, ret);
+            return -EIO;
+        }
+        ring->head = sqe->offset + sqe->size;
+cached:
+        if (sqe->opcode == DDRIVER_OP_WRITE)
+            ADD_WRITECNT(dev, sqe->size / dev->iounit_size);
+        else
+            ADD_READCNT(dev, sqe->size / dev->iounit_size);
+        return sqe->size;
+    default:
+        user_alert(dev, "ring opcode %d is unsupported", sqe->opcode);
+        return -EINVAL;
+    }
+}
+/**
+ * @brief 设备线程: 每次取走全部已提交的请求作为一批, 经调度器重排后
+ * 依次执行, 只睡一次整批的模拟延迟, 再一起放入完成队列.
+ *
+ * @param arg
+ * @return void*
+ */
+static void *ring_worker(void *arg) {
+    struct ddriver_ring *ring = (struct ddriver_ring *)arg;
+    struct ddriver *dev = ring->dev;
+    struct ddriver_sched_state *stat;
+    unsigned nr, i, idx;
+    struct ddriver_sched_rq *rq;
+    long long done_us;
+    uint64_t cnt;
+    long lat_us;
+    int sched;
+
+    pthread_mutex_lock(&ring->lock);
+    while (1) {
+        while (!ring->stop && ring->sq_head == ring->sq_tail)
+            pthread_cond_wait(&ring->sq_cond, &ring->lock);
+        if (ring->sq_head == ring->sq_tail)         /* stop且已排空 */
+            break;
+
+        nr = ring->sq_tail - ring->sq_head;
+        for (i = 0; i < nr; i++) {
+            idx = RING_MASK(ring, ring->sq_head + i);
+            ring->batch[i].sqe       = ring->sqes[idx];
+            ring->batch[i].submit_us = ring->sq_time[idx];
+            ring->batch[i].seq       = i;
+        }
+        ring->sq_head = ring->sq_tail;
+        pthread_mutex_unlock(&ring->lock);
+
+        sched = __atomic_load_n(&dev->sched, __ATOMIC_RELAXED);
+        stat = &dev->sched_stat[sched];
+        ddriver_scheds[sched].dispatch(dev, ring->batch, nr, ring->head, now_us(), stat);
+        __atomic_add_fetch(&stat->dispatch_cnt, nr, __ATOMIC_RELAXED);
+
+        lat_us = 0;
+        for (i = 0; i < nr; i++) {
+            if (ring->batch[i].seq != i)
+                __atomic_add_fetch(&stat->reorder_cnt, 1, __ATOMIC_RELAXED);
+            ring->done[i].user_data = ring->batch[i].sqe.user_data;
+            ring->done[i].res = ring_exec(ring, &ring->batch[i].sqe, sched,
+                                          &ring->batch[i].model_us);
+            lat_us += ring->batch[i].model_us;
+        }
+        if (lat_us > 0 && dev->emulate)
+            usleep(lat_us);
+
+        /* 实际耗时从提交算起, 包含排队和整批的等待 */
+        done_us = now_us();
+        for (i = 0; i < nr; i++) {
+            rq = &ring->batch[i];
+            if (ring->done[i].res >= 0 && (rq->sqe.opcode == DDRIVER_OP_READ ||
+                                           rq->sqe.opcode == DDRIVER_OP_WRITE))
+                stat_account_io(dev, rq->sqe.opcode == DDRIVER_OP_WRITE, rq->sqe.size,
+                                rq->model_us, done_us - rq->submit_us);
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        for (i = 0; i < nr; i++)
+            ring->cqes[RING_CQ_MASK(ring, ring->cq_tail++)] = ring->done[i];
+        pthread_cond_broadcast(&ring->cq_cond);
+        if (ring->event_fd >= 0) {
+            cnt = nr;
+            if (write(ring->event_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+                user_alert(dev, "ring eventfd notify failed: %s", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+/**
+ * @brief 收割一个完成项, 调用者持有锁
+ *
+ * @param ring
+ * @param cqe
+ */
+static void ring_reap(struct ddriver_ring *ring, struct ddriver_cqe *cqe) {
+    *cqe = ring->cqes[RING_CQ_MASK(ring, ring->cq_head++)];
+    ring->inflight--;
+}
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 建立异步队列
+ *
+ * @param fd
+ * @param entries
+ * @param flags
+ * @param ring
+ * @return int
+ */
+int ddriver_ring_init(int fd, unsigned entries, unsigned flags, struct ddriver_ring **ring) {
+    struct ddriver *dev = ddriver_get(fd);
+    struct ddriver_ring *r;
+    unsigned sq_entries = 1;
+    int ret;
+
+    if (dev == NULL)
+        return -EBADF;
+    if (entries == 0 || entries > RING_MAX_ENTRIES) {
+        user_alert(dev, "ring entries %u should be in [1, %d]", entries, RING_MAX_ENTRIES);
+        return -EINVAL;
+    }
+    while (sq_entries < entries)
+        sq_entries <<= 1;
+
+    r = (struct ddriver_ring *)calloc(1, sizeof(struct ddriver_ring));
+    if (r == NULL)
+        return -ENOMEM;
+    r->dev        = dev;
+    r->fd         = fd;
+    r->flags      = flags;
+    r->sq_entries = sq_entries;
+    r->cq_entries = sq_entries * 2;
+    r->sqes       = (struct ddriver_sqe *)calloc(r->sq_entries, sizeof(struct ddriver_sqe));
+    r->sq_time    = (long long *)calloc(r->sq_entries, sizeof(long long));
+    r->batch      = (struct ddriver_sched_rq *)calloc(r->sq_entries, sizeof(struct ddriver_sched_rq));
+    r->cqes       = (struct ddriver_cqe *)calloc(r->cq_entries, sizeof(struct ddriver_cqe));
+    r->done       = (struct ddriver_cqe *)calloc(r->sq_entries, sizeof(struct ddriver_cqe));
+    r->head       = lseek(fd, 0, SEEK_CUR);
+    r->event_fd   = -1;
+    if (!r->sqes || !r->sq_time || !r->batch || !r->cqes || !r->done) {
+        ret = -ENOMEM;
+        goto err_free;
+    }
+    if (flags & DDRIVER_RING_EVENTFD) {
+        r->event_fd = eventfd(0, EFD_CLOEXEC);
+        if (r->event_fd < 0) {
+            ret = -errno;
+            goto err_free;
+        }
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->sq_cond, NULL);
+    pthread_cond_init(&r->cq_cond, NULL);
+    ret = pthread_create(&r->worker, NULL, ring_worker, r);
+    if (ret != 0) {
+        ret = -ret;
+        goto err_destroy;
+    }
+
+    *ring = r;
+    return 0;
+
+err_destroy:
+    pthread_cond_destroy(&r->cq_cond);
+    pthread_cond_destroy(&r->sq_cond);
+    pthread_mutex_destroy(&r->lock);
+    if (r->event_fd >= 0)
+        close(r->event_fd);
+err_free:
+    free(r->done);
+    free(r->cqes);
+    free(r->batch);
+    free(r->sq_time);
+    free(r->sqes);
+    free(r);
+    return ret;
+}
+/**
+ * @brief 取一个空闲的提交队列项
+ *
+ * @param ring
+ * @return struct ddriver_sqe*
+ */
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring) {
+    struct ddriver_sqe *sqe = NULL;
+    unsigned pending;
+
+    pthread_mutex_lock(&ring->lock);
+    pending = ring->sq_local - ring->sq_tail;
+    if (ring->sq_local - ring->sq_head < ring->sq_entries &&
+        ring->inflight + pending < ring->cq_entries) {
+        sqe = &ring->sqes[RING_MASK(ring, ring->sq_local++)];
+        memset(sqe, 0, sizeof(struct ddriver_sqe));
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return sqe;
+}
+/**
+ * @brief 提交已填好的请求
+ *
+ * @param ring
+ * @return int
+ */
+int ddriver_ring_submit(struct ddriver_ring *ring) {
+    long long now = now_us();
+    unsigned nr, i;
+
+    pthread_mutex_lock(&ring->lock);
+    nr = ring->sq_local - ring->sq_tail;
+    if (nr > 0) {
+        for (i = ring->sq_tail; i != ring->sq_local; i++)
+            ring->sq_time[RING_MASK(ring, i)] = now;
+        ring->sq_tail = ring->sq_local;
+        ring->inflight += nr;
+        pthread_cond_signal(&ring->sq_cond);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return nr;
+}
+/**
+ * @brief 非阻塞收割
+ *
+ * @param ring
+ * @param cqe
+ * @return int
+ */
+int ddriver_ring_peek_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe) {
+    int ret = -EAGAIN;
+
+    pthread_mutex_lock(&ring->lock);
+    if (ring->cq_head != ring->cq_tail) {
+        ring_reap(ring, cqe);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+/**
+ * @brief 阻塞收割
+ *
+ * @param ring
+ * @param cqe
+ * @return int
+ */
+int ddriver_ring_wait_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe) {
+    int ret = -EAGAIN;
+
+    pthread_mutex_lock(&ring->lock);
+    while (ring->cq_head == ring->cq_tail && ring->inflight > 0)
+        pthread_cond_wait(&ring->cq_cond, &ring->lock);
+    if (ring->cq_head != ring->cq_tail) {
+        ring_reap(ring, cqe);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+/**
+ * @brief 完成通知用的eventfd
+ *
+ * @param ring
+ * @return int
+ */
+int ddriver_ring_eventfd(struct ddriver_ring *ring) {
+    return ring->event_fd;
+}
+/**
+ * @brief 停止设备线程并释放队列. 已提交的请求会先执行完, 未收割的完成项被丢弃
+ *
+ * @param ring
+ * @return int
+ */
+int ddriver_ring_exit(struct ddriver_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->stop = 1;
+    pthread_cond_signal(&ring->sq_cond);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->worker, NULL);
+
+    pthread_cond_destroy(&ring->cq_cond);
+    pthread_cond_destroy(&ring->sq_cond);
+    pthread_mutex_destroy(&ring->lock);
+    if (ring->event_fd >= 0)
+        close(ring->event_fd);
+    free(ring->done);
+    free(ring->cqes);
+    free(ring->batch);
+    free(ring->sq_time);
+    free(ring->sqes);
+    free(ring);
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "ddriver_dev.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+/* 与Linux mq-deadline的默认值一致 */
+#define DEADLINE_READ_EXPIRE_US     (500 * 1000)
+#define DEADLINE_WRITE_EXPIRE_US    (5000 * 1000)
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief 超时请求在前(按到达顺序), 其余按key升序, key相同按到达顺序
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+static int rq_cmp(const void *a, const void *b) {
+    const struct ddriver_sched_rq *ra = (const struct ddriver_sched_rq *)a;
+    const struct ddriver_sched_rq *rb = (const struct ddriver_sched_rq *)b;
+
+    if (ra->expired != rb->expired)
+        return rb->expired - ra->expired;
+    if (!ra->expired && ra->key != rb->key)
+        return ra->key < rb->key ? -1 : 1;
+    return ra->seq < rb->seq ? -1 : (ra->seq > rb->seq);
+}
+/**
+ * @brief C-LOOK的排序键: 磁头之后的请求按位置递增, 磁头之前的请求
+ * 绕回到最后, 仍按位置递增
+ *
+ * @param dev
+ * @param rq
+ * @param head
+ * @return long long
+ */
+static long long clook_key(struct ddriver *dev, struct ddriver_sched_rq *rq, off_t head) {
+    if (rq->sqe.offset >= head)
+        return rq->sqe.offset;
+    return rq->sqe.offset + dev->layout_size;
+}
+/******************************************************************************
+* SECTION: Schedulers
+*******************************************************************************/
+static void noop_dispatch(struct ddriver *dev, struct ddriver_sched_rq *rqs, int nr, off_t head,
+                          long long now, struct ddriver_sched_state *stat) {
+    IGNORE_ARG(dev);
+    IGNORE_ARG(rqs);
+    IGNORE_ARG(nr);
+    IGNORE_ARG(head);
+    IGNORE_ARG(now);
+    IGNORE_ARG(stat);
+}
+
+static void clook_dispatch(struct ddriver *dev, struct ddriver_sched_rq *rqs, int nr, off_t head,
+                           long long now, struct ddriver_sched_state *stat) {
+    int i;
+    IGNORE_ARG(now);
+    IGNORE_ARG(stat);
+
+    for (i = 0; i < nr; i++) {
+        rqs[i].expired = 0;
+        rqs[i].key = clook_key(dev, &rqs[i], head);
+    }
+    qsort(rqs, nr, sizeof(struct ddriver_sched_rq), rq_cmp);
+}
+/**
+ * @brief 超过期限的请求按到达顺序先派发, 防止远处的请求被电梯饿死;
+ * 其余请求按C-LOOK顺序派发
+ */
+static void deadline_dispatch(struct ddriver *dev, struct ddriver_sched_rq *rqs, int nr,
+                              off_t head, long long now, struct ddriver_sched_state *stat) {
+    long long expire;
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        expire = rqs[i].sqe.opcode == DDRIVER_OP_WRITE ? DEADLINE_WRITE_EXPIRE_US
+                                                        : DEADLINE_READ_EXPIRE_US;
+        rqs[i].expired = now - rqs[i].submit_us >= expire;
+        rqs[i].key = clook_key(dev, &rqs[i], head);
+        if (rqs[i].expired)
+            __atomic_add_fetch(&stat->expire_cnt, 1, __ATOMIC_RELAXED);
+    }
+    qsort(rqs, nr, sizeof(struct ddriver_sched_rq), rq_cmp);
+}
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+const struct ddriver_sched_ops ddriver_scheds[DDRIVER_SCHED_NR] = {
+    [DDRIVER_SCHED_NOOP]     = { .name = "noop",     .dispatch = noop_dispatch },
+    [DDRIVER_SCHED_DEADLINE] = { .name = "deadline", .dispatch = deadline_dispatch },
+    [DDRIVER_SCHED_CLOOK]    = { .name = "c-look",   .dispatch = clook_dispatch },
+};
+/******************************************************************************
+* SECTION: Global Function Implementation
+*******************************************************************************/
+/**
+ * @brief 记录一次由调度器派发的请求带来的磁头移动
+ *
+ * @param dev
+ * @param sched
+ * @param from
+ * @param to
+ * @param lat_us 该次移动的模拟延迟
+ */
+void sched_account_seek(struct ddriver *dev, int sched, off_t from, off_t to, long lat_us) {
+    struct ddriver_sched_state *stat = &dev->sched_stat[sched];
+
+    __atomic_add_fetch(&stat->seek_dist, llabs(to - from), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stat->seek_lat_us, lat_us, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "ddriver.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define REPLAY_OPS          (DDRIVER_OP_SEEK + 1)
+#define REPLAY_FILL         0x5a                      /* 重放写入的数据 */
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+/* 每种操作的重放结果 */
+struct replay_stat
+{
+    long long ops;
+    long long errs;
+    long long bytes;
+    long long total_us;
+    long long *lat_us;                                /* 每个成功请求的耗时, 用于分位数 */
+};
+/******************************************************************************
+* SECTION: Global Variable
+*******************************************************************************/
+static const char *op_names[REPLAY_OPS] = { "nop", "read", "write", "seek" };
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static void usage(const char *prog) {
+    printf("用法: %s [-p profile] [-r] [-t tag] <trace> <image>\n", prog);
+    printf("  -p profile  重放使用的磁盘配置, 同DDRIVER_PROFILE, 如\"ssd,latency=1\"\n");
+    printf("  -r          按跟踪中的时间戳节奏发出请求, 默认一个接一个尽快重放\n");
+    printf("  -t tag      只重放该标签的记录\n");
+    printf("  image       重放用的磁盘镜像, 其内容会被覆盖\n");
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+/**
+ * @brief 读入整个跟踪文件
+ *
+ * @param path
+ * @param hdr 返回文件头
+ * @param nr 返回记录数
+ * @return struct ddriver_trace_rec* 失败返回NULL
+ */
+static struct ddriver_trace_rec *load_trace(const char *path, struct ddriver_trace_hdr *hdr,
+                                            long *nr) {
+    struct ddriver_trace_rec *recs;
+    struct stat st;
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL || fstat(fileno(fp), &st) < 0) {
+        fprintf(stderr, "can't open trace [%s]: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, fp) != 1 || hdr->magic != DDRIVER_TRACE_MAGIC ||
+        hdr->version != DDRIVER_TRACE_VERSION) {
+        fprintf(stderr, "[%s] is not a ddriver trace\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    *nr = (st.st_size - sizeof(*hdr)) / sizeof(struct ddriver_trace_rec);
+    recs = malloc((*nr + 1) * sizeof(struct ddriver_trace_rec));
+    if (recs == NULL || fread(recs, sizeof(*recs), *nr, fp) != (size_t)*nr) {
+        fprintf(stderr, "can't read %ld records from [%s]\n", *nr, path);
+        free(recs);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    return recs;
+}
+/**
+ * @brief 重放一条记录. 读写都带偏移走ddriver_readv/ddriver_writev,
+ * 与SEEK共用fd上的磁头, 这样定位开销与记录时的顺序一致
+ *
+ * @param fd
+ * @param rec
+ * @param buf 至少rec->size字节
+ * @return int
+ */
+static int replay_one(int fd, const struct ddriver_trace_rec *rec, char *buf) {
+    struct iovec iov = { .iov_base = buf, .iov_len = rec->size };
+
+    switch (rec->op)
+    {
+    case DDRIVER_OP_SEEK:
+        return ddriver_seek(fd, rec->offset, SEEK_SET);
+    case DDRIVER_OP_READ:
+        return ddriver_readv(fd, rec->offset, &iov, 1);
+    case DDRIVER_OP_WRITE:
+        return ddriver_writev(fd, rec->offset, &iov, 1);
+    default:
+        return -EINVAL;
+    }
+}
+
+static void report(struct replay_stat *stats, long long elapsed_us, int fd) {
+    struct ddriver_stats_ex ex;
+    long long bytes = 0, ops = 0;
+    struct replay_stat *st;
+    int op;
+
+    printf("%-6s %10s %8s %12s %10s %10s %10s\n",
+           "op", "count", "errors", "bytes", "avg(us)", "p50(us)", "p99(us)");
+    for (op = DDRIVER_OP_READ; op < REPLAY_OPS; op++) {
+        st = &stats[op];
+        if (st->ops == 0)
+            continue;
+        qsort(st->lat_us, st->ops - st->errs, sizeof(long long), cmp_ll);
+        printf("%-6s %10lld %8lld %12lld %10lld %10lld %10lld\n", op_names[op],
+               st->ops, st->errs, st->bytes,
+               st->ops > st->errs ? st->total_us / (st->ops - st->errs) : 0,
+               st->ops > st->errs ? st->lat_us[(st->ops - st->errs) / 2] : 0,
+               st->ops > st->errs ? st->lat_us[(st->ops - st->errs) * 99 / 100] : 0);
+        ops += st->ops;
+        bytes += st->bytes;
+    }
+    printf("elapsed %lld us, %.1f ops/s, %.2f MiB/s\n", elapsed_us,
+           elapsed_us ? ops * 1e6 / elapsed_us : 0.0,
+           elapsed_us ? bytes * 1e6 / elapsed_us / (1024 * 1024) : 0.0);
+    if (ddriver_ioctl(fd, IOC_REQ_DEVICE_STATS_EX, &ex) == 0)
+        printf("modeled latency %llu us, seek distance %llu bytes\n",
+               (unsigned long long)ex.model_lat_us, (unsigned long long)ex.seek_dist);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 把ddriver跟踪在指定的延迟配置下重放到一个磁盘镜像上,
+ * 报告每种操作的吞吐与延迟分布, 用于在相同负载下比较布局与缓存的改动
+ */
+int main(int argc, char **argv) {
+    struct ddriver_trace_rec *recs;
+    struct ddriver_trace_hdr hdr;
+    struct ddriver_profile prof;
+    struct replay_stat stats[REPLAY_OPS];
+    const char *spec = NULL;
+    long long start, issue, wait;
+    uint32_t max_size = 0;
+    long nr, i;
+    int paced = 0, tag = -1;
+    char *buf;
+    int fd, ret, opt;
+
+    while ((opt = getopt(argc, argv, "p:rt:h")) != -1) {
+        switch (opt)
+        {
+        case 'p': spec = optarg; break;
+        case 'r': paced = 1; break;
+        case 't': tag = atoi(optarg); break;
+        default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    recs = load_trace(argv[optind], &hdr, &nr);
+    if (recs == NULL)
+        return 1;
+    /* 默认沿用记录时的几何, 配置串可覆盖延迟和块大小, 但磁盘不小于记录时 */
+    ddriver_profile_parse("default", &prof);
+    prof.disk_size = hdr.disk_size;
+    prof.block_size = hdr.block_size;
+    if (spec && ddriver_profile_parse(spec, &prof) < 0) {
+        fprintf(stderr, "bad profile [%s]\n", spec);
+        return 1;
+    }
+    if (prof.disk_size < hdr.disk_size)
+        prof.disk_size = hdr.disk_size;
+
+    memset(stats, 0, sizeof(stats));
+    for (i = 0; i < nr; i++) {
+        if (recs[i].op < REPLAY_OPS && stats[recs[i].op].lat_us == NULL)
+            stats[recs[i].op].lat_us = malloc(nr * sizeof(long long));
+        if (recs[i].size > max_size)
+            max_size = recs[i].size;
+    }
+    buf = malloc(max_size ? max_size : 1);
+    if (buf == NULL)
+        return 1;
+    memset(buf, REPLAY_FILL, max_size);
+
+    fd = ddriver_open_ex(argv[optind + 1], &prof);
+    if (fd < 0) {
+        fprintf(stderr, "can't open [%s]: %s\n", argv[optind + 1], strerror(-fd));
+        return 1;
+    }
+    printf("replay %ld records, disk %llu bytes, block %u bytes\n", nr,
+           (unsigned long long)prof.disk_size, prof.block_size);
+
+    start = now_us();
+    for (i = 0; i < nr; i++) {
+        if (recs[i].op >= REPLAY_OPS || recs[i].op == DDRIVER_OP_NOP ||
+            (tag >= 0 && recs[i].tag != tag))
+            continue;
+        if (paced) {
+            wait = start + (long long)recs[i].ts_us - now_us();
+            if (wait > 0)
+                usleep(wait);
+        }
+        issue = now_us();
+        ret = replay_one(fd, &recs[i], buf);
+        stats[recs[i].op].ops++;
+        if (ret < 0) {
+            stats[recs[i].op].errs++;
+            continue;
+        }
+        issue = now_us() - issue;
+        stats[recs[i].op].lat_us[stats[recs[i].op].ops - stats[recs[i].op].errs - 1] = issue;
+        stats[recs[i].op].total_us += issue;
+        stats[recs[i].op].bytes += recs[i].size;
+    }
+    report(stats, now_us() - start, fd);
+
+    ddriver_close(fd);
+    for (i = 0; i < REPLAY_OPS; i++)
+        free(stats[i].lat_us);
+    free(buf);
+    free(recs);
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include "../include/newfs_bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+/*
+ * newfs位图微基准：
+ *
+ *   newfs_bitmap_bench [名字过滤子串] [位数]
+ *
+ * 每项在10%、50%、99%占用率下各跑BENCH_MIN_NS，打印每次的平均耗时。位图有两种填法：
+ *   prefix  前面连续占满，相当于按顺序建文件，旧的从0开始逐位扫描最吃亏
+ *   random  随机打散，相当于反复建删之后
+ * 每次迭代分配后马上释放，占用率保持不变。
+ *   BM_ByteScan  原来newfs_alloc_inode里按字节再按位、从0开始的扫描
+ *   BM_WordScan  newfs_bitmap_find_zero从0开始按64位字扫描
+ *   BM_NextFit   newfs_bitmap_alloc，从上次的游标继续
+ *   BM_AllocRun  newfs_bitmap_alloc_run找16位的连续段
+ */
+
+#define BENCH_DEFAULT_BITS 65536
+#define BENCH_RUN 16
+#define BENCH_MIN_NS 2e8
+
+struct bench_ctx
+{
+    struct newfs_bitmap bm;
+    uint8_t *map;
+    int nbits;
+    unsigned long long rng;
+};
+
+struct bench
+{
+    const char *name;
+    int (*run)(struct bench_ctx *ctx); /* 一次迭代，返回分到的位数 */
+};
+
+static const char *fills[] = {"prefix", "random"};
+static const int pcts[] = {10, 50, 99};
+
+static unsigned long long rand_next(struct bench_ctx *ctx)
+{
+    ctx->rng ^= ctx->rng << 13;
+    ctx->rng ^= ctx->rng >> 7;
+    ctx->rng ^= ctx->rng << 17;
+    return ctx->rng;
+}
+
+static int bm_byte_scan(struct bench_ctx *ctx)
+{
+    int byte_cursor, bit_cursor;
+    int nbytes = (ctx->nbits + 7) / 8;
+
+    for (byte_cursor = 0; byte_cursor < nbytes; byte_cursor++)
+    {
+        for (bit_cursor = 0; bit_cursor < 8; bit_cursor++)
+        {
+            if ((ctx->map[byte_cursor] & (0x1 << bit_cursor)) == 0)
+            {
+                ctx->map[byte_cursor] |= (0x1 << bit_cursor);
+                ctx->map[byte_cursor] &= ~(0x1 << bit_cursor);
+                return 1;
+            }
+        }
+    }
+    return -ENOSPC;
+}
+
+static int bm_word_scan(struct bench_ctx *ctx)
+{
+    int bit = newfs_bitmap_find_zero(&ctx->bm, 0, ctx->nbits);
+
+    if (bit < 0)
+    {
+        return -ENOSPC;
+    }
+    newfs_bitmap_set(&ctx->bm, bit);
+    newfs_bitmap_clear(&ctx->bm, bit);
+    return 1;
+}
+
+static int bm_next_fit(struct bench_ctx *ctx)
+{
+    int bit = newfs_bitmap_alloc(&ctx->bm);
+
+    if (bit < 0)
+    {
+        return -ENOSPC;
+    }
+    newfs_bitmap_clear(&ctx->bm, bit);
+    return 1;
+}
+
+static int bm_alloc_run(struct bench_ctx *ctx)
+{
+    int start;
+    int len = newfs_bitmap_alloc_run(&ctx->bm, BENCH_RUN, -1, &start);
+
+    if (len == 0)
+    {
+        return -ENOSPC;
+    }
+    newfs_bitmap_clear_range(&ctx->bm, start, len);
+    return len;
+}
+
+static const struct bench benches[] = {
+    {"BM_ByteScan", bm_byte_scan},
+    {"BM_WordScan", bm_word_scan},
+    {"BM_NextFit", bm_next_fit},
+    {"BM_AllocRun", bm_alloc_run},
+};
+/**
+ * @brief 按填法把位图填到pct%
+ */
+static void fill_map(struct bench_ctx *ctx, const char *fill, int pct)
+{
+    int used = (int)((long long)ctx->nbits * pct / 100);
+    int bit;
+
+    memset(ctx->map, 0, (ctx->nbits + 63) / 64 * 8);
+    newfs_bitmap_destroy(&ctx->bm);
+    newfs_bitmap_init(&ctx->bm, ctx->map, ctx->nbits);
+    if (strcmp(fill, "prefix") == 0)
+    {
+        newfs_bitmap_set_range(&ctx->bm, 0, used);
+        return;
+    }
+    ctx->rng = 0x2545f4914f6cdd1dULL;
+    while (used > 0)
+    {
+        bit = rand_next(ctx) % ctx->nbits;
+        if (!newfs_bitmap_test(&ctx->bm, bit))
+        {
+            newfs_bitmap_set(&ctx->bm, bit);
+            used--;
+        }
+    }
+}
+
+static double clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+/**
+ * @brief 反复跑一项直到满BENCH_MIN_NS，每64次看一次时间
+ *
+ * @return int 出错时返回run的错误码
+ */
+static int run_bench(const struct bench *b, struct bench_ctx *ctx, const char *name)
+{
+    long long iters = 0;
+    double start, elapsed;
+    int ret, i;
+
+    start = clock_ns();
+    do
+    {
+        for (i = 0; i < 64; i++)
+        {
+            ret = b->run(ctx);
+            if (ret < 0)
+            {
+                printf("%-28s ERROR: %s\n", name, strerror(-ret));
+                return ret;
+            }
+        }
+        iters += 64;
+        elapsed = clock_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+    printf("%-28s %11.1f ns %12lld\n", name, elapsed / iters, iters);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_ctx ctx;
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    char name[64];
+    int i, f, p, ret = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nbits = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_BITS;
+    if (ctx.nbits < 64)
+    {
+        fprintf(stderr, "nbits must be at least 64\n");
+        return 1;
+    }
+    /* 按64位字读，长度向上对齐到8字节 */
+    ctx.map = (uint8_t *)malloc((ctx.nbits + 63) / 64 * 8);
+
+#ifdef __AVX2__
+    printf("newfs bitmap, %d bits, avx2\n", ctx.nbits);
+#else
+    printf("newfs bitmap, %d bits\n", ctx.nbits);
+#endif
+    printf("%-28s %14s %12s\n", "Benchmark", "Time", "Iterations");
+    for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])); i++)
+    {
+        for (f = 0; f < (int)(sizeof(fills) / sizeof(fills[0])); f++)
+        {
+            for (p = 0; p < (int)(sizeof(pcts) / sizeof(pcts[0])); p++)
+            {
+                snprintf(name, sizeof(name), "%s/%s/%d", benches[i].name, fills[f], pcts[p]);
+                if (filter && !strstr(name, filter))
+                    continue;
+                fill_map(&ctx, fills[f], pcts[p]);
+                if (run_bench(&benches[i], &ctx, name) < 0)
+                    ret = 1;
+            }
+        }
+    }
+    newfs_bitmap_destroy(&ctx.bm);
+    free(ctx.map);
+    return ret;
+}
@@ -3,14 +3,58 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
+#include <stdint.h>
+
+#define DDRIVER_PROFILE_ENV         "DDRIVER_PROFILE"   /* ddriver_open读取的配置 */
+#define DDRIVER_PROFILE_MMAP        0x1                 /* 映射整个磁盘 */
+#define DDRIVER_PROFILE_NO_LATENCY  0x2                 /* 关闭延迟模拟 */
+#define DDRIVER_PROFILE_CHUNKED     0x4                 /* 新建分块压缩的稀疏镜像 */
+
+/**
+ * @brief 磁盘几何与延迟配置
+ */
+struct ddriver_profile {
+    uint64_t disk_size;                                 /* 磁盘大小(字节) */
+    uint32_t block_size;                                /* 设备IO单位, 512~64K的2的幂 */
+    uint32_t track_num;                                 /* 磁道数, 决定旋转延迟的粒度 */
+    uint32_t read_lat_us;                               /* 每次读的固定延迟 */
+    uint32_t write_lat_us;                              /* 每次写的固定延迟 */
+    uint32_t seek_lat_us;                               /* 磁头转一圈的延迟, 0表示无寻道开销 */
+    uint32_t flags;                                     /* DDRIVER_PROFILE_* */
+    uint32_t flush_ms;                                  /* 写回缓存的定时刷出周期, 0表示不定时刷 */
+    uint64_t cache_size;                                /* 易失写回缓存大小(字节), 0表示直写 */
+};
+
+/**
+ * @brief 打开ddriver设备；每次打开都有独立的几何、统计与日志(路径加_log)，
+ * 同一进程可同时打开多个磁盘镜像
+ * 
+ * @param path ddriver设备路径，不存在时创建；也可以是内核ddriver的字符设备(/dev/ddriver)
+ * @return int 设备handler，小于0失败
+ */
+int ddriver_open(char *path);
 
 /**
- * @brief 打开ddriver设备
+ * @brief 按指定的配置打开ddriver设备
  * 
  * @param path ddriver设备路径
+ * @param profile 磁盘配置，NULL时与ddriver_open相同，读取环境变量DDRIVER_PROFILE
+ * @return int 设备handler，小于0失败
+ */
+int ddriver_open_ex(char *path, const struct ddriver_profile *profile);
+
+/**
+ * @brief 在profile上叠加配置串，如"ssd,size=1G,mmap=1"；
+ * 可用项: 预设名(default/hdd/ssd), size, block, tracks, read_lat, write_lat, seek_lat(us), mmap, latency,
+ * cache(写回缓存大小), flush_ms, chunked(空文件新建为分块压缩镜像, 已有的按文件头自动识别)；
+ * 含'/'时视为配置文件路径，文件中#之后为注释
+ * 
+ * @param spec 配置串或配置文件路径
+ * @param profile 待修改的配置
  * @return int 0成功，否则失败
  */
-int ddriver_open(char *path);
+int ddriver_profile_parse(const char *spec, struct ddriver_profile *profile);
 
 /**
  * @brief 移动ddriver磁盘头
@@ -42,6 +86,60 @@ int ddriver_write(int fd, char *buf, size_t size);
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 向量读出数据，一次调用读出多个连续块
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param iov 要读出的Buf列表，每段大小都需是设备IO单位的整数倍
+ * @param iovcnt iov的段数
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_readv(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 向量写入数据，一次调用写入多个连续块
+ * 
+ * @param fd ddriver设备handler
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @param iov 要写入的Buf列表，每段大小都需是设备IO单位的整数倍
+ * @param iovcnt iov的段数
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_writev(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief 按位置读出数据，不依赖也不改变设备的当前位置，可被多个线程并发调用；
+ * 寻道延迟按调用线程自己的磁头位置计算
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，需是设备IO单位的整数倍
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 读出的字节数，小于0失败
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 按位置写入数据，线程安全，语义同ddriver_pread
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，需是设备IO单位的整数倍
+ * @param offset 起始位置，注意要和设备IO单位对齐
+ * @return int 写入的字节数，小于0失败
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief mmap模式(环境变量DDRIVER_MMAP=1)下获取磁盘块的地址，可直接原地读写
+ * 
+ * @param fd ddriver设备handler
+ * @param blkno 块号，以设备IO单位计，之后的块在内存中连续
+ * @return void* 块地址，未开启mmap模式或越界时返回NULL
+ */
+void *ddriver_map_block(int fd, int blkno);
+
 /**
  * @brief ddriver IO控制
  * 
@@ -60,4 +158,139 @@ int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
  */
 int ddriver_close(int fd);
 
+#define DDRIVER_TRACE_ENV       "DDRIVER_TRACE"     /* 非0时ddriver_open自动跟踪到路径加_trace */
+#define DDRIVER_TRACE_MAGIC     0x52544444          /* "DDTR" */
+#define DDRIVER_TRACE_VERSION   1
+
+/* 跟踪文件头, 之后紧跟若干ddriver_trace_rec */
+struct ddriver_trace_hdr {
+    uint32_t magic;                                   /* DDRIVER_TRACE_MAGIC */
+    uint32_t version;                                 /* DDRIVER_TRACE_VERSION */
+    uint32_t block_size;                              /* 记录时的设备IO单位 */
+    uint32_t reserved;
+    uint64_t disk_size;                               /* 记录时的磁盘大小 */
+};
+
+/* 一次SEEK/读/写 */
+struct ddriver_trace_rec {
+    uint64_t ts_us;                                   /* 距开始跟踪的时间(us) */
+    int64_t  offset;                                  /* 磁盘偏移 */
+    uint32_t size;                                    /* 字节数, SEEK为0 */
+    uint16_t op;                                      /* DDRIVER_OP_READ/WRITE/SEEK */
+    uint16_t tag;                                     /* 调用者标签, 见ddriver_trace_tag */
+};
+
+/**
+ * @brief 开始把该设备上的每次SEEK/读/写记录到二进制跟踪文件,
+ * 可用tools/ddriver_replay在任意延迟配置下重放
+ * 
+ * @param fd ddriver设备handler
+ * @param path 跟踪文件路径，已存在时覆盖
+ * @return int 0成功，否则失败
+ */
+int ddriver_trace_start(int fd, const char *path);
+
+/**
+ * @brief 停止跟踪并关闭跟踪文件，不能与该设备上的IO并发调用
+ * 
+ * @param fd ddriver设备handler
+ * @return int 0成功，否则失败
+ */
+int ddriver_trace_stop(int fd);
+
+/**
+ * @brief 设置调用线程之后的IO在跟踪中的标签，如区分元数据与数据
+ * 
+ * @param tag 标签，只保留低16位
+ * @return unsigned 之前的标签
+ */
+unsigned ddriver_trace_tag(unsigned tag);
+
+/* 异步请求的操作码 */
+#define DDRIVER_OP_NOP          0
+#define DDRIVER_OP_READ         1
+#define DDRIVER_OP_WRITE        2
+#define DDRIVER_OP_SEEK         3
+
+/* ddriver_ring_init的flags: 每批完成后通知eventfd */
+#define DDRIVER_RING_EVENTFD    0x1
+
+/* 提交队列项 */
+struct ddriver_sqe {
+    int      opcode;                                  /* DDRIVER_OP_* */
+    off_t    offset;                                  /* 磁盘偏移，要和设备IO单位对齐 */
+    void     *buf;                                    /* 读写Buf，SEEK时忽略 */
+    size_t   size;                                    /* 设备IO单位的整数倍，SEEK时忽略 */
+    uint64_t user_data;                               /* 原样带回cqe */
+};
+
+/* 完成队列项 */
+struct ddriver_cqe {
+    uint64_t user_data;
+    int      res;                                     /* 传输字节数(SEEK为磁头位置)，小于0为错误码 */
+};
+
+struct ddriver_ring;
+
+/**
+ * @brief 在ddriver设备上建立异步提交/完成队列，并启动设备线程
+ * 
+ * @param fd ddriver设备handler
+ * @param entries 提交队列深度，向上取整到2的幂
+ * @param flags DDRIVER_RING_EVENTFD等
+ * @param ring 返回的队列
+ * @return int 0成功，否则失败
+ */
+int ddriver_ring_init(int fd, unsigned entries, unsigned flags, struct ddriver_ring **ring);
+
+/**
+ * @brief 取一个空闲的提交队列项，填好后需调用ddriver_ring_submit
+ * 
+ * @param ring 
+ * @return struct ddriver_sqe* 队列已满时返回NULL，此时应先收割完成项
+ */
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring);
+
+/**
+ * @brief 把已填好的提交队列项作为一批交给设备线程
+ * 
+ * @param ring 
+ * @return int 本次提交的请求数
+ */
+int ddriver_ring_submit(struct ddriver_ring *ring);
+
+/**
+ * @brief 非阻塞地收割一个完成项
+ * 
+ * @param ring 
+ * @param cqe 返回的完成项
+ * @return int 0成功，没有完成项时返回-EAGAIN
+ */
+int ddriver_ring_peek_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe);
+
+/**
+ * @brief 阻塞等待并收割一个完成项
+ * 
+ * @param ring 
+ * @param cqe 返回的完成项
+ * @return int 0成功，没有在途请求时返回-EAGAIN
+ */
+int ddriver_ring_wait_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe);
+
+/**
+ * @brief 获取完成通知用的eventfd
+ * 
+ * @param ring 
+ * @return int eventfd，未指定DDRIVER_RING_EVENTFD时返回-1
+ */
+int ddriver_ring_eventfd(struct ddriver_ring *ring);
+
+/**
+ * @brief 等待在途请求完成，停止设备线程并释放队列，需在ddriver_close前调用
+ * 
+ * @param ring 
+ * @return int 0成功，否则失败
+ */
+int ddriver_ring_exit(struct ddriver_ring *ring);
+
 #endif /* _DDRIVER_H_ */
\ No newline at end of file
@@ -9,8 +9,10 @@
 #include "string.h"
 #include "fuse.h"
 #include <stddef.h>
+#include <pthread.h>
 #include "ddriver.h"
 #include "errno.h"
+#include "newfs_bitmap.h"
 #include "types.h"
 
 /*******************************************************************************/
@@ -20,6 +22,21 @@
 /******************************************************************************
 * SECTION: newfs.c
 *******************************************************************************/
+int 			   newfs_buf_init();
+int 			   newfs_buf_flush();
+void 			   newfs_buf_invalidate(int offset, int len);
+int 			   newfs_buf_zero(int offset, int len);
+void 			   newfs_buf_exit();
+void 			   newfs_discard_add(int offset, int len);
+void 			   newfs_discard_cancel(int offset);
+int 			   newfs_discard_flush();
+int 			   newfs_drop_dentry(struct newfs_inode *, struct newfs_dentry *);
+int 			   newfs_drop_inode(struct newfs_inode *);
+int 			   newfs_inode_grow(struct newfs_inode *, int);
+void 			   newfs_inode_shrink(struct newfs_inode *, int);
+int 			   newfs_inode_io(struct newfs_inode *, int, uint8_t *, int, boolean);
+struct newfs_inode* newfs_read_inode(struct newfs_dentry *, int);
+struct newfs_inode* newfs_load_inode(struct newfs_dentry *);
 void* 			   newfs_init(struct fuse_conn_info *);
 void  			   newfs_destroy(void *);
 int   			   newfs_mkdir(const char *, mode_t);
@@ -40,5 +57,19 @@ int   			   newfs_truncate(const char *, off_t);
 			
 int   			   newfs_open(const char *, struct fuse_file_info *);
 int   			   newfs_opendir(const char *, struct fuse_file_info *);
+/* 多线程FUSE用的加锁版本 */
+int   			   newfs_locked_mkdir(const char *, mode_t);
+int   			   newfs_locked_getattr(const char *, struct stat *);
+int   			   newfs_locked_readdir(const char *, void *, fuse_fill_dir_t, off_t,
+						                       struct fuse_file_info *);
+int   			   newfs_locked_mknod(const char *, mode_t, dev_t);
+int   			   newfs_locked_write(const char *, const char *, size_t, off_t,
+					                         struct fuse_file_info *);
+int   			   newfs_locked_read(const char *, char *, size_t, off_t,
+					                        struct fuse_file_info *);
+int   			   newfs_locked_truncate(const char *, off_t);
+int   			   newfs_locked_unlink(const char *);
+int   			   newfs_locked_rmdir(const char *);
+int   			   newfs_locked_access(const char *, int);
 
-#endif  /* _newfs_H_ */
\ No newline at end of file
+#endif  /* _newfs_H_ */
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef _NEWFS_BITMAP_H_
+#define _NEWFS_BITMAP_H_
+
+#include <stdint.h>
+
+/******************************************************************************
+ * SECTION: 位图
+ * inode位图和数据位图共用。位的排列和磁盘上一致：第i位在map[i / 8]的第i % 8位。
+ * 查找按64位字进行，用__builtin_ctzll定位字内的位；编译时开了AVX2(-mavx2)
+ * 则先按256位一组跳过整组全满(或全空)的部分。
+ * map的长度要至少覆盖到nbits向上对齐到64位，按字读时不会越界
+ *
+ * 位图上面再有两级摘要，挂载时由位图重建，不落盘：
+ *   每NEWFS_BITMAP_GROUP_BITS位一组，记空闲位数和组内最长的空闲段
+ *   顶层每组一位，表示该组还有空闲位
+ * 找空闲位时先在顶层按字跳过满的组，找连续段时先看各组的最长空闲段和首尾空闲位数，
+ * 只在能放下的组里逐字查找
+ *******************************************************************************/
+#define NEWFS_BITMAP_GROUP_BITS 512
+
+struct newfs_bitmap_group
+{
+    int nfree;        /* 组内空闲位数 */
+    int maxrun;       /* 组内最长空闲段的长度，-1表示改过之后还没重新统计 */
+    int maxrun_start; /* 最长空闲段的起始位 */
+    int head;         /* 组首连续的空闲位数 */
+    int tail;         /* 组尾连续的空闲位数 */
+};
+
+struct newfs_bitmap
+{
+    uint8_t *map;
+    int nbits; /* 有效位数，之后的位不参与分配 */
+    int hint;  /* next-fit游标：上次分配的末尾，下次从这里开始找 */
+    int nfree; /* 空闲位总数 */
+    int ngroups;
+    struct newfs_bitmap_group *groups;
+    uint64_t *avail; /* 顶层：第g位为1表示第g组还有空闲位 */
+};
+
+int  newfs_bitmap_init(struct newfs_bitmap *bm, uint8_t *map, int nbits);
+void newfs_bitmap_destroy(struct newfs_bitmap *bm);
+int  newfs_bitmap_test(struct newfs_bitmap *bm, int bit);
+void newfs_bitmap_set(struct newfs_bitmap *bm, int bit);
+void newfs_bitmap_clear(struct newfs_bitmap *bm, int bit);
+void newfs_bitmap_set_range(struct newfs_bitmap *bm, int start, int len);
+void newfs_bitmap_clear_range(struct newfs_bitmap *bm, int start, int len);
+int  newfs_bitmap_find_zero(struct newfs_bitmap *bm, int from, int to);
+int  newfs_bitmap_find_one(struct newfs_bitmap *bm, int from, int to);
+int  newfs_bitmap_alloc(struct newfs_bitmap *bm);
+int  newfs_bitmap_find_run(struct newfs_bitmap *bm, int want, int goal, int *start);
+int  newfs_bitmap_alloc_run(struct newfs_bitmap *bm, int want, int goal, int *start);
+
+#endif /* _NEWFS_BITMAP_H_ */
@@ -20,7 +20,7 @@ typedef enum newfs_file_type
 #define UINT32_BITS 32
 #define UINT8_BITS 8
 
-#define NEWFS_MAGIC_NUM 0x00001511 
+#define NEWFS_MAGIC_NUM 0x00001513 //磁盘格式变了就换幻数，旧格式的盘会被重建
 #define NEWFS_SUPER_OFS 0          //超级块的偏移（字节）
 #define NEWFS_ROOT_INO 0           //超级块在位图中的索引
 
@@ -34,16 +34,21 @@ typedef enum newfs_file_type
 #define NEWFS_ERROR_UNSUPPORTED ENXIO
 #define NEWFS_ERROR_IO EIO       /* Error Input/Output */
 #define NEWFS_ERROR_INVAL EINVAL /* Invalid Args */
+#define NEWFS_ERROR_NOTDIR ENOTDIR
+#define NEWFS_ERROR_NOTEMPTY ENOTEMPTY
 
 #define NEWFS_MAX_FILE_NAME 128 //最大文件名长度
-#define NEWFS_DATA_PER_FILE 4   //每个文件最多4个EXT2下的块
+#define NEWFS_EXTENT_DIRECT 16  //inode里直接存放的extent数，多出的放到间接extent块
 #define NEWFS_DEFAULT_PERM 0777
+#define NEWFS_DISCARD_BATCH 64  //攒够这么多个释放的块就先discard一次
 
 #define NEWFS_IOC_MAGIC 'S'
 #define NEWFS_IOC_SEEK _IO(NEWFS_IOC_MAGIC, 0)
 
-#define NEWFS_FLAG_BUF_DIRTY 0x1
-#define NEWFS_FLAG_BUF_OCCUPY 0x2
+#define NEWFS_FLAG_BUF_DIRTY 0x1   //缓冲块被改过，还没写回
+#define NEWFS_FLAG_BUF_OCCUPY 0x2  //缓冲块装着某个磁盘块的内容
+#define NEWFS_BUF_NR 256           //缓冲区的块数，2的幂
+#define NEWFS_BUF_BATCH 16         //连续未命中的块合成一次读
 
 /******************************************************************************
  * SECTION: Macro Function
@@ -62,6 +67,8 @@ typedef enum newfs_file_type
 #define NEWFS_ASSIGN_FNAME(pnewfs_dentry, _fname) memcpy(pnewfs_dentry->fname, _fname, strlen(_fname))
 #define NEWFS_INO_OFS(ino) (newfs_super.inode_offset + (ino)*NEWFS_BLK_SZ())
 #define NEWFS_DATA_OFS(blocknum) (newfs_super.data_offset + (blocknum)*NEWFS_BLK_SZ())
+#define NEWFS_EXTENT_PER_BLK() ((NEWFS_BLK_SZ() - sizeof(struct newfs_extent_blk_d)) / sizeof(struct newfs_extent_d))
+//一个间接extent块能放的extent数
 
 #define NEWFS_IS_DIR(pinode) (pinode->dentry->ftype == NEWFS_DIR)
 //返回输入inode指向的是否为文件夹
@@ -73,24 +80,42 @@ typedef enum newfs_file_type
 struct newfs_dentry;
 struct newfs_inode;
 struct newfs_super;
+struct newfs_extent_d;
+
+/*块缓冲区：所有对设备的读写都经过这里，按NEWFS_BLK_SZ()大小的块缓存，
+hash按块号查找，LRU链表上最近用过的在前，写回时从尾部换出*/
+struct newfs_buf
+{
+    int blkno;              /* 缓存的磁盘块号(offset / NEWFS_BLK_SZ()) */
+    flag16 flag;            /* NEWFS_FLAG_BUF_* */
+    uint8_t *data;
+    struct newfs_buf *hnext; /* hash链 */
+    struct newfs_buf *prev;  /* LRU */
+    struct newfs_buf *next;
+};
 
 struct custom_options
 {
     const char *device;
     boolean show_help;
+    boolean discard; // --discard：释放的块在sync时discard
 };
-/*值得一提的是，
-这里我采用固定分配，
-因此pointer和bno会固定指向一些位置，不会变动。*/
+/*文件数据按extent映射：每个extent是一段物理上连续的数据块，
+按文件内的逻辑顺序排列，第i个extent接在前i-1个extent之后。
+文件内容不常驻内存，读写都经过块缓冲区*/
 struct newfs_inode
 {                 //仿照指导书定义
     uint32_t ino; /* 在inode位图中的下标 */
     int size;     /* 文件已占用空间 */
     int dir_cnt;
-    struct newfs_dentry *dentry;                 /* 指向该inode的dentry */
-    struct newfs_dentry *dentrys;                /* 所有目录项 */
-    uint8_t *block_pointer[NEWFS_DATA_PER_FILE]; /* 如果是 FILE，指向 4 个数据块 */
-    int blocknum[NEWFS_DATA_PER_FILE];                /* 数据块在磁盘中的块号  上述数据块在磁盘中的块号 */
+    struct newfs_dentry *dentry;     /* 指向该inode的dentry */
+    struct newfs_dentry *dentrys;    /* 所有目录项 */
+    struct newfs_extent_d *extents;  /* 数据块的extent表 */
+    int extent_cnt;
+    int extent_cap;                  /* extents数组的容量 */
+    int blk_cnt;                     /* 所有extent的块数之和 */
+    int *ext_blks;                   /* 间接extent块的块号，按链表顺序 */
+    int ext_blk_cnt;
 };
 
 
@@ -134,11 +159,30 @@ struct newfs_super
     int map_data_blks;   //数据位图块数
     int map_data_offset; //数据位图偏移
 
+    struct newfs_bitmap inode_bm; //在map_inode上做查找和分配
+    struct newfs_bitmap data_bm;  //在map_data上做查找和分配
+
     int inode_offset; // 索引结点的偏移
     int data_offset;  // 数据块的偏移
 
     boolean is_mounted;
 
+    boolean discard;                                      //是否discard释放的块
+    int discard_cnt;                                      //待discard的块数
+    struct ddriver_range discards[NEWFS_DISCARD_BATCH];   //待discard的块
+
+    pthread_rwlock_t lock;                                //FUSE多线程: 修改操作持写锁，只读操作持读锁
+    pthread_mutex_t load_lock;                            //读锁下懒加载inode时互斥
+
+    struct newfs_buf *bufs;                               //块缓冲区
+    uint8_t *buf_data;                                    //NEWFS_BUF_NR个块的数据
+    struct newfs_buf *buf_hash[NEWFS_BUF_NR];
+    struct newfs_buf buf_lru;                             //LRU链表头
+    pthread_mutex_t buf_lock;                             //读锁下也会读设备，缓冲区单独加锁
+    int buf_hits;
+    int buf_misses;
+    int buf_writebacks;                                   //写回设备的次数
+
     struct newfs_dentry *root_dentry;
 };
 
@@ -177,6 +221,15 @@ struct newfs_super_d
 
     int inode_offset; /* 索引结点的偏移 */
     int data_offset;  /* 数据块的偏移*/
+
+    int max_ino;  /* inode数，即inode位图的有效位数 */
+    int max_data; /* 数据块数，即数据位图的有效位数 */
+};
+
+struct newfs_extent_d
+{
+    int start; /* 起始数据块号 */
+    int len;   /* 连续的块数 */
 };
 
 struct newfs_inode_d
@@ -185,7 +238,16 @@ struct newfs_inode_d
     int size;     /* 文件已占用空间 */
     int dir_cnt;
     NEWFS_FILE_TYPE ftype;
-    int blocknum[NEWFS_DATA_PER_FILE]; /* 数据块在磁盘中的块号 */
+    int extent_cnt;                                   /* extent总数 */
+    int ext_blk;                                      /* 第一个间接extent块，没有时为-1 */
+    struct newfs_extent_d extents[NEWFS_EXTENT_DIRECT]; /* 前NEWFS_EXTENT_DIRECT个extent */
+};
+
+/*间接extent块：块头之后紧跟extent，多个间接块用next串成链表*/
+struct newfs_extent_blk_d
+{
+    int next; /* 下一个间接extent块，-1表示链表结束 */
+    int cnt;  /* 本块中的extent数 */
 };
 
 struct newfs_dentry_d
@@ -195,4 +257,4 @@ struct newfs_dentry_d
     uint32_t ino; /* 指向的 ino 号 */
 };
 
-#endif /* _TYPES_H_ */
\ No newline at end of file
+#endif /* _TYPES_H_ */
\ No newline at end of file
@@ -13,30 +13,32 @@
  *******************************************************************************/
 static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
                                               OPTION("--device=%s", device),
+                                              OPTION("--discard", discard),
                                               FUSE_OPT_END};
 struct newfs_super newfs_super;
 struct custom_options newfs_options;
 /******************************************************************************
  * SECTION: FUSE操作定义
  *******************************************************************************/
+/* FUSE默认多线程调用，表中挂的是下方SECTION: 并发包装中加了锁的版本 */
 static struct fuse_operations operations = {
-    .init = newfs_init,         /* mount文件系统 */
-    .destroy = newfs_destroy,   /* umount文件系统 */
-    .mkdir = newfs_mkdir,       /* 建目录，mkdir */
-    .getattr = newfs_getattr,   /* 获取文件属性，类似stat，必须完成 */
-    .readdir = newfs_readdir,   /* 填充dentrys */
-    .mknod = newfs_mknod,       /* 创建文件，touch相关 */
-    .write = newfs_write,       /* 写入文件 */
-    .read = newfs_read,         /* 读文件 */
-    .utimens = newfs_utimens,   /* 修改时间，忽略，避免touch报错 */
-    .truncate = newfs_truncate, /* 改变文件大小 */
-    .unlink = NULL,             /* 删除文件 */
-    .rmdir = NULL,              /* 删除目录， rm -r */
-    .rename = NULL,             /* 重命名，mv */
+    .init = newfs_init,                /* mount文件系统 */
+    .destroy = newfs_destroy,          /* umount文件系统 */
+    .mkdir = newfs_locked_mkdir,       /* 建目录，mkdir */
+    .getattr = newfs_locked_getattr,   /* 获取文件属性，类似stat，必须完成 */
+    .readdir = newfs_locked_readdir,   /* 填充dentrys */
+    .mknod = newfs_locked_mknod,       /* 创建文件，touch相关 */
+    .write = newfs_locked_write,       /* 写入文件 */
+    .read = newfs_locked_read,         /* 读文件 */
+    .utimens = newfs_utimens,          /* 修改时间，忽略，避免touch报错 */
+    .truncate = newfs_locked_truncate, /* 改变文件大小 */
+    .unlink = newfs_locked_unlink,     /* 删除文件 */
+    .rmdir = newfs_locked_rmdir,       /* 删除目录， rm -r */
+    .rename = NULL,                    /* 重命名，mv */
 
     .open = NULL,
     .opendir = NULL,
-    .access = newfs_access};
+    .access = newfs_locked_access};
 
 /******************************************************************************
  * SECTION: 辅助函数定义  仿照sfs util
@@ -81,91 +83,495 @@ int newfs_calc_lvl(const char *path)
     }
     return lvl;
 }
+static struct newfs_buf **newfs_buf_slot(int blkno)
+{
+    return &newfs_super.buf_hash[(unsigned)blkno & (NEWFS_BUF_NR - 1)];
+}
+
+static struct newfs_buf *newfs_buf_lookup(int blkno)
+{
+    struct newfs_buf *buf;
+    for (buf = *newfs_buf_slot(blkno); buf != NULL; buf = buf->hnext)
+    {
+        if (buf->blkno == blkno)
+        {
+            return buf;
+        }
+    }
+    return NULL;
+}
+
+static void newfs_buf_lru_del(struct newfs_buf *buf)
+{
+    buf->prev->next = buf->next;
+    buf->next->prev = buf->prev;
+}
+//最近用过的放到表头
+static void newfs_buf_touch(struct newfs_buf *buf)
+{
+    newfs_buf_lru_del(buf);
+    buf->next = newfs_super.buf_lru.next;
+    buf->prev = &newfs_super.buf_lru;
+    newfs_super.buf_lru.next->prev = buf;
+    newfs_super.buf_lru.next = buf;
+}
+/**
+ * @brief 把缓冲块从hash中摘下，清掉标志并放到LRU表尾，优先被复用
+ *
+ * @param buf
+ */
+static void newfs_buf_release(struct newfs_buf *buf)
+{
+    struct newfs_buf **cursor = newfs_buf_slot(buf->blkno);
+    while (*cursor != buf)
+    {
+        cursor = &(*cursor)->hnext;
+    }
+    *cursor = buf->hnext;
+    buf->flag = 0;
+    buf->blkno = -1;
+    newfs_buf_lru_del(buf);
+    buf->prev = newfs_super.buf_lru.prev;
+    buf->next = &newfs_super.buf_lru;
+    newfs_super.buf_lru.prev->next = buf;
+    newfs_super.buf_lru.prev = buf;
+}
+/**
+ * @brief 换出LRU表尾的缓冲块(脏块先写回)，分配给blkno，内容由调用者填
+ *
+ * @param blkno
+ * @return struct newfs_buf* 写回失败返回NULL
+ */
+static struct newfs_buf *newfs_buf_alloc(int blkno)
+{
+    struct newfs_buf *buf = newfs_super.buf_lru.prev;
+
+    if (buf->flag & NEWFS_FLAG_BUF_DIRTY)
+    {
+        if (ddriver_pwrite(NEWFS_DRIVER(), (char *)buf->data, NEWFS_BLK_SZ(),
+                           buf->blkno * NEWFS_BLK_SZ()) != NEWFS_BLK_SZ())
+        {
+            return NULL;
+        }
+        newfs_super.buf_writebacks++;
+    }
+    if (buf->flag & NEWFS_FLAG_BUF_OCCUPY)
+    {
+        newfs_buf_release(buf);
+    }
+    buf->blkno = blkno;
+    buf->flag = NEWFS_FLAG_BUF_OCCUPY;
+    buf->hnext = *newfs_buf_slot(blkno);
+    *newfs_buf_slot(blkno) = buf;
+    newfs_buf_touch(buf);
+    return buf;
+}
+/**
+ * @brief 取第blkno块的缓冲块
+ *
+ * @param blkno
+ * @param need_read 未命中时是否要从磁盘读出原内容，整块覆盖时不需要
+ * @return struct newfs_buf*
+ */
+static struct newfs_buf *newfs_buf_get(int blkno, boolean need_read)
+{
+    struct newfs_buf *buf = newfs_buf_lookup(blkno);
+
+    if (buf != NULL)
+    {
+        newfs_super.buf_hits++;
+        newfs_buf_touch(buf);
+        return buf;
+    }
+    newfs_super.buf_misses++;
+    buf = newfs_buf_alloc(blkno);
+    if (buf != NULL && need_read &&
+        ddriver_pread(NEWFS_DRIVER(), (char *)buf->data, NEWFS_BLK_SZ(),
+                      blkno * NEWFS_BLK_SZ()) != NEWFS_BLK_SZ())
+    {
+        newfs_buf_release(buf);
+        return NULL;
+    }
+    return buf;
+}
+/**
+ * @brief 把[first, last]中连续未命中的块各自合成一次向量读，只寻道一次
+ *
+ * @param first
+ * @param last
+ */
+static void newfs_buf_prefetch(int first, int last)
+{
+    struct iovec iov[NEWFS_BUF_BATCH];
+    struct newfs_buf *bufs[NEWFS_BUF_BATCH];
+    int blkno = first;
+    int cnt, i;
+
+    while (blkno <= last)
+    {
+        for (cnt = 0; blkno <= last && cnt < NEWFS_BUF_BATCH && newfs_buf_lookup(blkno) == NULL;
+             cnt++, blkno++)
+        {
+            bufs[cnt] = newfs_buf_alloc(blkno);
+            if (bufs[cnt] == NULL)
+            {
+                break;
+            }
+            iov[cnt].iov_base = bufs[cnt]->data;
+            iov[cnt].iov_len = NEWFS_BLK_SZ();
+        }
+        if (cnt == 0)
+        {
+            blkno++;
+            continue;
+        }
+        newfs_super.buf_misses += cnt;
+        //读失败的块放回去，之后newfs_buf_get会再单独读一次
+        if (ddriver_readv(NEWFS_DRIVER(), (blkno - cnt) * NEWFS_BLK_SZ(), iov, cnt) !=
+            cnt * NEWFS_BLK_SZ())
+        {
+            for (i = 0; i < cnt; i++)
+            {
+                newfs_buf_release(bufs[i]);
+            }
+            newfs_super.buf_misses -= cnt;
+        }
+    }
+}
+
+static int newfs_buf_cmp(const void *a, const void *b)
+{
+    const struct newfs_buf *ba = *(const struct newfs_buf **)a;
+    const struct newfs_buf *bb = *(const struct newfs_buf **)b;
+    return ba->blkno < bb->blkno ? -1 : (ba->blkno > bb->blkno);
+}
+/**
+ * @brief 分配缓冲区，mount时在知道块大小后调用
+ *
+ * @return int
+ */
+int newfs_buf_init()
+{
+    int i;
+
+    newfs_super.bufs = (struct newfs_buf *)calloc(NEWFS_BUF_NR, sizeof(struct newfs_buf));
+    newfs_super.buf_data = (uint8_t *)malloc(NEWFS_BLKS_SZ(NEWFS_BUF_NR));
+    if (newfs_super.bufs == NULL || newfs_super.buf_data == NULL)
+    {
+        free(newfs_super.bufs);
+        free(newfs_super.buf_data);
+        return -ENOMEM;
+    }
+    memset(newfs_super.buf_hash, 0, sizeof(newfs_super.buf_hash));
+    newfs_super.buf_lru.next = newfs_super.buf_lru.prev = &newfs_super.buf_lru;
+    for (i = 0; i < NEWFS_BUF_NR; i++)
+    {
+        newfs_super.bufs[i].blkno = -1;
+        newfs_super.bufs[i].data = newfs_super.buf_data + NEWFS_BLKS_SZ(i);
+        newfs_super.bufs[i].next = &newfs_super.buf_lru;
+        newfs_super.bufs[i].prev = newfs_super.buf_lru.prev;
+        newfs_super.buf_lru.prev->next = &newfs_super.bufs[i];
+        newfs_super.buf_lru.prev = &newfs_super.bufs[i];
+    }
+    newfs_super.buf_hits = newfs_super.buf_misses = newfs_super.buf_writebacks = 0;
+    pthread_mutex_init(&newfs_super.buf_lock, NULL);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 按块号排序写回所有脏块，块号相邻的合成一次向量写
+ *
+ * @return int
+ */
+int newfs_buf_flush()
+{
+    struct newfs_buf *dirty[NEWFS_BUF_NR];
+    struct iovec iov[NEWFS_BUF_NR];
+    int cnt = 0;
+    int i, j, run;
+    int ret = NEWFS_ERROR_NONE;
+
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    for (i = 0; i < NEWFS_BUF_NR; i++)
+    {
+        if (newfs_super.bufs[i].flag & NEWFS_FLAG_BUF_DIRTY)
+        {
+            dirty[cnt++] = &newfs_super.bufs[i];
+        }
+    }
+    qsort(dirty, cnt, sizeof(struct newfs_buf *), newfs_buf_cmp);
+    for (i = 0; i < cnt; i += run)
+    {
+        for (run = 0; i + run < cnt && dirty[i + run]->blkno == dirty[i]->blkno + run; run++)
+        {
+            iov[run].iov_base = dirty[i + run]->data;
+            iov[run].iov_len = NEWFS_BLK_SZ();
+        }
+        if (ddriver_writev(NEWFS_DRIVER(), dirty[i]->blkno * NEWFS_BLK_SZ(), iov, run) !=
+            run * NEWFS_BLK_SZ())
+        {
+            ret = -NEWFS_ERROR_IO;
+            continue;
+        }
+        for (j = 0; j < run; j++)
+        {
+            dirty[i + j]->flag &= ~NEWFS_FLAG_BUF_DIRTY;
+        }
+        newfs_super.buf_writebacks++;
+    }
+    pthread_mutex_unlock(&newfs_super.buf_lock);
+    return ret;
+}
+/**
+ * @brief 丢掉[offset, offset + len)内的缓冲块，不写回。用于已经释放的块
+ *
+ * @param offset
+ * @param len
+ */
+void newfs_buf_invalidate(int offset, int len)
+{
+    struct newfs_buf *buf;
+    int blkno;
+
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    for (blkno = offset / NEWFS_BLK_SZ(); blkno * NEWFS_BLK_SZ() < offset + len; blkno++)
+    {
+        buf = newfs_buf_lookup(blkno);
+        if (buf != NULL)
+        {
+            newfs_buf_release(buf);
+        }
+    }
+    pthread_mutex_unlock(&newfs_super.buf_lock);
+}
+/**
+ * @brief 把[offset, offset + len)内的块在缓冲区里清零并标脏，不读磁盘。
+ * 用于新分配的块，避免读到以前留下的旧数据
+ *
+ * @param offset 按块对齐
+ * @param len 按块对齐
+ * @return int
+ */
+int newfs_buf_zero(int offset, int len)
+{
+    struct newfs_buf *buf;
+    int blkno;
+
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    for (blkno = offset / NEWFS_BLK_SZ(); blkno * NEWFS_BLK_SZ() < offset + len; blkno++)
+    {
+        buf = newfs_buf_get(blkno, FALSE);
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&newfs_super.buf_lock);
+            return -NEWFS_ERROR_IO;
+        }
+        memset(buf->data, 0, NEWFS_BLK_SZ());
+        buf->flag |= NEWFS_FLAG_BUF_DIRTY;
+    }
+    pthread_mutex_unlock(&newfs_super.buf_lock);
+    return NEWFS_ERROR_NONE;
+}
+
+void newfs_buf_exit()
+{
+    NEWFS_DBG("[%s] buffer hits %d, misses %d, writebacks %d\n", __func__,
+              newfs_super.buf_hits, newfs_super.buf_misses, newfs_super.buf_writebacks);
+    pthread_mutex_destroy(&newfs_super.buf_lock);
+    free(newfs_super.bufs);
+    free(newfs_super.buf_data);
+    newfs_super.bufs = NULL;
+    newfs_super.buf_data = NULL;
+}
 /**
- * @brief 封装ddriver的读,一次读1024B
+ * @brief 经块缓冲区读，未命中的块从磁盘读进缓冲区
  *
  * @param offset 要读的数据在磁盘上的偏移
  * @param out_content 读出的数据首地址放到out_content
  * @param size 要读出的数据大小(字节)
  * @return int
  */
-
 int newfs_driver_read(int offset, uint8_t *out_content, int size)
 {
-    int offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
-    //向下取整，然后把取整失去的部分加到size，为了就是按块读取
-
-    //读取的时候改为BLKSZ，按块读取 offset aligned是要读的数据在磁盘上的位置
-    int bias = offset - offset_aligned;
-    int size_aligned = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    //读取的时候改为BLKSZ，按块读取
-    //这里拿到对齐后的，需要读出的数据的大小
-
-    //分配的内存按EXT2的数据块大小对齐
-    //申请一块临时的内存，用cur指过去
-    uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-
-    //移动磁头到指定数据位置
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
-    {
-        //从磁盘中读取数据到上面申请的内存空间中
-        //每次读写都需要 读写完整的512B 的磁盘块，因此这里还是IOsz
-        ddriver_read(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        //修改内存指针和剩下需要读取的大小，如果剩下需要读取的大小为0，就结束
-        cur += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();
-    }
-    //读出来的东西都在申请的临时空间temp content中，直接copy到目标位置即可
-    memcpy(out_content, temp_content + bias, size);
-
-    //释放申请的空间
-    free(temp_content);
+    int blkno = offset / NEWFS_BLK_SZ();
+    int last = (offset + size - 1) / NEWFS_BLK_SZ();
+    int bias = offset % NEWFS_BLK_SZ();
+    int len;
+    struct newfs_buf *buf;
+
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    newfs_buf_prefetch(blkno, last);
+    for (; blkno <= last; blkno++)
+    {
+        buf = newfs_buf_get(blkno, TRUE);
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&newfs_super.buf_lock);
+            return -NEWFS_ERROR_IO;
+        }
+        len = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        memcpy(out_content, buf->data + bias, len);
+        out_content += len;
+        size -= len;
+        bias = 0;
+    }
+    pthread_mutex_unlock(&newfs_super.buf_lock);
     return NEWFS_ERROR_NONE;
 }
 
 /**
- * @brief 写入数据
+ * @brief 写入块缓冲区并标脏，newfs_buf_flush或换出时才写到磁盘。
+ * 同一块上的多次小写在内存里合并，整块覆盖时不读原内容
  *
- * @param fd ddriver设备handler
- * @param buf 要写入的数据Buf
+ * @param offset 要写的数据在磁盘上的偏移
+ * @param in_content 要写入的数据
  * @param size 要写入的数据大小
  * @return int 0成功，否则失败
  */
-
 int newfs_driver_write(int offset, uint8_t *in_content, int size)
 {
-    int offset_aligned = NEWFS_ROUND_DOWN(offset, NEWFS_BLK_SZ());
-    int bias = offset - offset_aligned;
-    int size_aligned = NEWFS_ROUND_UP((size + bias), NEWFS_BLK_SZ());
-    uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
-    newfs_driver_read(offset_aligned, temp_content, size_aligned);
-    memcpy(temp_content + bias, in_content, size);
+    int blkno = offset / NEWFS_BLK_SZ();
+    int bias = offset % NEWFS_BLK_SZ();
+    int len;
+    struct newfs_buf *buf;
 
-    // lseek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(NEWFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    for (; size > 0; blkno++)
     {
-        ddriver_write(NEWFS_DRIVER(), cur, NEWFS_IO_SZ());
-        cur += NEWFS_IO_SZ();
-        size_aligned -= NEWFS_IO_SZ();
+        len = NEWFS_BLK_SZ() - bias < size ? NEWFS_BLK_SZ() - bias : size;
+        buf = newfs_buf_get(blkno, len != NEWFS_BLK_SZ());
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&newfs_super.buf_lock);
+            return -NEWFS_ERROR_IO;
+        }
+        memcpy(buf->data + bias, in_content, len);
+        buf->flag |= NEWFS_FLAG_BUF_DIRTY;
+        in_content += len;
+        size -= len;
+        bias = 0;
     }
-
-    free(temp_content);
+    pthread_mutex_unlock(&newfs_super.buf_lock);
     return NEWFS_ERROR_NONE;
 }
+/**
+ * @brief mmap模式下返回磁盘offset处在映射中的地址，可以原地读取，
+ * 省掉newfs_driver_read的拷贝
+ *
+ * @param offset 要读的数据在磁盘上的偏移
+ * @param size 要读的字节数
+ * @return void* 设备未开启mmap模式，或者数据在缓冲区中(可能比磁盘上新)时返回NULL，
+ * 调用者退回newfs_driver_read
+ */
+void *newfs_driver_map(int offset, int size)
+{
+    uint8_t *blk;
+    boolean is_cached;
+
+    pthread_mutex_lock(&newfs_super.buf_lock);
+    is_cached = newfs_buf_lookup(offset / NEWFS_BLK_SZ()) != NULL ||
+                newfs_buf_lookup((offset + size - 1) / NEWFS_BLK_SZ()) != NULL;
+    pthread_mutex_unlock(&newfs_super.buf_lock);
+    if (is_cached)
+    {
+        return NULL;
+    }
+    blk = (uint8_t *)ddriver_map_block(NEWFS_DRIVER(), offset / NEWFS_IO_SZ());
+    if (blk == NULL)
+    {
+        return NULL;
+    }
+    return blk + offset % NEWFS_IO_SZ();
+}
+/**
+ * @brief 记下一个已释放的块，等到sync时再批量discard；未开启--discard时忽略
+ *
+ * @param offset 块在磁盘上的偏移
+ * @param len 字节数
+ */
+void newfs_discard_add(int offset, int len)
+{
+    if (!newfs_super.discard)
+    {
+        return;
+    }
+    //攒满了就先发一批
+    if (newfs_super.discard_cnt == NEWFS_DISCARD_BATCH)
+    {
+        newfs_discard_flush();
+    }
+    newfs_super.discards[newfs_super.discard_cnt].offset = offset;
+    newfs_super.discards[newfs_super.discard_cnt].len = len;
+    newfs_super.discard_cnt++;
+}
+/**
+ * @brief 块在discard之前又被分配出去时，撤销对它的discard，否则新数据会被清掉
+ *
+ * @param offset 块在磁盘上的偏移
+ */
+void newfs_discard_cancel(int offset)
+{
+    int i;
+    for (i = 0; i < newfs_super.discard_cnt; i++)
+    {
+        if (newfs_super.discards[i].offset == offset)
+        {
+            newfs_super.discards[i] = newfs_super.discards[--newfs_super.discard_cnt];
+            return;
+        }
+    }
+}
+
+static int newfs_range_cmp(const void *a, const void *b)
+{
+    const struct ddriver_range *ra = (const struct ddriver_range *)a;
+    const struct ddriver_range *rb = (const struct ddriver_range *)b;
+    return ra->offset < rb->offset ? -1 : (ra->offset > rb->offset);
+}
+/**
+ * @brief 按偏移排序，合并相邻的块后逐段discard
+ *
+ * @return int
+ */
+int newfs_discard_flush()
+{
+    struct ddriver_range range;
+    int i;
+    int ret = NEWFS_ERROR_NONE;
+
+    qsort(newfs_super.discards, newfs_super.discard_cnt, sizeof(struct ddriver_range), newfs_range_cmp);
+    for (i = 0; i < newfs_super.discard_cnt; i++)
+    {
+        range = newfs_super.discards[i];
+        //相邻的块合成一段
+        while (i + 1 < newfs_super.discard_cnt &&
+               newfs_super.discards[i + 1].offset == range.offset + range.len)
+        {
+            range.len += newfs_super.discards[++i].len;
+        }
+        if (ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &range) < 0)
+        {
+            NEWFS_DBG("[%s] discard [%lld, %lld) failed\n", __func__,
+                      range.offset, range.offset + range.len);
+            ret = -NEWFS_ERROR_IO;
+        }
+    }
+    newfs_super.discard_cnt = 0;
+    return ret;
+}
 /**
  * @brief 为一个inode分配dentry，采用头插法
- *dentry加入到inode
+ *dentry加入到inode，目录项放不下时目录才多要一块
  * @param inode
  * @param dentry
- * @return int
+ * @return int 目录项数，目录没法增长时返回-NEWFS_ERROR_NOSPACE
  */
 int newfs_alloc_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry)
 {
+    int size = (inode->dir_cnt + 1) * sizeof(struct newfs_dentry_d);
+    if (newfs_inode_grow(inode, NEWFS_ROUND_UP(size, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
+    {
+        return -NEWFS_ERROR_NOSPACE;
+    }
     //如果inode的dentrys为空，就直接让这个head指向dentry
     if (inode->dentrys == NULL)
     {
@@ -181,49 +587,278 @@ int newfs_alloc_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry)
     return inode->dir_cnt;
 }
 /**
- * @brief 分配一个inode，占用位图
+ * @brief 将dentry从inode的dentrys中取出
  *
- * @param dentry 该dentry指向分配的inode
- * @return newfs_inode
+ * @param inode
+ * @param dentry
+ * @return int
  */
-struct newfs_inode *newfs_alloc_inode(struct newfs_dentry *dentry)
+int newfs_drop_dentry(struct newfs_inode *inode, struct newfs_dentry *dentry)
 {
-    struct newfs_inode *inode;
-    int byte_cursor = 0; //按byte对位图进行定位
-    int bit_cursor = 0;  //定位位图中的bit
-    int ino_cursor = 0;  //在inode位图中的编号，其实这里的ino cursor和bit cursor永远是一样的，这个变量删掉也沒事
-    int data_blk_cnt = 0;
-    boolean is_find_free_entry = FALSE;
-    boolean data_blk_flag = FALSE;
-
-    //对位图进行遍历，先按字节找再按比特找
-    for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_inode_blks);
-         byte_cursor++)
-    {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
+    struct newfs_dentry **cursor = &inode->dentrys;
+    //沿着链表找指向dentry的那个指针，改成指向它的下一个
+    while (*cursor != NULL && *cursor != dentry)
+    {
+        cursor = &(*cursor)->brother;
+    }
+    if (*cursor == NULL)
+    {
+        return -NEWFS_ERROR_NOTFOUND;
+    }
+    *cursor = dentry->brother;
+    inode->dir_cnt--;
+    //sync时目录项会紧凑地重写，末尾空出来的块可以还回去
+    newfs_inode_shrink(inode, NEWFS_ROUND_UP(inode->dir_cnt * sizeof(struct newfs_dentry_d), NEWFS_BLK_SZ()) /
+                                  NEWFS_BLK_SZ());
+    return inode->dir_cnt;
+}
+/**
+ * @brief 释放从start开始的len个数据块：清数据位图，丢掉缓冲块，并交给discard批次
+ *
+ * @param start
+ * @param len
+ */
+static void newfs_free_blocks(int start, int len)
+{
+    int blkno;
+    newfs_bitmap_clear_range(&newfs_super.data_bm, start, len);
+    for (blkno = start; blkno < start + len; blkno++)
+    {
+        newfs_buf_invalidate(NEWFS_DATA_OFS(blkno), NEWFS_BLK_SZ()); //释放的块不必再写回
+        newfs_discard_add(NEWFS_DATA_OFS(blkno), NEWFS_BLK_SZ());
+    }
+}
+/**
+ * @brief 在数据位图中分配一段连续的空闲块。先试goal处(紧接文件末尾，分到的块能直接并进
+ * 最后一个extent)，不行再从next-fit游标起取第一段不短于want的空闲段，都没有时取最长的一段。
+ * 分到的块在缓冲区里清零
+ *
+ * @param want 想要的块数
+ * @param goal 优先尝试的起始块号，-1表示不指定
+ * @param start 返回分到的起始块号
+ * @return int 分到的块数，没有空闲块时返回-NEWFS_ERROR_NOSPACE
+ */
+static int newfs_alloc_blocks(int want, int goal, int *start)
+{
+    int len = newfs_bitmap_alloc_run(&newfs_super.data_bm, want, goal, start);
+    int blkno;
+
+    if (len == 0)
+    {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    for (blkno = *start; blkno < *start + len; blkno++)
+    {
+        newfs_discard_cancel(NEWFS_DATA_OFS(blkno));
+    }
+    if (newfs_buf_zero(NEWFS_DATA_OFS(*start), NEWFS_BLKS_SZ(len)) != NEWFS_ERROR_NONE)
+    {
+        newfs_free_blocks(*start, len);
+        return -NEWFS_ERROR_IO;
+    }
+    return len;
+}
+/**
+ * @brief 在extent表末尾追加一段块，和最后一个extent物理上相邻时直接合并
+ *
+ * @param inode
+ * @param start
+ * @param len
+ * @return int
+ */
+static int newfs_extent_append(struct newfs_inode *inode, int start, int len)
+{
+    struct newfs_extent_d *last = inode->extent_cnt > 0 ? &inode->extents[inode->extent_cnt - 1] : NULL;
+    struct newfs_extent_d *extents;
+    int cap;
+
+    if (last != NULL && last->start + last->len == start)
+    {
+        last->len += len;
+        inode->blk_cnt += len;
+        return NEWFS_ERROR_NONE;
+    }
+    if (inode->extent_cnt == inode->extent_cap)
+    {
+        cap = inode->extent_cap > 0 ? inode->extent_cap * 2 : NEWFS_EXTENT_DIRECT;
+        extents = (struct newfs_extent_d *)realloc(inode->extents, cap * sizeof(struct newfs_extent_d));
+        if (extents == NULL)
         {
-            //利用位运算，确定某一位是否为0，如果为0说明他对应的inode位图为空闲，就可以拿来分配。
-            if ((newfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0)
-            {
-                //确定拿来分配以后就要把相应的位图设置为1，表示被占用
-                newfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;
-                break;
-            }
-            ino_cursor++;
+            return -ENOMEM;
         }
-        if (is_find_free_entry)
+        inode->extents = extents;
+        inode->extent_cap = cap;
+    }
+    inode->extents[inode->extent_cnt].start = start;
+    inode->extents[inode->extent_cnt].len = len;
+    inode->extent_cnt++;
+    inode->blk_cnt += len;
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 给inode补块直到共有blks块，每次都从文件末尾接着要，尽量连成一个extent
+ *
+ * @param inode
+ * @param blks
+ * @return int
+ */
+int newfs_inode_grow(struct newfs_inode *inode, int blks)
+{
+    struct newfs_extent_d *last;
+    int goal, start, cnt, ret;
+
+    //空闲块总数不够就不用去找了，也免得分到一半再失败
+    if (blks - inode->blk_cnt > newfs_super.data_bm.nfree)
+    {
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    while (inode->blk_cnt < blks)
+    {
+        last = inode->extent_cnt > 0 ? &inode->extents[inode->extent_cnt - 1] : NULL;
+        goal = last != NULL ? last->start + last->len : -1;
+        cnt = newfs_alloc_blocks(blks - inode->blk_cnt, goal, &start);
+        if (cnt < 0)
         {
-            break;
+            return cnt;
+        }
+        ret = newfs_extent_append(inode, start, cnt);
+        if (ret != NEWFS_ERROR_NONE)
+        {
+            newfs_free_blocks(start, cnt);
+            return ret;
         }
     }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 从文件末尾释放块，直到只剩blks块
+ *
+ * @param inode
+ * @param blks
+ */
+void newfs_inode_shrink(struct newfs_inode *inode, int blks)
+{
+    struct newfs_extent_d *last;
+    int cut;
 
-    if (!is_find_free_entry || ino_cursor == newfs_super.max_ino)
-        return -NEWFS_ERROR_NOSPACE;
+    while (inode->blk_cnt > blks)
+    {
+        last = &inode->extents[inode->extent_cnt - 1];
+        cut = last->len < inode->blk_cnt - blks ? last->len : inode->blk_cnt - blks;
+        newfs_free_blocks(last->start + last->len - cut, cut);
+        last->len -= cut;
+        inode->blk_cnt -= cut;
+        if (last->len == 0)
+        {
+            inode->extent_cnt--;
+        }
+    }
+}
+/**
+ * @brief 把文件内的第lblk块映射到磁盘块号
+ *
+ * @param inode
+ * @param lblk 文件内的逻辑块号
+ * @param run 返回从该块起在同一extent内还连续的块数
+ * @return int 磁盘块号，超出已分配的块时返回-1
+ */
+static int newfs_bmap(struct newfs_inode *inode, int lblk, int *run)
+{
+    int i;
+    for (i = 0; i < inode->extent_cnt; i++)
+    {
+        if (lblk < inode->extents[i].len)
+        {
+            *run = inode->extents[i].len - lblk;
+            return inode->extents[i].start + lblk;
+        }
+        lblk -= inode->extents[i].len;
+    }
+    return -1;
+}
+/**
+ * @brief 按文件内偏移读写inode的数据。一个extent内的部分只发一次newfs_driver_read/write，
+ * 顺序读时缓冲区会把它合成连续的向量读
+ *
+ * @param inode
+ * @param offset 文件内偏移
+ * @param buf
+ * @param size
+ * @param is_write
+ * @return int
+ */
+int newfs_inode_io(struct newfs_inode *inode, int offset, uint8_t *buf, int size, boolean is_write)
+{
+    int blkno, run, bias, len, ret;
+
+    while (size > 0)
+    {
+        blkno = newfs_bmap(inode, offset / NEWFS_BLK_SZ(), &run);
+        if (blkno < 0)
+        {
+            return -NEWFS_ERROR_INVAL;
+        }
+        bias = offset % NEWFS_BLK_SZ();
+        len = NEWFS_BLKS_SZ(run) - bias < size ? NEWFS_BLKS_SZ(run) - bias : size;
+        ret = is_write ? newfs_driver_write(NEWFS_DATA_OFS(blkno) + bias, buf, len)
+                       : newfs_driver_read(NEWFS_DATA_OFS(blkno) + bias, buf, len);
+        if (ret != NEWFS_ERROR_NONE)
+        {
+            return ret;
+        }
+        offset += len;
+        buf += len;
+        size -= len;
+    }
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief mmap模式下返回文件内偏移offset处在映射中的地址，
+ * 只有这段数据在磁盘上连续时才能原地读
+ *
+ * @param inode
+ * @param offset
+ * @param size
+ * @return void* 不能原地读时返回NULL
+ */
+static void *newfs_inode_map(struct newfs_inode *inode, int offset, int size)
+{
+    int run;
+    int bias = offset % NEWFS_BLK_SZ();
+    int blkno = newfs_bmap(inode, offset / NEWFS_BLK_SZ(), &run);
+
+    if (blkno < 0 || NEWFS_BLKS_SZ(run) - bias < size)
+    {
+        return NULL;
+    }
+    return newfs_driver_map(NEWFS_DATA_OFS(blkno) + bias, size);
+}
+/**
+ * @brief 分配一个inode，占用位图
+ *
+ * @param dentry 该dentry指向分配的inode
+ * @return newfs_inode 没有空闲inode或内存不足时返回NULL
+ */
+struct newfs_inode *newfs_alloc_inode(struct newfs_dentry *dentry)
+{
+    struct newfs_inode *inode;
+    //next-fit：从上次分配的位置往后按64位一字找空闲位
+    int ino_cursor = newfs_bitmap_alloc(&newfs_super.inode_bm);
+
+    if (ino_cursor < 0)
+    {
+        return NULL;
+    }
 
     //这一块模仿sfs
     /* 先分配一个 inode */
     inode = (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
+    if (inode == NULL)
+    {
+        newfs_bitmap_clear(&newfs_super.inode_bm, ino_cursor);
+        return NULL;
+    }
+    newfs_discard_cancel(NEWFS_INO_OFS(ino_cursor));
     inode->ino = ino_cursor;
     inode->size = 0;
 
@@ -237,78 +872,194 @@ struct newfs_inode *newfs_alloc_inode(struct newfs_dentry *dentry)
     inode->dir_cnt = 0;
     inode->dentrys = NULL;
 
-    // inode分配完了就要去处理固定分配策略，以及数据位图
-    //下面相当于是给这个inode的四个指针分配相应的空间,固定分配策略
-    /*为这个inode指定四个磁盘块，因为这里还是用了指针桶，所以还是要仿照上面的逻辑进行散列查询
-    如果是文件还会顺带指定随机快，也是因为是固定分配，就直接在这里把随机块给固定下来了
-    */
-    int block_num = 0;
-    if (NEWFS_IS_REG(inode))
+    inode->extents = NULL;
+    inode->extent_cnt = 0;
+    inode->extent_cap = 0;
+    inode->blk_cnt = 0;
+    inode->ext_blks = NULL;
+    inode->ext_blk_cnt = 0;
+    //不预留数据块：文件第一次写时、目录加目录项时才分配，空文件不占数据块
+
+    return inode;
+}
+
+/**
+ * @brief 释放inode：清掉inode位图和数据位图中对应的位，并把这些块交给discard批次
+ * 目录会先递归释放下面所有的inode和dentry
+ *
+ * @param inode
+ * @return int
+ */
+int newfs_drop_inode(struct newfs_inode *inode)
+{
+    struct newfs_dentry *dentry_cursor;
+    struct newfs_dentry *dentry_to_free;
+    int i;
+
+    if (inode == newfs_super.root_dentry->inode)
+    {
+        return -NEWFS_ERROR_INVAL;
+    }
+
+    if (NEWFS_IS_DIR(inode))
+    {
+        dentry_cursor = inode->dentrys;
+        //递归向下drop
+        while (dentry_cursor)
+        {
+            //还没读进内存的子inode要先读进来，才知道它占了哪些块
+            if (dentry_cursor->inode == NULL)
+            {
+                dentry_cursor->inode = newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+            }
+            if (dentry_cursor->inode != NULL)
+            {
+                newfs_drop_inode(dentry_cursor->inode);
+            }
+            dentry_to_free = dentry_cursor;
+            dentry_cursor = dentry_cursor->brother;
+            free(dentry_to_free);
+        }
+        inode->dentrys = NULL;
+        inode->dir_cnt = 0;
+    }
+
+    //清inode位图
+    newfs_bitmap_clear(&newfs_super.inode_bm, inode->ino);
+    newfs_buf_invalidate(NEWFS_INO_OFS(inode->ino), NEWFS_BLK_SZ()); //释放的块不必再写回
+    newfs_discard_add(NEWFS_INO_OFS(inode->ino), NEWFS_BLK_SZ());
+    //清数据位图：数据块和间接extent块
+    newfs_inode_shrink(inode, 0);
+    for (i = 0; i < inode->ext_blk_cnt; i++)
+    {
+        newfs_free_blocks(inode->ext_blks[i], 1);
+    }
+    free(inode->extents);
+    free(inode->ext_blks);
+    free(inode);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 把NEWFS_EXTENT_DIRECT之后的extent写到间接extent块链表里，
+ * 间接块不够时补分配，多余的释放
+ *
+ * @param inode
+ * @return int
+ */
+static int newfs_sync_extents(struct newfs_inode *inode)
+{
+    int per_blk = NEWFS_EXTENT_PER_BLK();
+    int rest = inode->extent_cnt > NEWFS_EXTENT_DIRECT ? inode->extent_cnt - NEWFS_EXTENT_DIRECT : 0;
+    int need = (rest + per_blk - 1) / per_blk;
+    struct newfs_extent_blk_d *hdr;
+    uint8_t *blk;
+    int *ext_blks;
+    int i, cnt, start;
+
+    while (inode->ext_blk_cnt < need)
+    {
+        ext_blks = (int *)realloc(inode->ext_blks, (inode->ext_blk_cnt + 1) * sizeof(int));
+        if (ext_blks == NULL)
+        {
+            return -ENOMEM;
+        }
+        inode->ext_blks = ext_blks;
+        if (newfs_alloc_blocks(1, -1, &start) < 0)
+        {
+            return -NEWFS_ERROR_NOSPACE;
+        }
+        inode->ext_blks[inode->ext_blk_cnt++] = start;
+    }
+    while (inode->ext_blk_cnt > need)
+    {
+        newfs_free_blocks(inode->ext_blks[--inode->ext_blk_cnt], 1);
+    }
+
+    blk = (uint8_t *)malloc(NEWFS_BLK_SZ());
+    if (blk == NULL)
+    {
+        return -ENOMEM;
+    }
+    hdr = (struct newfs_extent_blk_d *)blk;
+    for (i = 0; i < need; i++)
     {
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks);
-             byte_cursor++)
+        cnt = rest - i * per_blk < per_blk ? rest - i * per_blk : per_blk;
+        memset(blk, 0, NEWFS_BLK_SZ());
+        hdr->next = i + 1 < need ? inode->ext_blks[i + 1] : -1;
+        hdr->cnt = cnt;
+        memcpy(hdr + 1, inode->extents + NEWFS_EXTENT_DIRECT + i * per_blk,
+               cnt * sizeof(struct newfs_extent_d));
+        if (newfs_driver_write(NEWFS_DATA_OFS(inode->ext_blks[i]), blk, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
         {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
-            {
-                //如果这个数据位图是空闲的
-                if ((newfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0)
-                {
-                    //取出来，标明1
-                    newfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                    //因为是文件类型，直接分配指针和blocknum
-                    inode->block_pointer[data_blk_cnt] = (uint8_t *)malloc(NEWFS_BLK_SZ());
-                    inode->blocknum[data_blk_cnt++] = block_num;
-                    if (data_blk_cnt == NEWFS_DATA_PER_FILE)
-                    {
-                        data_blk_flag = TRUE;
-                        break;
-                    }
-                }
-                block_num++;
-            }
-
-            if (data_blk_flag)
-            {
-                break;
-            }
+            free(blk);
+            return -NEWFS_ERROR_IO;
         }
     }
-    else
+    free(blk);
+    return NEWFS_ERROR_NONE;
+}
+/**
+ * @brief 按磁盘inode重建extent表，超出NEWFS_EXTENT_DIRECT的部分沿间接块链表读入
+ *
+ * @param inode
+ * @param inode_d
+ * @return int
+ */
+static int newfs_read_extents(struct newfs_inode *inode, struct newfs_inode_d *inode_d)
+{
+    struct newfs_extent_blk_d *hdr;
+    uint8_t *blk;
+    int *ext_blks;
+    int blkno = inode_d->ext_blk;
+    int cnt = inode_d->extent_cnt;
+    int i, n;
+
+    inode->extent_cap = cnt > NEWFS_EXTENT_DIRECT ? cnt : NEWFS_EXTENT_DIRECT;
+    inode->extents = (struct newfs_extent_d *)malloc(inode->extent_cap * sizeof(struct newfs_extent_d));
+    inode->extent_cnt = cnt < NEWFS_EXTENT_DIRECT ? cnt : NEWFS_EXTENT_DIRECT;
+    inode->ext_blks = NULL;
+    inode->ext_blk_cnt = 0;
+    blk = (uint8_t *)malloc(NEWFS_BLK_SZ());
+    if (inode->extents == NULL || blk == NULL)
+    {
+        free(blk);
+        return -ENOMEM;
+    }
+    memcpy(inode->extents, inode_d->extents, inode->extent_cnt * sizeof(struct newfs_extent_d));
+
+    hdr = (struct newfs_extent_blk_d *)blk;
+    while (inode->extent_cnt < cnt && blkno >= 0)
     {
-        for (byte_cursor = 0; byte_cursor < NEWFS_BLKS_SZ(newfs_super.map_data_blks);
-             byte_cursor++)
+        if (newfs_driver_read(NEWFS_DATA_OFS(blkno), blk, NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
         {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
-            {
-                if ((newfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0)
-                {
-                    newfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                    //不是文件类型，只需要分配磁盘块,不分配内存空间
-                    inode->blocknum[data_blk_cnt++] = bit_cursor;
-                    if (data_blk_cnt == NEWFS_DATA_PER_FILE)
-                    {
-                        data_blk_flag = TRUE;
-                        break;
-                    }
-                }
-                // blocknum_cursor++;
-            }
-            if (data_blk_flag)
-            {
-                break;
-            }
+            free(blk);
+            return -NEWFS_ERROR_IO;
         }
+        ext_blks = (int *)realloc(inode->ext_blks, (inode->ext_blk_cnt + 1) * sizeof(int));
+        if (ext_blks == NULL)
+        {
+            free(blk);
+            return -ENOMEM;
+        }
+        inode->ext_blks = ext_blks;
+        inode->ext_blks[inode->ext_blk_cnt++] = blkno;
+        n = hdr->cnt < cnt - inode->extent_cnt ? hdr->cnt : cnt - inode->extent_cnt;
+        memcpy(inode->extents + inode->extent_cnt, hdr + 1, n * sizeof(struct newfs_extent_d));
+        inode->extent_cnt += n;
+        blkno = hdr->next;
     }
+    free(blk);
 
-    if (!data_blk_flag || bit_cursor == newfs_super.max_data)
-        return -NEWFS_ERROR_NOSPACE;
-
-    return inode;
+    inode->blk_cnt = 0;
+    for (i = 0; i < inode->extent_cnt; i++)
+    {
+        inode->blk_cnt += inode->extents[i].len;
+    }
+    return NEWFS_ERROR_NONE;
 }
-
 /**
  * @brief 将内存中的inode写回相应到磁盘的inode
- *这里是仅仅写回inode本身的内容
+ *这里是仅仅写回inode本身的内容，以及放不进inode的extent
  * @param inode
  * @return int
  */
@@ -316,17 +1067,28 @@ int newfs_sync_inode_d(struct newfs_inode *inode)
 {
     //建一个临时的磁盘inode，写入相关属性
     struct newfs_inode_d inode_d;
+    memset(&inode_d, 0, sizeof(struct newfs_inode_d));
     inode_d.ino = inode->ino;
     inode_d.size = inode->size;
     inode_d.ftype = inode->dentry->ftype;
     inode_d.dir_cnt = inode->dir_cnt;
-    int blk_cnt = 0;
-    //数据块的块号写回，因为这个是我们新加入的
-    for (blk_cnt = 0; blk_cnt < NEWFS_DATA_PER_FILE; blk_cnt++)
-        inode_d.blocknum[blk_cnt] = inode->blocknum[blk_cnt]; /* 数据块的块号也要赋值 */
+    //extent表：前NEWFS_EXTENT_DIRECT个放在inode里，其余写到间接块
+    if (newfs_sync_extents(inode) != NEWFS_ERROR_NONE)
+    {
+        return -NEWFS_ERROR_IO;
+    }
+    inode_d.extent_cnt = inode->extent_cnt;
+    inode_d.ext_blk = inode->ext_blk_cnt > 0 ? inode->ext_blks[0] : -1;
+    //空文件和空目录没有extent表，inode->extents为NULL
+    if (inode->extent_cnt > 0)
+    {
+        memcpy(inode_d.extents, inode->extents,
+               (inode->extent_cnt < NEWFS_EXTENT_DIRECT ? inode->extent_cnt : NEWFS_EXTENT_DIRECT) *
+                   sizeof(struct newfs_extent_d));
+    }
     //剩下的用driver write  把磁盘inode写回磁盘
     if (newfs_driver_write(NEWFS_INO_OFS(inode->ino), (uint8_t *)&inode_d,
-                           sizeof(struct newfs_inode)) != NEWFS_ERROR_NONE)
+                           sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE)
     {
         return -NEWFS_ERROR_IO;
     }
@@ -341,139 +1103,164 @@ int newfs_sync_inode_d(struct newfs_inode *inode)
  */
 int newfs_sync_inode(struct newfs_inode *inode)
 {
-    //新建一个磁盘类型inode，为后面写入磁盘准备
-    struct newfs_inode_d inode_d;
     struct newfs_dentry *dentry_cursor;
-    struct newfs_dentry_d dentry_d;
-    int ino = inode->ino;
-    //把相应的属性设置好
-    inode_d.ino = ino;
-    inode_d.size = inode->size;
-    inode_d.ftype = inode->dentry->ftype;
-    inode_d.dir_cnt = inode->dir_cnt;
-    //先写回inode本身的
-    newfs_sync_inode_d(inode);
-    int blk_cnt = 0;
-    int offset;
-    //再写回inode下方的
-    /* Cycle 1: 写 INODE */
-    /* Cycle 2: 写 数据 */
-    if (NEWFS_IS_DIR(inode)) //因为是目录类型，因此要写回目录项dentry
-    {
-        blk_cnt = 0;
-        dentry_cursor = inode->dentrys;
-        //拿到内存中的dentry的头，内存中的inode是我们要写回磁盘的东西
-
-        while (dentry_cursor != NULL) //退出条件就是遍历完内存inode的所有dentry
-        {
-            //找到inode分配的首个数据块
-            offset = NEWFS_DATA_OFS(inode->blocknum[blk_cnt]); // dentry 从 inode 分配的首个数据块开始存
-            /* 写满一个 blk 时换到下一个 blocknum */
-            while (dentry_cursor != NULL)
-            { //把内存中的dentry，复制到上面申请的临时的磁盘dentry中
-                memcpy(dentry_d.fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
-                dentry_d.ftype = dentry_cursor->ftype;
-                dentry_d.ino = dentry_cursor->ino;
-                //把磁盘的dentry写回磁盘
-                if (newfs_driver_write(offset, (uint8_t *)&dentry_d,
-                                       sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE)
-                {
-                    NEWFS_DBG("[%s] io error\n", __func__);
-                    return -NEWFS_ERROR_IO;
-                }
-                //如果这个内存dentry下还有inode，就递归把它写进磁盘
-                if (dentry_cursor->inode != NULL)
-                {
-                    newfs_sync_inode(dentry_cursor->inode);
-                }
-                //处理完这个dentry，去到他的下一个dentry
-                dentry_cursor = dentry_cursor->brother;
-                //修改offset
-                offset += sizeof(struct newfs_dentry_d);
-            }
-            blk_cnt++; /* 访问下一个指向的数据块 */
-        }
-    }
-    else if (NEWFS_IS_REG(inode)) //如果是文件，就直接写回数据块
+    struct newfs_dentry_d *dentrys_d;
+    int size = inode->dir_cnt * sizeof(struct newfs_dentry_d);
+    int i = 0;
+    int ret;
+    /* Cycle 1: 写 数据 */
+    /* Cycle 2: 写 INODE */
+    if (NEWFS_IS_DIR(inode) && inode->dir_cnt > 0) //因为是目录类型，因此要写回目录项dentry
     {
-        for (blk_cnt = 0; blk_cnt < NEWFS_DATA_PER_FILE; blk_cnt++)
+        //目录项按顺序排在目录的数据里，块在newfs_alloc_dentry时已经分好，拼好一次写入
+        dentrys_d = (struct newfs_dentry_d *)calloc(inode->dir_cnt, sizeof(struct newfs_dentry_d));
+        if (dentrys_d == NULL)
         {
-            if (newfs_driver_write(NEWFS_DATA_OFS(inode->blocknum[blk_cnt]),
-                                   inode->block_pointer[blk_cnt], NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
+            return -ENOMEM;
+        }
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; dentry_cursor = dentry_cursor->brother)
+        { //把内存中的dentry，复制到磁盘dentry中
+            memcpy(dentrys_d[i].fname, dentry_cursor->fname, NEWFS_MAX_FILE_NAME);
+            dentrys_d[i].ftype = dentry_cursor->ftype;
+            dentrys_d[i].ino = dentry_cursor->ino;
+            i++;
+            //如果这个内存dentry下还有inode，就递归把它写进磁盘
+            if (dentry_cursor->inode != NULL)
             {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return -NEWFS_ERROR_IO;
+                newfs_sync_inode(dentry_cursor->inode);
             }
         }
+        ret = newfs_inode_io(inode, 0, (uint8_t *)dentrys_d, size, TRUE);
+        free(dentrys_d);
+        if (ret != NEWFS_ERROR_NONE)
+        {
+            NEWFS_DBG("[%s] io error\n", __func__);
+            return -NEWFS_ERROR_IO;
+        }
     }
-    return NEWFS_ERROR_NONE;
+    //文件的数据写的时候已经进了块缓冲区，这里只剩inode本身
+    return newfs_sync_inode_d(inode);
+}
+/**
+ * @brief 读inode出错时释放已经建好的部分：读进来的子dentry、extent表和inode本身
+ *
+ * @param inode
+ */
+static void newfs_free_read_inode(struct newfs_inode *inode)
+{
+    struct newfs_dentry *dentry_cursor = inode->dentrys;
+    struct newfs_dentry *dentry_to_free;
+
+    while (dentry_cursor)
+    {
+        dentry_to_free = dentry_cursor;
+        dentry_cursor = dentry_cursor->brother;
+        free(dentry_to_free);
+    }
+    free(inode->extents);
+    free(inode->ext_blks);
+    free(inode);
 }
 /**
  * @brief
  *
  * @param dentry dentry指向ino，读取该inode
  * @param ino inode唯一编号
- * @return struct newfs_inode*
+ * @return struct newfs_inode* 内存不足或读盘出错时返回NULL
  */
 struct newfs_inode *newfs_read_inode(struct newfs_dentry *dentry, int ino)
 {
-    struct newfs_inode *inode = (struct newfs_inode *)malloc(sizeof(struct newfs_inode));
-    struct newfs_inode_d inode_d;
+    struct newfs_inode *inode = (struct newfs_inode *)calloc(1, sizeof(struct newfs_inode));
+    struct newfs_inode_d inode_d_buf;
+    struct newfs_inode_d *inode_d;
     struct newfs_dentry *sub_dentry;
-    struct newfs_dentry_d dentry_d;
-    int blk_cnt = 0;
+    struct newfs_dentry_d dentry_d_buf;
+    struct newfs_dentry_d *dentry_d;
     int dir_cnt = 0;
 
-    //从第ino个inode中把磁盘中的inode读到inode_d中
-    if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d,
-                          sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE)
+    if (inode == NULL)
     {
-        NEWFS_DBG("[%s] io error\n", __func__);
         return NULL;
     }
+    //mmap模式下直接在映射里读磁盘inode，否则从第ino个inode中把磁盘中的inode读到inode_d_buf中
+    inode_d = (struct newfs_inode_d *)newfs_driver_map(NEWFS_INO_OFS(ino), sizeof(struct newfs_inode_d));
+    if (inode_d == NULL)
+    {
+        if (newfs_driver_read(NEWFS_INO_OFS(ino), (uint8_t *)&inode_d_buf,
+                              sizeof(struct newfs_inode_d)) != NEWFS_ERROR_NONE)
+        {
+            NEWFS_DBG("[%s] io error\n", __func__);
+            free(inode);
+            return NULL;
+        }
+        inode_d = &inode_d_buf;
+    }
     inode->dir_cnt = 0;
-    inode->ino = inode_d.ino;
-    inode->size = inode_d.size;
+    inode->ino = inode_d->ino;
+    inode->size = inode_d->size;
     inode->dentry = dentry; /* 指回父级 dentry*/
     inode->dentrys = NULL;
-    for (blk_cnt = 0; blk_cnt < NEWFS_DATA_PER_FILE; blk_cnt++)
-        inode->blocknum[blk_cnt] = inode_d.blocknum[blk_cnt];
     //在内存中重建ino对应的inode，因为他和磁盘中的inode_d结构不同
+    if (newfs_read_extents(inode, inode_d) != NEWFS_ERROR_NONE)
+    {
+        NEWFS_DBG("[%s] io error\n", __func__);
+        newfs_free_read_inode(inode);
+        return NULL;
+    }
 
     if (NEWFS_IS_DIR(inode)) //如果是文件夹，则读入目录
     {
-        dir_cnt = inode_d.dir_cnt;
-        //这里我发现了一个神奇的事情，就即使连续读也是可以读进来，说明虽然设计了离散的指针桶
-        //但其实没起作用，他们还是连续的
+        dir_cnt = inode_d->dir_cnt;
+        //目录项在目录的数据里按顺序排列，可能跨块也可能跨extent
         //一共有dir_cnt个dentry要读
         for (int i = 0; i < dir_cnt; i++)
-        { //从磁盘中依次读进来
-            if (newfs_driver_read(NEWFS_INO_OFS(ino) + i * sizeof(struct newfs_dentry_d), (uint8_t *)&dentry_d,
-                                  sizeof(struct newfs_dentry_d)) != NEWFS_ERROR_NONE)
+        { //从磁盘中依次读进来，mmap模式下原地读
+            dentry_d = (struct newfs_dentry_d *)newfs_inode_map(inode, i * sizeof(struct newfs_dentry_d),
+                                                                sizeof(struct newfs_dentry_d));
+            if (dentry_d == NULL)
             {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return NULL;
+                if (newfs_inode_io(inode, i * sizeof(struct newfs_dentry_d), (uint8_t *)&dentry_d_buf,
+                                   sizeof(struct newfs_dentry_d), FALSE) != NEWFS_ERROR_NONE)
+                {
+                    NEWFS_DBG("[%s] io error\n", __func__);
+                    newfs_free_read_inode(inode);
+                    return NULL;
+                }
+                dentry_d = &dentry_d_buf;
             }
             //用subdentry来重建，并分配给inode
-            sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
+            sub_dentry = new_dentry(dentry_d->fname, dentry_d->ftype);
             sub_dentry->parent = inode->dentry;
-            sub_dentry->ino = dentry_d.ino;
+            sub_dentry->ino = dentry_d->ino;
             newfs_alloc_dentry(inode, sub_dentry);
         }
     }
-    else if (NEWFS_IS_REG(inode)) //如果是文件，则读入数据块
+    //文件的数据不再整个读进内存，读写时按extent经块缓冲区访问
+    return inode;
+}
+/**
+ * @brief 返回dentry的inode，未读入时先读入。只读操作持有读锁时也会走到这里，
+ * 所以读入过程用load_lock互斥，读入完成后再发布给其它线程
+ *
+ * @param dentry
+ * @return struct newfs_inode*
+ */
+struct newfs_inode *newfs_load_inode(struct newfs_dentry *dentry)
+{
+    struct newfs_inode *inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+    if (inode != NULL)
+    {
+        return inode;
+    }
+
+    pthread_mutex_lock(&newfs_super.load_lock);
+    inode = dentry->inode;
+    if (inode == NULL)
     {
-        for (blk_cnt = 0; blk_cnt < NEWFS_DATA_PER_FILE; blk_cnt++)
-        {
-            inode->block_pointer[blk_cnt] = (uint8_t *)malloc(NEWFS_BLK_SZ()); /* 只分配一个块 */
-            if (newfs_driver_read(NEWFS_DATA_OFS(inode->blocknum[blk_cnt]), inode->block_pointer[blk_cnt],
-                                  NEWFS_BLK_SZ()) != NEWFS_ERROR_NONE)
-            {
-                NEWFS_DBG("[%s] io error\n", __func__);
-                return NULL;
-            }
-        }
+        inode = newfs_read_inode(dentry, dentry->ino);
+        __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
     }
+    pthread_mutex_unlock(&newfs_super.load_lock);
     return inode;
 }
 /**
@@ -523,7 +1310,8 @@ struct newfs_dentry *newfs_lookup(const char *path, boolean *is_find, boolean *i
     int lvl = 0;
     boolean is_hit;
     char *fname = NULL;
-    char *path_cpy = (char *)malloc(sizeof(path));
+    char *save = NULL;
+    char *path_cpy = (char *)malloc(strlen(path) + 1);
     *is_root = FALSE;
     strcpy(path_cpy, path);
     //首先计算路径的级数，如果为0说明是根目录。
@@ -536,18 +1324,20 @@ struct newfs_dentry *newfs_lookup(const char *path, boolean *is_find, boolean *i
 
     //不为0则需要从根目录开始，依次匹配路径中的目录项，直到找到文件所对应的目录项。
     //如果没找到则返回最后一次匹配的目录项。
-    fname = strtok(path_cpy, "/");
+    //FUSE多线程下不能用strtok的全局状态
+    fname = strtok_r(path_cpy, "/", &save);
     while (fname)
     {
         lvl++;
-        if (dentry_cursor->inode == NULL) // inode未被读入
-        {                                 /* Cache机制 */
-                                          //读进来即可
-            newfs_read_inode(dentry_cursor, dentry_cursor->ino);
+        //inode未被读入则读进来，Cache机制
+        inode = newfs_load_inode(dentry_cursor);
+        if (inode == NULL)
+        { //读盘出错，没有可返回的目录项
+            *is_find = FALSE;
+            dentry_ret = NULL;
+            break;
         }
 
-        inode = dentry_cursor->inode;
-
         if (NEWFS_IS_REG(inode) && lvl < total_lvl)
         { //该目录项的inode为文件，则返回上一级目录
             NEWFS_DBG("[%s] not a dir\n", __func__);
@@ -560,8 +1350,9 @@ struct newfs_dentry *newfs_lookup(const char *path, boolean *is_find, boolean *i
             is_hit = FALSE;
             //找到当前inode下文件名字与fname相同的目录项
             while (dentry_cursor)
-            { //判断名称是否相同
-                if (memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0)
+            { //判断名称是否相同：长度也要相等，否则/d/f1会匹配到f19
+                if (strnlen(dentry_cursor->fname, NEWFS_MAX_FILE_NAME) == strlen(fname) &&
+                    memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0)
                 {
                     is_hit = TRUE;
                     break;
@@ -587,12 +1378,14 @@ struct newfs_dentry *newfs_lookup(const char *path, boolean *is_find, boolean *i
             }
         }
         //若找到了fname，当深度还不够，则以dentry_cursor继续循环。
-        fname = strtok(NULL, "/"); //获取分解的下一位
+        fname = strtok_r(NULL, "/", &save); //获取分解的下一位
     }
-    //若要返回的目录项的inode还没读入，则需先读入。
-    if (dentry_ret->inode == NULL)
+    free(path_cpy);
+    //若要返回的目录项的inode还没读入，则需先读入。读不出来时和上面一样返回NULL
+    if (dentry_ret != NULL && newfs_load_inode(dentry_ret) == NULL)
     {
-        dentry_ret->inode = newfs_read_inode(dentry_ret, dentry_ret->ino);
+        *is_find = FALSE;
+        dentry_ret = NULL;
     }
 
     return dentry_ret;
@@ -627,6 +1420,8 @@ int newfs_mount(struct custom_options options)
     boolean is_init = FALSE; //是否被初始化
 
     newfs_super.is_mounted = FALSE;
+    pthread_rwlock_init(&newfs_super.lock, NULL);
+    pthread_mutex_init(&newfs_super.load_lock, NULL);
 
     driver_fd = ddriver_open(options.device);
 
@@ -635,9 +1430,17 @@ int newfs_mount(struct custom_options options)
         return driver_fd;
     }
 
-    newfs_super.driver_fd = driver_fd;                                        //把打开设备的句柄给到内存结构超级块
+    newfs_super.driver_fd = driver_fd;
+    newfs_super.discard = options.discard;
+    newfs_super.discard_cnt = 0;                                        //把打开设备的句柄给到内存结构超级块
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &newfs_super.sz_disk); //表明设备大小和io大小
     ddriver_ioctl(NEWFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &newfs_super.sz_io);
+    //块大小确定以后才能分配缓冲区
+    ret = newfs_buf_init();
+    if (ret != NEWFS_ERROR_NONE)
+    {
+        return ret;
+    }
 
     //创建根目录项
     root_dentry = new_dentry("/", NEWFS_DIR);
@@ -682,8 +1485,8 @@ int newfs_mount(struct custom_options options)
         map_data_blks = 1;
 
         /* 布局layout */
-        newfs_super.max_ino = inode_num;
-        newfs_super.max_data = data_num;
+        newfs_super_d.max_ino = inode_num;
+        newfs_super_d.max_data = data_num;
 
         // layout应该是
         //超级块  inode位图  数据位图  inode  datablock
@@ -694,6 +1497,13 @@ int newfs_mount(struct custom_options options)
 
         newfs_super_d.inode_offset = newfs_super_d.map_data_offset + NEWFS_BLKS_SZ(map_data_blks);
         newfs_super_d.data_offset = newfs_super_d.inode_offset + NEWFS_BLKS_SZ(inode_num);
+        //块大小随设备IO大小变化, 布局可能超出磁盘(例如4KiB扇区的小盘)
+        if (newfs_super_d.data_offset + (long long)NEWFS_BLKS_SZ(data_num) > NEWFS_DISK_SZ())
+        {
+            NEWFS_DBG("[%s] layout needs %lld bytes, disk has %d\n", __func__,
+                      newfs_super_d.data_offset + (long long)NEWFS_BLKS_SZ(data_num), NEWFS_DISK_SZ());
+            return -NEWFS_ERROR_NOSPACE;
+        }
 
         newfs_super_d.map_inode_blks = map_inode_blks;
         newfs_super_d.map_data_blks = map_data_blks;
@@ -716,6 +1526,9 @@ int newfs_mount(struct custom_options options)
     //索引节点和数据块在磁盘中的偏移
     newfs_super.inode_offset = newfs_super_d.inode_offset;
     newfs_super.data_offset = newfs_super_d.data_offset;
+    //inode数和数据块数存在超级块里，重新挂载时也要知道位图有多少有效位
+    newfs_super.max_ino = newfs_super_d.max_ino;
+    newfs_super.max_data = newfs_super_d.max_data;
 
     /* 读取两个位图到内存空间 */
     if (newfs_driver_read(newfs_super_d.map_inode_offset, (uint8_t *)(newfs_super.map_inode),
@@ -728,14 +1541,28 @@ int newfs_mount(struct custom_options options)
     {
         return -NEWFS_ERROR_IO;
     }
+    //按位图内容重建空闲摘要
+    if (newfs_bitmap_init(&newfs_super.inode_bm, newfs_super.map_inode, newfs_super.max_ino) < 0 ||
+        newfs_bitmap_init(&newfs_super.data_bm, newfs_super.map_data, newfs_super.max_data) < 0)
+    {
+        return -NEWFS_ERROR_NOSPACE;
+    }
     //分配根目录项
     if (is_init)
     { //给根目录项分配inode，这里是初始化inode
         root_inode = newfs_alloc_inode(root_dentry);
+        if (root_inode == NULL)
+        {
+            return -NEWFS_ERROR_NOSPACE;
+        }
         newfs_sync_inode(root_inode); /* 将重建后的 根inode 写回磁盘 */
     }
 
     root_inode = newfs_read_inode(root_dentry, NEWFS_ROOT_INO);
+    if (root_inode == NULL)
+    {
+        return -NEWFS_ERROR_IO;
+    }
     root_dentry->inode = root_inode;
     newfs_super.root_dentry = root_dentry;
     newfs_super.is_mounted = TRUE;
@@ -769,6 +1596,9 @@ int newfs_umount()
 
     newfs_super_d.inode_offset = newfs_super.inode_offset;
     newfs_super_d.data_offset = newfs_super.data_offset;
+
+    newfs_super_d.max_ino = newfs_super.max_ino;
+    newfs_super_d.max_data = newfs_super.max_data;
     //写回超级块
     if (newfs_driver_write(NEWFS_SUPER_OFS, (uint8_t *)&newfs_super_d,
                            sizeof(struct newfs_super_d)) != NEWFS_ERROR_NONE)
@@ -789,6 +1619,17 @@ int newfs_umount()
         return -NEWFS_ERROR_IO;
     }
 
+    //缓冲区里攒下的脏块一次写回
+    if (newfs_buf_flush() != NEWFS_ERROR_NONE)
+    {
+        return -NEWFS_ERROR_IO;
+    }
+    //元数据都落盘以后，再丢弃已释放的块
+    newfs_discard_flush();
+
+    newfs_buf_exit();
+    newfs_bitmap_destroy(&newfs_super.inode_bm);
+    newfs_bitmap_destroy(&newfs_super.data_bm);
     free(newfs_super.map_inode);
     free(newfs_super.map_data);
     ddriver_close(NEWFS_DRIVER());
@@ -859,6 +1700,10 @@ int newfs_mkdir(const char *path, mode_t mode)
     {
         return -NEWFS_ERROR_EXISTS;
     }
+    if (last_dentry == NULL)
+    {
+        return -NEWFS_ERROR_IO;
+    }
 
     if (NEWFS_IS_REG(last_dentry->inode))
     {
@@ -872,7 +1717,18 @@ int newfs_mkdir(const char *path, mode_t mode)
     //这一块处理前驱后继的方式与mknod类似
     dentry->parent = last_dentry;
     inode = newfs_alloc_inode(dentry);
-    newfs_alloc_dentry(last_dentry->inode, dentry);
+    if (inode == NULL)
+    {
+        free(dentry);
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    //父目录没法再长出放目录项的块时，撤销刚分配的inode
+    if (newfs_alloc_dentry(last_dentry->inode, dentry) < 0)
+    {
+        newfs_drop_inode(inode);
+        free(dentry);
+        return -NEWFS_ERROR_NOSPACE;
+    }
 
     return NEWFS_ERROR_NONE;
 }
@@ -992,6 +1848,10 @@ int newfs_mknod(const char *path, mode_t mode, dev_t dev)
     {
         return -NEWFS_ERROR_EXISTS;
     }
+    if (last_dentry == NULL)
+    {
+        return -NEWFS_ERROR_IO;
+    }
     //文件不存在则在创建目录项和对应的inode，并和父目录项建立连接。
     fname = newfs_get_fname(path);
 
@@ -1006,7 +1866,18 @@ int newfs_mknod(const char *path, mode_t mode, dev_t dev)
     //处理前驱后继关系
     dentry->parent = last_dentry;
     inode = newfs_alloc_inode(dentry);
-    newfs_alloc_dentry(last_dentry->inode, dentry);
+    if (inode == NULL)
+    {
+        free(dentry);
+        return -NEWFS_ERROR_NOSPACE;
+    }
+    //父目录没法再长出放目录项的块时，撤销刚分配的inode
+    if (newfs_alloc_dentry(last_dentry->inode, dentry) < 0)
+    {
+        newfs_drop_inode(inode);
+        free(dentry);
+        return -NEWFS_ERROR_NOSPACE;
+    }
 
     return NEWFS_ERROR_NONE;
 }
@@ -1044,6 +1915,7 @@ int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
     //找到路径对应的dentry
     struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
     struct newfs_inode *inode;
+    int ret;
     //如果没找到就报错
     if (is_find == FALSE)
     {
@@ -1061,44 +1933,16 @@ int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
     {
         return -NEWFS_ERROR_SEEK;
     }
-    //把offset 和 size换算成对应块号和偏移
-    uint64_t start_blk = 0;
-    uint64_t start_offset = 0;
-    uint64_t end_blk = 0;
-    uint64_t end_offset = 0;
-    //开始块号和偏移
-    start_blk = offset / NEWFS_BLK_SZ();
-    start_offset = offset % NEWFS_BLK_SZ();
-    //结束块号和偏移
-    end_blk = (offset + size) / NEWFS_BLK_SZ();
-    end_offset = (offset + size) % NEWFS_BLK_SZ();
-    char *buf_offset = buf;
-    //接下来就按块来操作他们
-    //如果开始和结束在同一个块中，直接copy到对应的数据块即可
-    if (start_blk == end_blk)
-    {
-        memcpy(inode->block_pointer[start_blk] + start_offset, buf, size);
+    //块不够就从文件末尾接着分配，尽量和已有的块连成一个extent
+    ret = newfs_inode_grow(inode, NEWFS_ROUND_UP(offset + size, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ());
+    if (ret != NEWFS_ERROR_NONE)
+    {
+        return ret;
     }
-    else
+    ret = newfs_inode_io(inode, offset, (uint8_t *)buf, size, TRUE);
+    if (ret != NEWFS_ERROR_NONE)
     {
-        //否则就先把第一个块的内容拷贝过去，不一定是整个块，使用好offset
-        memcpy(inode->block_pointer[start_blk] + start_offset, buf,
-               NEWFS_BLK_SZ() - start_offset);
-        buf_offset = buf_offset + (NEWFS_BLK_SZ() - start_offset);
-        start_blk++;
-        //然后就处理中间的整块
-        while (start_blk < end_blk && start_blk < 4)
-        {
-            memcpy(inode->block_pointer[start_blk], buf_offset, NEWFS_BLK_SZ());
-            start_blk++;
-            buf_offset = buf_offset + NEWFS_BLK_SZ();
-        }
-        //最后处理最后一块的部分，同样不一定是整块
-        if (start_blk < 4 && start_blk == end_blk)
-        {
-            memcpy(inode->block_pointer[end_blk], buf_offset,
-                   end_offset);
-        }
+        return ret;
     }
 
     inode->size = offset + size > inode->size ? offset + size : inode->size;
@@ -1121,11 +1965,7 @@ int newfs_read(const char *path, char *buf, size_t size, off_t offset,
 {
     /* 选做 */
     boolean is_find, is_root;
-    char *buf_offset = buf;
-    int start_blk = 0;
-    int start_offset = 0;
-    int end_blk = 0;
-    int end_offset = 0;
+    int ret;
 
     struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
     struct newfs_inode *inode;
@@ -1146,42 +1986,33 @@ int newfs_read(const char *path, char *buf, size_t size, off_t offset,
     {
         return -NEWFS_ERROR_SEEK;
     }
-
-    start_blk = offset / NEWFS_BLK_SZ();
-    start_offset = offset % NEWFS_BLK_SZ();
-
-    end_blk = (offset + size) / NEWFS_BLK_SZ();
-    end_offset = (offset + size) % NEWFS_BLK_SZ();
-
-    if (start_blk == end_blk)
+    //不读过文件末尾
+    if (offset + size > inode->size)
     {
-        memcpy(buf, inode->block_pointer[start_blk] + start_offset, size);
+        size = inode->size - offset;
     }
-    else
+    ret = newfs_inode_io(inode, offset, (uint8_t *)buf, size, FALSE);
+    if (ret != NEWFS_ERROR_NONE)
     {
-
-        memcpy(buf, inode->block_pointer[start_blk] + start_offset,
-               NEWFS_BLK_SZ() - start_offset);
-        buf_offset = buf + (NEWFS_BLK_SZ() - start_offset);
-        start_blk++;
-
-        while (start_blk < end_blk && start_blk < 4)
-        {
-            memcpy(buf_offset, inode->block_pointer[start_blk], NEWFS_BLK_SZ());
-            start_blk++;
-            buf_offset = buf_offset + NEWFS_BLK_SZ();
-        }
-
-        if (start_blk < 4 && start_blk == end_blk)
-        {
-            memcpy(buf_offset, inode->block_pointer[end_blk],
-                   end_offset);
-        }
+        return ret;
     }
 
     return size;
 }
 
+/**
+ * @brief 把dentry从父目录里删掉并释放它的inode
+ *
+ * @param dentry
+ */
+static void newfs_remove(struct newfs_dentry *dentry)
+{
+    //先释放inode占的块，再把dentry从父目录里摘掉
+    newfs_drop_inode(dentry->inode);
+    newfs_drop_dentry(dentry->parent->inode, dentry);
+    free(dentry);
+}
+
 /**
  * @brief 删除文件
  *
@@ -1190,8 +2021,24 @@ int newfs_read(const char *path, char *buf, size_t size, off_t offset,
  */
 int newfs_unlink(const char *path)
 {
-    /* 选做 */
-    return 0;
+    boolean is_find, is_root;
+    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
+
+    if (is_find == FALSE)
+    {
+        return -NEWFS_ERROR_NOTFOUND;
+    }
+    if (is_root)
+    {
+        return -NEWFS_ERROR_INVAL;
+    }
+    //目录要用rmdir删
+    if (NEWFS_IS_DIR(dentry->inode))
+    {
+        return -NEWFS_ERROR_ISDIR;
+    }
+    newfs_remove(dentry);
+    return NEWFS_ERROR_NONE;
 }
 
 /**
@@ -1208,8 +2055,28 @@ int newfs_unlink(const char *path)
  */
 int newfs_rmdir(const char *path)
 {
-    /* 选做 */
-    return 0;
+    boolean is_find, is_root;
+    struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
+
+    if (is_find == FALSE)
+    {
+        return -NEWFS_ERROR_NOTFOUND;
+    }
+    if (is_root)
+    {
+        return -NEWFS_ERROR_INVAL;
+    }
+    if (NEWFS_IS_REG(dentry->inode))
+    {
+        return -NEWFS_ERROR_NOTDIR;
+    }
+    //只删空目录，rm -r会先删掉下面的文件
+    if (dentry->inode->dir_cnt > 0)
+    {
+        return -NEWFS_ERROR_NOTEMPTY;
+    }
+    newfs_remove(dentry);
+    return NEWFS_ERROR_NONE;
 }
 
 /**
@@ -1265,6 +2132,8 @@ int newfs_truncate(const char *path, off_t offset)
     boolean is_find, is_root;
     struct newfs_dentry *dentry = newfs_lookup(path, &is_find, &is_root);
     struct newfs_inode *inode;
+    uint8_t *zeros;
+    int tail, ret;
 
     if (is_find == FALSE)
     {
@@ -1278,10 +2147,38 @@ int newfs_truncate(const char *path, off_t offset)
         return -NEWFS_ERROR_ISDIR;
     }
 
+    //变小时释放末尾用不到的块；变大时新块已经清零，只需清掉原末尾块里size之后的旧内容
+    if (offset < inode->size)
+    {
+        newfs_inode_shrink(inode, NEWFS_ROUND_UP(offset, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ());
+    }
+    else if (offset > inode->size)
+    {
+        tail = NEWFS_BLKS_SZ(inode->blk_cnt) < offset ? NEWFS_BLKS_SZ(inode->blk_cnt) : offset;
+        tail -= inode->size;
+        ret = newfs_inode_grow(inode, NEWFS_ROUND_UP(offset, NEWFS_BLK_SZ()) / NEWFS_BLK_SZ());
+        if (ret != NEWFS_ERROR_NONE)
+        {
+            return ret;
+        }
+        if (tail > 0)
+        {
+            zeros = (uint8_t *)calloc(1, tail);
+            if (zeros == NULL)
+            {
+                return -ENOMEM;
+            }
+            ret = newfs_inode_io(inode, inode->size, zeros, tail, TRUE);
+            free(zeros);
+            if (ret != NEWFS_ERROR_NONE)
+            {
+                return ret;
+            }
+        }
+    }
     inode->size = offset;
 
     return NEWFS_ERROR_NONE;
-    return 0;
 }
 
 /**
@@ -1326,6 +2223,97 @@ int newfs_access(const char *path, int type)
     }
     return is_access_ok ? NEWFS_ERROR_NONE : -NEWFS_ERROR_ACCESS;
 }
+/******************************************************************************
+ * SECTION: 并发包装
+ * 上面的实现都假设单线程。只读操作(getattr/readdir/read/access)持读锁，
+ * 可以并发执行；修改目录树、位图或文件内容的操作持写锁
+ *******************************************************************************/
+#define NEWFS_RDLOCK() pthread_rwlock_rdlock(&newfs_super.lock)
+#define NEWFS_WRLOCK() pthread_rwlock_wrlock(&newfs_super.lock)
+#define NEWFS_UNLOCK() pthread_rwlock_unlock(&newfs_super.lock)
+
+int newfs_locked_mkdir(const char *path, mode_t mode)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_mkdir(path, mode);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_getattr(const char *path, struct stat *newfs_stat)
+{
+    NEWFS_RDLOCK();
+    int ret = newfs_getattr(path, newfs_stat);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                         struct fuse_file_info *fi)
+{
+    NEWFS_RDLOCK();
+    int ret = newfs_readdir(path, buf, filler, offset, fi);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_mknod(path, mode, dev);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_write(const char *path, const char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_write(path, buf, size, offset, fi);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+    NEWFS_RDLOCK();
+    int ret = newfs_read(path, buf, size, offset, fi);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_truncate(const char *path, off_t offset)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_truncate(path, offset);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_unlink(const char *path)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_unlink(path);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_rmdir(const char *path)
+{
+    NEWFS_WRLOCK();
+    int ret = newfs_rmdir(path);
+    NEWFS_UNLOCK();
+    return ret;
+}
+
+int newfs_locked_access(const char *path, int type)
+{
+    NEWFS_RDLOCK();
+    int ret = newfs_access(path, type);
+    NEWFS_UNLOCK();
+    return ret;
+}
 /******************************************************************************
  * SECTION: FUSE入口
  *******************************************************************************/
@@ -1343,4 +2331,4 @@ int main(int argc, char **argv)
     ret = fuse_main(args.argc, args.argv, &operations, NULL);
     fuse_opt_free_args(&args);
     return ret;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../include/newfs_bitmap.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/******************************************************************************
+ * SECTION: 宏定义
+ *******************************************************************************/
+#define NEWFS_WORD_BITS 64
+#define NEWFS_ALL_ONES (~0ULL)
+#define NEWFS_GROUP_END(bm, g) ((g) + 1 < (bm)->ngroups ? ((g) + 1) * NEWFS_BITMAP_GROUP_BITS : (bm)->nbits)
+
+/******************************************************************************
+ * SECTION: 辅助函数
+ *******************************************************************************/
+/**
+ * @brief 读位图的第w个64位字，第i位对应字里的第i % 64位
+ *
+ * @param bm
+ * @param w
+ * @return uint64_t
+ */
+static inline uint64_t newfs_bitmap_word(struct newfs_bitmap *bm, int w)
+{
+    uint64_t x;
+    memcpy(&x, bm->map + w * sizeof(uint64_t), sizeof(uint64_t));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+/**
+ * @brief 写回位图的第w个64位字
+ *
+ * @param bm
+ * @param w
+ * @param x
+ */
+static inline void newfs_bitmap_word_store(struct newfs_bitmap *bm, int w, uint64_t x)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    memcpy(bm->map + w * sizeof(uint64_t), &x, sizeof(uint64_t));
+}
+
+#ifdef __AVX2__
+/**
+ * @brief 从第w个字开始的256位与flip异或后是否全为0，即整组都不是要找的位
+ *
+ * @param bm
+ * @param w
+ * @param flip
+ * @return int
+ */
+static inline int newfs_bitmap_skip256(struct newfs_bitmap *bm, int w, uint64_t flip)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(bm->map + w * sizeof(uint64_t)));
+    v = _mm256_xor_si256(v, _mm256_set1_epi64x((long long)flip));
+    return _mm256_testz_si256(v, v);
+}
+#endif
+
+/**
+ * @brief 在[from, to)中找第一个与flip异或后为1的位：flip为0时找置位，全1时找空闲位
+ *
+ * @param bm
+ * @param from
+ * @param to
+ * @param flip
+ * @return int 找不到返回-1
+ */
+static int newfs_bitmap_scan(struct newfs_bitmap *bm, int from, int to, uint64_t flip)
+{
+    int w, last, bit;
+    uint64_t x;
+
+    if (to > bm->nbits)
+    {
+        to = bm->nbits;
+    }
+    if (from < 0)
+    {
+        from = 0;
+    }
+    if (from >= to)
+    {
+        return -1;
+    }
+    w = from / NEWFS_WORD_BITS;
+    last = (to - 1) / NEWFS_WORD_BITS;
+    //第一个字里from之前的位不算
+    x = (newfs_bitmap_word(bm, w) ^ flip) & (NEWFS_ALL_ONES << (from % NEWFS_WORD_BITS));
+    while (x == 0)
+    {
+        if (++w > last)
+        {
+            return -1;
+        }
+#ifdef __AVX2__
+        while (w + 4 <= last + 1 && newfs_bitmap_skip256(bm, w, flip))
+        {
+            w += 4;
+        }
+        if (w > last)
+        {
+            return -1;
+        }
+#endif
+        x = newfs_bitmap_word(bm, w) ^ flip;
+    }
+    bit = w * NEWFS_WORD_BITS + __builtin_ctzll(x);
+    return bit < to ? bit : -1;
+}
+
+/**
+ * @brief [from, to)中置位的位数
+ *
+ * @param bm
+ * @param from
+ * @param to
+ * @return int
+ */
+static int newfs_bitmap_count(struct newfs_bitmap *bm, int from, int to)
+{
+    int cnt = 0;
+    int w;
+    uint64_t x;
+
+    for (w = from / NEWFS_WORD_BITS; w * NEWFS_WORD_BITS < to; w++)
+    {
+        x = newfs_bitmap_word(bm, w);
+        if (w * NEWFS_WORD_BITS < from)
+        {
+            x &= NEWFS_ALL_ONES << (from % NEWFS_WORD_BITS);
+        }
+        if ((w + 1) * NEWFS_WORD_BITS > to)
+        {
+            x &= NEWFS_ALL_ONES >> (NEWFS_WORD_BITS - to % NEWFS_WORD_BITS);
+        }
+        cnt += __builtin_popcountll(x);
+    }
+    return cnt;
+}
+/**
+ * @brief 第g组的空闲位数变了delta：更新计数和顶层位，组内统计作废
+ *
+ * @param bm
+ * @param g
+ * @param delta
+ */
+static void newfs_bitmap_group_update(struct newfs_bitmap *bm, int g, int delta)
+{
+    struct newfs_bitmap_group *grp = &bm->groups[g];
+
+    grp->nfree += delta;
+    grp->maxrun = -1;
+    bm->nfree += delta;
+    if (grp->nfree > 0)
+    {
+        bm->avail[g / NEWFS_WORD_BITS] |= 1ULL << (g % NEWFS_WORD_BITS);
+    }
+    else
+    {
+        bm->avail[g / NEWFS_WORD_BITS] &= ~(1ULL << (g % NEWFS_WORD_BITS));
+    }
+}
+/**
+ * @brief 重新统计第g组的最长空闲段和首尾空闲位数，没改过时直接返回
+ *
+ * @param bm
+ * @param g
+ * @return struct newfs_bitmap_group*
+ */
+static struct newfs_bitmap_group *newfs_bitmap_group_stat(struct newfs_bitmap *bm, int g)
+{
+    struct newfs_bitmap_group *grp = &bm->groups[g];
+    int start = g * NEWFS_BITMAP_GROUP_BITS;
+    int end = NEWFS_GROUP_END(bm, g);
+    int bit = start;
+    int run_end;
+
+    if (grp->maxrun >= 0)
+    {
+        return grp;
+    }
+    grp->maxrun = grp->head = grp->tail = 0;
+    grp->maxrun_start = -1;
+    while (grp->nfree > 0 && (bit = newfs_bitmap_scan(bm, bit, end, NEWFS_ALL_ONES)) >= 0)
+    {
+        run_end = newfs_bitmap_scan(bm, bit, end, 0);
+        if (run_end < 0)
+        {
+            run_end = end;
+        }
+        if (run_end - bit > grp->maxrun)
+        {
+            grp->maxrun = run_end - bit;
+            grp->maxrun_start = bit;
+        }
+        if (bit == start)
+        {
+            grp->head = run_end - bit;
+        }
+        if (run_end == end)
+        {
+            grp->tail = run_end - bit;
+        }
+        bit = run_end;
+    }
+    return grp;
+}
+/**
+ * @brief 顶层位图中从第g组起第一个还有空闲位的组
+ *
+ * @param bm
+ * @param g
+ * @return int 没有返回-1
+ */
+static int newfs_bitmap_next_group(struct newfs_bitmap *bm, int g)
+{
+    int w = g / NEWFS_WORD_BITS;
+    uint64_t x;
+
+    if (g >= bm->ngroups)
+    {
+        return -1;
+    }
+    x = bm->avail[w] & (NEWFS_ALL_ONES << (g % NEWFS_WORD_BITS));
+    while (x == 0)
+    {
+        if (++w * NEWFS_WORD_BITS >= bm->ngroups)
+        {
+            return -1;
+        }
+        x = bm->avail[w];
+    }
+    g = w * NEWFS_WORD_BITS + __builtin_ctzll(x);
+    return g < bm->ngroups ? g : -1;
+}
+
+/******************************************************************************
+ * SECTION: 位图操作
+ *******************************************************************************/
+/**
+ * @brief 挂在map上并按位图内容重建两级摘要
+ *
+ * @param bm
+ * @param map
+ * @param nbits
+ * @return int
+ */
+int newfs_bitmap_init(struct newfs_bitmap *bm, uint8_t *map, int nbits)
+{
+    int g;
+
+    bm->map = map;
+    bm->nbits = nbits;
+    bm->hint = 0;
+    bm->nfree = 0;
+    bm->ngroups = (nbits + NEWFS_BITMAP_GROUP_BITS - 1) / NEWFS_BITMAP_GROUP_BITS;
+    bm->groups = (struct newfs_bitmap_group *)calloc(bm->ngroups, sizeof(struct newfs_bitmap_group));
+    bm->avail = (uint64_t *)calloc((bm->ngroups + NEWFS_WORD_BITS - 1) / NEWFS_WORD_BITS, sizeof(uint64_t));
+    if (bm->groups == NULL || bm->avail == NULL)
+    {
+        newfs_bitmap_destroy(bm);
+        return -ENOMEM;
+    }
+    for (g = 0; g < bm->ngroups; g++)
+    {
+        newfs_bitmap_group_update(bm, g, NEWFS_GROUP_END(bm, g) - g * NEWFS_BITMAP_GROUP_BITS -
+                                             newfs_bitmap_count(bm, g * NEWFS_BITMAP_GROUP_BITS,
+                                                                NEWFS_GROUP_END(bm, g)));
+    }
+    return 0;
+}
+
+void newfs_bitmap_destroy(struct newfs_bitmap *bm)
+{
+    free(bm->groups);
+    free(bm->avail);
+    bm->groups = NULL;
+    bm->avail = NULL;
+}
+
+int newfs_bitmap_test(struct newfs_bitmap *bm, int bit)
+{
+    return (bm->map[bit / 8] >> (bit % 8)) & 0x1;
+}
+
+void newfs_bitmap_set(struct newfs_bitmap *bm, int bit)
+{
+    if (!newfs_bitmap_test(bm, bit))
+    {
+        bm->map[bit / 8] |= (uint8_t)(0x1 << (bit % 8));
+        newfs_bitmap_group_update(bm, bit / NEWFS_BITMAP_GROUP_BITS, -1);
+    }
+}
+
+void newfs_bitmap_clear(struct newfs_bitmap *bm, int bit)
+{
+    if (newfs_bitmap_test(bm, bit))
+    {
+        bm->map[bit / 8] &= (uint8_t)(~(0x1 << (bit % 8)));
+        newfs_bitmap_group_update(bm, bit / NEWFS_BITMAP_GROUP_BITS, 1);
+    }
+}
+/**
+ * @brief 按字把[start, end)内的位都改成val，不更新摘要
+ *
+ * @param bm
+ * @param start
+ * @param end
+ * @param val
+ * @return int 改之前置位的位数
+ */
+static int newfs_bitmap_fill(struct newfs_bitmap *bm, int start, int end, int val)
+{
+    int ones = 0;
+    int w;
+    uint64_t x, mask;
+
+    for (w = start / NEWFS_WORD_BITS; w * NEWFS_WORD_BITS < end; w++)
+    {
+        mask = NEWFS_ALL_ONES;
+        if (w * NEWFS_WORD_BITS < start)
+        {
+            mask &= NEWFS_ALL_ONES << (start % NEWFS_WORD_BITS);
+        }
+        if ((w + 1) * NEWFS_WORD_BITS > end)
+        {
+            mask &= NEWFS_ALL_ONES >> (NEWFS_WORD_BITS - end % NEWFS_WORD_BITS);
+        }
+        x = newfs_bitmap_word(bm, w);
+        ones += __builtin_popcountll(x & mask);
+        newfs_bitmap_word_store(bm, w, val ? x | mask : x & ~mask);
+    }
+    return ones;
+}
+/**
+ * @brief 按组把[start, start + len)改成val，并更新各组摘要
+ *
+ * @param bm
+ * @param start
+ * @param len
+ * @param val
+ */
+static void newfs_bitmap_fill_range(struct newfs_bitmap *bm, int start, int len, int val)
+{
+    int end = start + len;
+    int g, seg_end, ones;
+
+    while (start < end)
+    {
+        g = start / NEWFS_BITMAP_GROUP_BITS;
+        seg_end = NEWFS_GROUP_END(bm, g) < end ? NEWFS_GROUP_END(bm, g) : end;
+        ones = newfs_bitmap_fill(bm, start, seg_end, val);
+        newfs_bitmap_group_update(bm, g, val ? -(seg_end - start - ones) : ones);
+        start = seg_end;
+    }
+}
+
+void newfs_bitmap_set_range(struct newfs_bitmap *bm, int start, int len)
+{
+    newfs_bitmap_fill_range(bm, start, len, 1);
+}
+
+void newfs_bitmap_clear_range(struct newfs_bitmap *bm, int start, int len)
+{
+    newfs_bitmap_fill_range(bm, start, len, 0);
+}
+/**
+ * @brief [from, to)中第一个空闲位。from所在的组找不到时，在顶层跳过满的组
+ *
+ * @return int 找不到返回-1
+ */
+int newfs_bitmap_find_zero(struct newfs_bitmap *bm, int from, int to)
+{
+    int g, bit;
+
+    if (to > bm->nbits)
+    {
+        to = bm->nbits;
+    }
+    if (from < 0)
+    {
+        from = 0;
+    }
+    if (from >= to)
+    {
+        return -1;
+    }
+    g = from / NEWFS_BITMAP_GROUP_BITS;
+    if (bm->groups[g].nfree > 0)
+    {
+        bit = newfs_bitmap_scan(bm, from, NEWFS_GROUP_END(bm, g) < to ? NEWFS_GROUP_END(bm, g) : to,
+                                NEWFS_ALL_ONES);
+        if (bit >= 0)
+        {
+            return bit;
+        }
+    }
+    g = newfs_bitmap_next_group(bm, g + 1);
+    if (g < 0 || g * NEWFS_BITMAP_GROUP_BITS >= to)
+    {
+        return -1;
+    }
+    return newfs_bitmap_scan(bm, g * NEWFS_BITMAP_GROUP_BITS, to, NEWFS_ALL_ONES);
+}
+/**
+ * @brief [from, to)中第一个已置位的位
+ *
+ * @return int 找不到返回-1
+ */
+int newfs_bitmap_find_one(struct newfs_bitmap *bm, int from, int to)
+{
+    return newfs_bitmap_scan(bm, from, to, 0);
+}
+/**
+ * @brief next-fit分配一位：从游标找到末尾，没有再从头找到游标
+ *
+ * @param bm
+ * @return int 分到的位，位图满时返回-1
+ */
+int newfs_bitmap_alloc(struct newfs_bitmap *bm)
+{
+    int bit = newfs_bitmap_find_zero(bm, bm->hint, bm->nbits);
+
+    if (bit < 0)
+    {
+        bit = newfs_bitmap_find_zero(bm, 0, bm->hint);
+    }
+    if (bit < 0)
+    {
+        return -1;
+    }
+    newfs_bitmap_set(bm, bit);
+    bm->hint = bit + 1 < bm->nbits ? bit + 1 : 0;
+    return bit;
+}
+/**
+ * @brief 在[from, to)中逐段找连续空闲位，够want就停，否则best记下最长的一段。
+ * 起点在to之前的段可以越过to，最多取到want
+ *
+ * @param bm
+ * @param from
+ * @param to
+ * @param want
+ * @param best 进出都是目前最长段的长度
+ * @param best_start 进出都是目前最长段的起始位
+ */
+static void newfs_bitmap_scan_run(struct newfs_bitmap *bm, int from, int to, int want,
+                                  int *best, int *best_start)
+{
+    int bit = from;
+    int lim, end;
+
+    while (*best < want && (bit = newfs_bitmap_find_zero(bm, bit, to)) >= 0)
+    {
+        lim = want < bm->nbits - bit ? bit + want : bm->nbits;
+        end = newfs_bitmap_scan(bm, bit, lim, 0);
+        end = end < 0 ? lim : end;
+        if (end - bit > *best)
+        {
+            *best = end - bit;
+            *best_start = bit;
+        }
+        bit = end;
+    }
+}
+/**
+ * @brief 找一段连续的空闲位，不修改位图。先试goal处，再从游标逐段找到游标所在组的末尾；
+ * 还不够want就按组查摘要：组内最长空闲段够长就直接用，组尾有空闲位时再看它接上后面的组
+ * 能有多长。找到末尾后再从头找一遍，都不够时给出最长的一段
+ *
+ * @param bm
+ * @param want 想要的位数
+ * @param goal 优先尝试的起始位，-1表示不指定
+ * @param start 返回起始位
+ * @return int 找到的位数，不超过want；没有空闲位时返回0
+ */
+int newfs_bitmap_find_run(struct newfs_bitmap *bm, int want, int goal, int *start)
+{
+    struct newfs_bitmap_group *grp;
+    int best = 0;
+    int best_start = -1;
+    int first = bm->hint / NEWFS_BITMAP_GROUP_BITS;
+    int pass, lo, hi, g, bit;
+
+    if (goal >= 0 && goal < bm->nbits && !newfs_bitmap_test(bm, goal))
+    {
+        newfs_bitmap_scan_run(bm, goal, goal + 1, want, &best, &best_start);
+    }
+    //游标所在的组刚分配过，摘要多半已作废，直接逐段找比重新统计省事
+    newfs_bitmap_scan_run(bm, bm->hint, NEWFS_GROUP_END(bm, first), want, &best, &best_start);
+    //再找(first, ngroups)，然后绕回[0, first]
+    for (pass = 0; pass < 2 && best < want; pass++)
+    {
+        lo = pass == 0 ? first + 1 : 0;
+        hi = pass == 0 ? bm->ngroups : first + 1;
+        for (g = newfs_bitmap_next_group(bm, lo); g >= 0 && g < hi && best < want;
+             g = newfs_bitmap_next_group(bm, g + 1))
+        {
+            grp = newfs_bitmap_group_stat(bm, g);
+            if (grp->maxrun > best)
+            {
+                best = grp->maxrun < want ? grp->maxrun : want;
+                best_start = grp->maxrun_start;
+            }
+            //组尾的空闲段可能延伸到后面的组
+            if (grp->tail > 0 && g + 1 < bm->ngroups)
+            {
+                bit = NEWFS_GROUP_END(bm, g) - grp->tail;
+                newfs_bitmap_scan_run(bm, bit, bit + 1, want, &best, &best_start);
+            }
+        }
+    }
+    if (best > 0)
+    {
+        *start = best_start;
+    }
+    return best;
+}
+/**
+ * @brief 用newfs_bitmap_find_run找一段并置位，游标移到这段之后
+ *
+ * @param bm
+ * @param want
+ * @param goal
+ * @param start
+ * @return int 分到的位数，没有空闲位时返回0
+ */
+int newfs_bitmap_alloc_run(struct newfs_bitmap *bm, int want, int goal, int *start)
+{
+    int len = newfs_bitmap_find_run(bm, want, goal, start);
+
+    if (len > 0)
+    {
+        newfs_bitmap_set_range(bm, *start, len);
+        bm->hint = *start + len < bm->nbits ? *start + len : 0;
+    }
+    return len;
+}
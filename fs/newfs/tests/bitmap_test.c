@@ -0,0 +1,208 @@
+#include "../include/newfs_bitmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * newfs位图的正确性测试：随机改位图，每步都和逐位实现的参照模型比对
+ * find_zero、find_one、alloc、find_run的结果以及nfree和各组的空闲计数。
+ * 位数取几个不是64整数倍、跨组边界的值；开了NEWFS_AVX2时同时覆盖AVX2路径。
+ *
+ *   newfs_bitmap_test [轮数]
+ */
+
+#define TEST_ROUNDS 300
+#define TEST_OPS 64
+
+#define CHECK(cond)                                                                \
+    do                                                                             \
+    {                                                                              \
+        if (!(cond))                                                               \
+        {                                                                          \
+            fprintf(stderr, "%s:%d: nbits %d: check failed: %s\n", __FILE__, __LINE__, \
+                    nbits, #cond);                                                 \
+            exit(1);                                                               \
+        }                                                                          \
+    } while (0)
+
+static const int sizes[] = {1, 63, 64, 65, 511, 512, 513, 1000, 1536, 2048, 4103};
+static unsigned long long rng = 0x2545f4914f6cdd1dULL;
+
+static int rand_int(int n)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (int)(rng % (unsigned long long)n);
+}
+/**
+ * @brief 参照模型：[from, to)中第一个值为val的位
+ */
+static int ref_find(const char *ref, int nbits, int from, int to, int val)
+{
+    int i;
+
+    for (i = from < 0 ? 0 : from; i < to && i < nbits; i++)
+    {
+        if (ref[i] == val)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+/**
+ * @brief 参照模型：最长空闲段的长度
+ */
+static int ref_maxrun(const char *ref, int nbits)
+{
+    int best = 0, cur = 0;
+    int i;
+
+    for (i = 0; i < nbits; i++)
+    {
+        cur = ref[i] ? 0 : cur + 1;
+        best = cur > best ? cur : best;
+    }
+    return best;
+}
+/**
+ * @brief 位图与参照模型逐位一致，空闲计数和顶层位也一致
+ */
+static void check_state(struct newfs_bitmap *bm, const char *ref, int nbits)
+{
+    int g, i, end, nfree, total = 0;
+
+    for (i = 0; i < nbits; i++)
+    {
+        CHECK(newfs_bitmap_test(bm, i) == ref[i]);
+    }
+    for (g = 0; g < bm->ngroups; g++)
+    {
+        end = (g + 1) * NEWFS_BITMAP_GROUP_BITS < nbits ? (g + 1) * NEWFS_BITMAP_GROUP_BITS : nbits;
+        nfree = 0;
+        for (i = g * NEWFS_BITMAP_GROUP_BITS; i < end; i++)
+        {
+            nfree += !ref[i];
+        }
+        CHECK(bm->groups[g].nfree == nfree);
+        CHECK((int)((bm->avail[g / 64] >> (g % 64)) & 1) == (nfree > 0));
+        total += nfree;
+    }
+    CHECK(bm->nfree == total);
+}
+
+static void check_finds(struct newfs_bitmap *bm, const char *ref, int nbits)
+{
+    int from, to, want, goal, start, len, best, i;
+
+    for (i = 0; i < 16; i++)
+    {
+        from = rand_int(nbits + 8) - 4;
+        to = rand_int(nbits + 8);
+        CHECK(newfs_bitmap_find_zero(bm, from, to) == ref_find(ref, nbits, from, to, 0));
+        CHECK(newfs_bitmap_find_one(bm, from, to) == ref_find(ref, nbits, from, to, 1));
+    }
+    want = 1 + rand_int(rand_int(2) ? 40 : 1200);
+    goal = rand_int(nbits + 4) - 2;
+    bm->hint = rand_int(nbits);
+    start = -1;
+    len = newfs_bitmap_find_run(bm, want, goal, &start);
+    best = ref_maxrun(ref, nbits);
+    CHECK(len == (best < want ? best : want));
+    for (i = 0; i < len; i++)
+    {
+        CHECK(start + i < nbits && !ref[start + i]);
+    }
+}
+
+static void run_round(int nbits)
+{
+    struct newfs_bitmap bm;
+    uint8_t *map = (uint8_t *)calloc((nbits + 63) / 64 * 8, 1);
+    char *ref = (char *)calloc(nbits, 1);
+    int density = rand_int(101);
+    int op, i, a, len, bit, start, want;
+
+    for (i = 0; i < nbits; i++)
+    {
+        if (rand_int(100) < density)
+        {
+            ref[i] = 1;
+            map[i / 8] |= (uint8_t)(1 << (i % 8));
+        }
+    }
+    CHECK(newfs_bitmap_init(&bm, map, nbits) == 0);
+    check_state(&bm, ref, nbits);
+
+    for (op = 0; op < TEST_OPS; op++)
+    {
+        a = rand_int(nbits);
+        len = rand_int(nbits - a + 1);
+        switch (rand_int(5))
+        {
+        case 0:
+            newfs_bitmap_set_range(&bm, a, len);
+            memset(ref + a, 1, len);
+            break;
+        case 1:
+            newfs_bitmap_clear_range(&bm, a, len);
+            memset(ref + a, 0, len);
+            break;
+        case 2:
+            for (i = 0; i < 32; i++)
+            {
+                bit = rand_int(nbits);
+                ref[bit] = (char)rand_int(2);
+                ref[bit] ? newfs_bitmap_set(&bm, bit) : newfs_bitmap_clear(&bm, bit);
+            }
+            break;
+        case 3:
+            //next-fit：从游标找到末尾，没有再从头找
+            bm.hint = rand_int(nbits);
+            a = ref_find(ref, nbits, bm.hint, nbits, 0);
+            if (a < 0)
+            {
+                a = ref_find(ref, nbits, 0, bm.hint, 0);
+            }
+            bit = newfs_bitmap_alloc(&bm);
+            CHECK(bit == a);
+            if (bit >= 0)
+            {
+                ref[bit] = 1;
+            }
+            break;
+        default:
+            want = 1 + rand_int(64);
+            len = newfs_bitmap_alloc_run(&bm, want, rand_int(nbits), &start);
+            CHECK(len <= want && (len > 0) == (bm.nfree + len > 0));
+            for (i = 0; i < len; i++)
+            {
+                CHECK(!ref[start + i]);
+                ref[start + i] = 1;
+            }
+            break;
+        }
+        check_state(&bm, ref, nbits);
+        check_finds(&bm, ref, nbits);
+    }
+    newfs_bitmap_destroy(&bm);
+    free(ref);
+    free(map);
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : TEST_ROUNDS;
+    int r, s;
+
+    for (r = 0; r < rounds; r++)
+    {
+        for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+        {
+            run_round(sizes[s]);
+        }
+    }
+    printf("newfs bitmap: %d rounds x %d sizes passed\n", rounds, (int)(sizeof(sizes) / sizeof(sizes[0])));
+    return 0;
+}
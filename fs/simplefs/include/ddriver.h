@@ -3,12 +3,92 @@
 
 #include "ddriver_ctl_user.h"
 #include "stdio.h"
+#include <sys/uio.h>
+#include <stdint.h>
+
+#define DDRIVER_PROFILE_ENV         "DDRIVER_PROFILE"
+#define DDRIVER_PROFILE_MMAP        0x1
+#define DDRIVER_PROFILE_NO_LATENCY  0x2
+#define DDRIVER_PROFILE_CHUNKED     0x4
+
+struct ddriver_profile {
+    uint64_t disk_size;
+    uint32_t block_size;
+    uint32_t track_num;
+    uint32_t read_lat_us;
+    uint32_t write_lat_us;
+    uint32_t seek_lat_us;
+    uint32_t flags;
+    uint32_t flush_ms;
+    uint64_t cache_size;
+};
 
 int ddriver_open(char *path);
+int ddriver_open_ex(char *path, const struct ddriver_profile *profile);
+int ddriver_profile_parse(const char *spec, struct ddriver_profile *profile);
 int ddriver_seek(int fd, off_t offset, int whence);
 int ddriver_write(int fd, char *buf, size_t size);
 int ddriver_read(int fd, char *buf, size_t size);
+int ddriver_readv(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+int ddriver_writev(int fd, off_t offset, const struct iovec *iov, int iovcnt);
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+void *ddriver_map_block(int fd, int blkno);
 int ddriver_ioctl(int fd, unsigned long cmd, void *ret);
 int ddriver_close(int fd);
 
+#define DDRIVER_TRACE_ENV       "DDRIVER_TRACE"
+#define DDRIVER_TRACE_MAGIC     0x52544444
+#define DDRIVER_TRACE_VERSION   1
+
+struct ddriver_trace_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t disk_size;
+};
+
+struct ddriver_trace_rec {
+    uint64_t ts_us;
+    int64_t  offset;
+    uint32_t size;
+    uint16_t op;
+    uint16_t tag;
+};
+
+int ddriver_trace_start(int fd, const char *path);
+int ddriver_trace_stop(int fd);
+unsigned ddriver_trace_tag(unsigned tag);
+
+#define DDRIVER_OP_NOP          0
+#define DDRIVER_OP_READ         1
+#define DDRIVER_OP_WRITE        2
+#define DDRIVER_OP_SEEK         3
+
+#define DDRIVER_RING_EVENTFD    0x1
+
+struct ddriver_sqe {
+    int      opcode;
+    off_t    offset;
+    void     *buf;
+    size_t   size;
+    uint64_t user_data;
+};
+
+struct ddriver_cqe {
+    uint64_t user_data;
+    int      res;
+};
+
+struct ddriver_ring;
+
+int ddriver_ring_init(int fd, unsigned entries, unsigned flags, struct ddriver_ring **ring);
+struct ddriver_sqe *ddriver_ring_get_sqe(struct ddriver_ring *ring);
+int ddriver_ring_submit(struct ddriver_ring *ring);
+int ddriver_ring_peek_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe);
+int ddriver_ring_wait_cqe(struct ddriver_ring *ring, struct ddriver_cqe *cqe);
+int ddriver_ring_eventfd(struct ddriver_ring *ring);
+int ddriver_ring_exit(struct ddriver_ring *ring);
+
 #endif /* _DDRIVER_H_ */
\ No newline at end of file
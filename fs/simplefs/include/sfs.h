@@ -25,6 +25,9 @@ char* 			   sfs_get_fname(const char* path);
 int 			   sfs_calc_lvl(const char * path);
 int 			   sfs_driver_read(int offset, uint8_t *out_content, int size);
 int 			   sfs_driver_write(int offset, uint8_t *in_content, int size);
+void 			   sfs_discard_add(int offset, int len);
+void 			   sfs_discard_cancel(int offset);
+int 			   sfs_discard_flush();
 
 
 int 			   sfs_mount(struct custom_options options);
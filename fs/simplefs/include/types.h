@@ -41,6 +41,7 @@ typedef enum sfs_file_type {
 #define SFS_INODE_PER_FILE      1
 #define SFS_DATA_PER_FILE       16
 #define SFS_DEFAULT_PERM        0777
+#define SFS_DISCARD_BATCH       64      /* 攒够这么多段释放区域就先discard一次 */
 
 #define SFS_IOC_MAGIC           'S'
 #define SFS_IOC_SEEK            _IO(SFS_IOC_MAGIC, 0)
@@ -77,6 +78,7 @@ struct sfs_super;
 struct custom_options {
 	const char*        device;
 	boolean            show_help;
+	boolean            discard;                       /* --discard: 释放的区域在sync时discard */
 };
 
 struct sfs_inode
@@ -117,6 +119,10 @@ struct sfs_super
 
     boolean            is_mounted;
 
+    boolean            discard;
+    int                discard_cnt;
+    struct ddriver_range discards[SFS_DISCARD_BATCH]; /* 待discard的已释放区域 */
+
     struct sfs_dentry* root_dentry;
 };
 
@@ -15,6 +15,7 @@ static const struct fuse_opt option_spec[] = {
 	OPTION("--device=%s", device),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
+	OPTION("--discard", discard),
 	FUSE_OPT_END
 };
 
@@ -504,8 +505,9 @@ void sfs_usage() {
 	printf("Author: Deadpool <deadpoolmine@qq.com>\n");
 	printf("Description: A Filesystem in UserSpacE (FUSE) sample file system \n");
 	printf("\n");
-	printf("Usage: ./sfs-fuse --device=[device path] mntpoint\n");
+	printf("Usage: ./sfs-fuse --device=[device path] [--discard] mntpoint\n");
 	printf("mount device to mntpoint with SFS\n");
+	printf("--discard: discard freed blocks on the device when syncing\n");
 	printf("=================================================================\n");
 	printf("FUSE general options\n");
 	return;
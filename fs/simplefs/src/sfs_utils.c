@@ -55,16 +55,22 @@ int sfs_driver_read(int offset, uint8_t *out_content, int size)
     int offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
     int bias = offset - offset_aligned;
     int size_aligned = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
+    struct iovec iov;
+    if (bias == 0 && size_aligned == size)
+    { /* 已对齐，直接读入 */
+        iov.iov_base = out_content;
+        iov.iov_len = size;
+        return ddriver_readv(SFS_DRIVER(), offset_aligned, &iov, 1) == size
+                   ? SFS_ERROR_NONE
+                   : -SFS_ERROR_IO;
+    }
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
+    iov.iov_base = temp_content;
+    iov.iov_len = size_aligned;
+    if (ddriver_readv(SFS_DRIVER(), offset_aligned, &iov, 1) != size_aligned)
     {
-        // read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_read(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();
+        free(temp_content);
+        return -SFS_ERROR_IO;
     }
     memcpy(out_content, temp_content + bias, size);
     free(temp_content);
@@ -83,23 +89,107 @@ int sfs_driver_write(int offset, uint8_t *in_content, int size)
     int offset_aligned = SFS_ROUND_DOWN(offset, SFS_IO_SZ());
     int bias = offset - offset_aligned;
     int size_aligned = SFS_ROUND_UP((size + bias), SFS_IO_SZ());
+    struct iovec iov;
+    int ret = SFS_ERROR_NONE;
+    if (bias == 0 && size_aligned == size)
+    { /* 整块写无需先读 */
+        iov.iov_base = in_content;
+        iov.iov_len = size;
+        return ddriver_writev(SFS_DRIVER(), offset_aligned, &iov, 1) == size
+                   ? SFS_ERROR_NONE
+                   : -SFS_ERROR_IO;
+    }
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
-    sfs_driver_read(offset_aligned, temp_content, size_aligned);
+    if (sfs_driver_read(offset_aligned, temp_content, size_aligned) != SFS_ERROR_NONE)
+    {
+        free(temp_content);
+        return -SFS_ERROR_IO;
+    }
     memcpy(temp_content + bias, in_content, size);
 
-    // lseek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    ddriver_seek(SFS_DRIVER(), offset_aligned, SEEK_SET);
-    while (size_aligned != 0)
+    iov.iov_base = temp_content;
+    iov.iov_len = size_aligned;
+    if (ddriver_writev(SFS_DRIVER(), offset_aligned, &iov, 1) != size_aligned)
     {
-        // write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        ddriver_write(SFS_DRIVER(), cur, SFS_IO_SZ());
-        cur += SFS_IO_SZ();
-        size_aligned -= SFS_IO_SZ();
+        ret = -SFS_ERROR_IO;
     }
 
     free(temp_content);
-    return SFS_ERROR_NONE;
+    return ret;
+}
+/**
+ * @brief 记下一段已释放的区域, 等到sync时再批量discard; 未开启--discard时忽略
+ *
+ * @param offset
+ * @param len
+ */
+void sfs_discard_add(int offset, int len)
+{
+    if (!sfs_super.discard)
+    {
+        return;
+    }
+    if (sfs_super.discard_cnt == SFS_DISCARD_BATCH)
+    {
+        sfs_discard_flush();
+    }
+    sfs_super.discards[sfs_super.discard_cnt].offset = offset;
+    sfs_super.discards[sfs_super.discard_cnt].len = len;
+    sfs_super.discard_cnt++;
+}
+/**
+ * @brief 区域在discard之前又被分配出去时, 撤销对它的discard
+ *
+ * @param offset
+ */
+void sfs_discard_cancel(int offset)
+{
+    int i;
+    for (i = 0; i < sfs_super.discard_cnt; i++)
+    {
+        if (sfs_super.discards[i].offset == offset)
+        {
+            sfs_super.discards[i] = sfs_super.discards[--sfs_super.discard_cnt];
+            return;
+        }
+    }
+}
+
+static int sfs_range_cmp(const void *a, const void *b)
+{
+    const struct ddriver_range *ra = (const struct ddriver_range *)a;
+    const struct ddriver_range *rb = (const struct ddriver_range *)b;
+    return ra->offset < rb->offset ? -1 : (ra->offset > rb->offset);
+}
+/**
+ * @brief 按偏移排序, 合并相邻区域后逐段discard
+ *
+ * @return int
+ */
+int sfs_discard_flush()
+{
+    struct ddriver_range range;
+    int i;
+    int ret = SFS_ERROR_NONE;
+
+    qsort(sfs_super.discards, sfs_super.discard_cnt, sizeof(struct ddriver_range), sfs_range_cmp);
+    for (i = 0; i < sfs_super.discard_cnt; i++)
+    {
+        range = sfs_super.discards[i];
+        while (i + 1 < sfs_super.discard_cnt &&
+               sfs_super.discards[i + 1].offset == range.offset + range.len)
+        {
+            range.len += sfs_super.discards[++i].len;
+        }
+        if (ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &range) < 0)
+        {
+            SFS_DBG("[%s] discard [%lld, %lld) failed\n", __func__,
+                    range.offset, range.offset + range.len);
+            ret = -SFS_ERROR_IO;
+        }
+    }
+    sfs_super.discard_cnt = 0;
+    return ret;
 }
 /**
  * @brief 为一个inode分配dentry，采用头插法
@@ -197,6 +287,8 @@ struct sfs_inode *sfs_alloc_inode(struct sfs_dentry *dentry)
     if (!is_find_free_entry || ino_cursor == sfs_super.max_ino)
         return -SFS_ERROR_NOSPACE;
 
+    sfs_discard_cancel(SFS_INO_OFS(ino_cursor));
+
     inode = (struct sfs_inode *)malloc(sizeof(struct sfs_inode));
     inode->ino = ino_cursor;
     inode->size = 0;
@@ -347,6 +439,8 @@ int sfs_drop_inode(struct sfs_inode *inode)
                 if (ino_cursor == inode->ino)
                 {
                     sfs_super.map_inode[byte_cursor] &= (uint8_t)(~(0x1 << bit_cursor));
+                    sfs_discard_add(SFS_INO_OFS(inode->ino),
+                                    SFS_BLKS_SZ((SFS_INODE_PER_FILE + SFS_DATA_PER_FILE)));
                     is_find = TRUE;
                     break;
                 }
@@ -569,6 +663,8 @@ int sfs_mount(struct custom_options options)
     }
 
     sfs_super.driver_fd = driver_fd;
+    sfs_super.discard = options.discard;
+    sfs_super.discard_cnt = 0;
     ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &sfs_super.sz_disk);
     ddriver_ioctl(SFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &sfs_super.sz_io);
 
@@ -659,6 +755,9 @@ int sfs_umount()
         return -SFS_ERROR_IO;
     }
 
+    /* 元数据落盘后再丢弃已释放的区域 */
+    sfs_discard_flush();
+
     free(sfs_super.map_inode);
     ddriver_close(SFS_DRIVER());
 
@@ -6,16 +6,115 @@
 * SECTION: IO ctl protocol definitions
 *******************************************************************************/
 #define IOC_MAGIC               'A'
+
+#define DDRIVER_SCHED_NOOP      0                   /* 按到达顺序 */
+#define DDRIVER_SCHED_DEADLINE  1                   /* 按位置排序, 超时请求优先 */
+#define DDRIVER_SCHED_CLOOK     2                   /* 单向电梯, 到头后回绕 */
+#define DDRIVER_SCHED_NR        3
+
+struct ddriver_sched_state
+{
+    long long dispatch_cnt;                         /* 经调度器派发的请求数 */
+    long long reorder_cnt;                          /* 派发顺序与到达顺序不同的请求数 */
+    long long expire_cnt;                           /* 因超时被提前派发的请求数 */
+    long long seek_dist;                            /* 磁头移动的总字节数 */
+    long long seek_lat_us;                          /* 模拟的寻道延迟(us) */
+};
+
 struct ddriver_state
 {
     int write_cnt;
     int read_cnt;
     int seek_cnt;
+    int sched;                                      /* 当前调度器 DDRIVER_SCHED_* */
+    struct ddriver_sched_state sched_stat[DDRIVER_SCHED_NR];
+};
+
+#define DDRIVER_STAT_READ       0
+#define DDRIVER_STAT_WRITE      1
+#define DDRIVER_STAT_NR         2
+#define DDRIVER_HIST_BUCKETS    32                  /* 第i个桶: [2^i, 2^(i+1)) us, 第0个桶含0 */
+
+struct ddriver_stats_ex
+{
+    long long read_ops;                             /* 读请求数(一次向量读算一次) */
+    long long write_ops;
+    long long seek_ops;                             /* 磁头实际移动的次数 */
+    long long read_bytes;
+    long long write_bytes;
+    long long seek_dist;                            /* 磁头移动的总字节数 */
+    long long model_lat_us;                         /* 模拟延迟总和(us), 含寻道 */
+    long long model_hist[DDRIVER_STAT_NR][DDRIVER_HIST_BUCKETS];   /* 每次读写的模拟延迟 */
+    long long wall_hist[DDRIVER_STAT_NR][DDRIVER_HIST_BUCKETS];    /* 每次读写的实际耗时 */
+    long long discard_ops;
+    long long discard_bytes;
+};
+
+struct ddriver_range
+{
+    long long offset;                               /* 按块对齐 */
+    long long len;                                  /* 块大小的整数倍 */
+};
+
+#define DDRIVER_SECTOR_SZ       512                 /* 撕裂写的粒度 */
+
+#define DDRIVER_FAULT_DROP      0x1                 /* 第drop_after次之后的写静默丢弃 */
+#define DDRIVER_FAULT_TORN      0x2                 /* 第torn_at次写只落盘开头的若干扇区 */
+#define DDRIVER_FAULT_EIO_READ  0x4                 /* 读到eio区间时返回-EIO */
+#define DDRIVER_FAULT_EIO_WRITE 0x8                 /* 写到eio区间时返回-EIO */
+#define DDRIVER_FAULT_SPIKE     0x10                /* 随机注入延迟尖刺 */
+
+#define DDRIVER_SPIKE_FIXED     0                   /* 恒为spike_us */
+#define DDRIVER_SPIKE_UNIFORM   1                   /* [0, 2 * spike_us)均匀分布 */
+#define DDRIVER_SPIKE_EXP       2                   /* 均值spike_us的指数分布 */
+#define DDRIVER_SPIKE_PARETO    3                   /* 均值spike_us的帕累托分布(alpha=2), 长尾 */
+#define DDRIVER_SPIKE_NR        4
+
+struct ddriver_fault
+{
+    int       flags;                                /* DDRIVER_FAULT_*, 0关闭注入 */
+    int       spike_dist;                           /* DDRIVER_SPIKE_* */
+    long long drop_after;                           /* 写次数, 从设置注入时算起 */
+    long long torn_at;
+    long long eio_offset;                           /* 出错区间(字节) */
+    long long eio_len;
+    int       spike_permille;                       /* 每千次请求中出现尖刺的次数 */
+    int       seed;                                 /* 相同种子得到相同的故障序列 */
+    long long spike_us;                             /* 尖刺延迟的均值(us) */
+    /* 以下由IOC_REQ_DEVICE_FAULT_STATE返回, 设置时忽略 */
+    long long write_cnt;                            /* 设置以来的写次数 */
+    long long dropped;
+    long long torn;
+    long long eio;
+    long long spikes;
+};
+
+struct ddriver_cache_state
+{
+    long long size;                                 /* 缓存容量(块), 0表示未开启 */
+    long long dirty;                                /* 当前脏块数 */
+    long long read_hits;                            /* 整个请求都在缓存中的读 */
+    long long read_misses;
+    long long write_hits;                           /* 被缓存吸收的写 */
+    long long write_bypass;                         /* 大于缓存而直写的写 */
+    long long evictions;                            /* 缓存满时写回的LRU块 */
+    long long flushes;                              /* 刷出次数(ioctl/定时/关闭) */
+    long long flushed_blocks;                       /* 刷出时写回的块 */
 };
 
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)                     /* 请求查看设备大小 */
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)    /* 请求设备状态，返回 ddriver_state */
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)                           /* 请求重置设备 */
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)                     /* 请求设备IO大小 */
+#define IOC_REQ_DEVICE_SCHED    _IOW(IOC_MAGIC, 4, int)                     /* 设置IO调度器 DDRIVER_SCHED_* */
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 5, long long)               /* 请求查看设备大小(64位) */
+#define IOC_REQ_DEVICE_STATS_EX _IOR(IOC_MAGIC, 6, struct ddriver_stats_ex) /* 请求扩展统计，返回 ddriver_stats_ex */
+#define IOC_REQ_DEVICE_STATS_RESET _IO(IOC_MAGIC, 7)                        /* 只清零统计，不动磁盘内容 */
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 8, struct ddriver_range)    /* 丢弃一段块，之后读出全0 */
+#define IOC_REQ_DEVICE_FAULT    _IOW(IOC_MAGIC, 9, struct ddriver_fault)    /* 设置故障与延迟注入，flags为0时关闭 */
+#define IOC_REQ_DEVICE_FAULT_STATE _IOR(IOC_MAGIC, 10, struct ddriver_fault) /* 读回注入配置与命中次数 */
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 11)                          /* 把写回缓存中的脏块刷到盘上 */
+#define IOC_REQ_DEVICE_CACHE_STATE _IOR(IOC_MAGIC, 12, struct ddriver_cache_state) /* 请求写回缓存统计 */
+#define IOC_REQ_DEVICE_CACHE_DROP _IO(IOC_MAGIC, 13)                        /* 丢弃缓存中的脏块，模拟掉电 */
 
 #endif
\ No newline at end of file
@@ -0,0 +1,330 @@
+#include "../include/ddriver.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+/*
+ * ddriver微基准, 命令行与输出格式仿照google-benchmark:
+ *
+ *   ddriver_bench [--benchmark_filter=子串] [--benchmark_min_time=秒]
+ *                 [--benchmark_format=console|json] [--benchmark_out=文件]
+ *                 [--latency] [--disk=路径] [--disk_size=字节]
+ *
+ * 默认关闭延迟模拟, 量的是驱动本身的开销; --latency打开后量的是模拟磁盘.
+ * --benchmark_out总是写JSON, 便于与上一次的结果比较.
+ */
+
+#define BENCH_MAX           32
+#define BENCH_MAX_IO        4096
+#define BENCH_DEFAULT_DISK  (16 * 1024 * 1024)
+
+struct bench_ctx {
+    int       fd;
+    long long disk_size;
+    int       io_size;
+    unsigned long long rng;
+    long long pos;
+    char      buf[BENCH_MAX_IO];
+};
+
+struct bench {
+    const char *name;
+    int        arg;                                   /* IO大小, 0表示无参数 */
+    int        (*run)(struct bench_ctx *ctx);         /* 一次迭代, 返回传输的字节数 */
+};
+
+struct bench_result {
+    char      name[64];
+    long long iterations;
+    double    real_ns;
+    double    cpu_ns;
+    double    bytes_per_second;
+    double    items_per_second;
+    int       error;
+};
+
+static unsigned long long rand_next(struct bench_ctx *ctx) {
+    ctx->rng ^= ctx->rng << 13;
+    ctx->rng ^= ctx->rng >> 7;
+    ctx->rng ^= ctx->rng << 17;
+    return ctx->rng;
+}
+
+static long long rand_off(struct bench_ctx *ctx) {
+    return (long long)(rand_next(ctx) % (ctx->disk_size / ctx->io_size)) * ctx->io_size;
+}
+
+static long long seq_off(struct bench_ctx *ctx) {
+    long long off = ctx->pos;
+
+    ctx->pos += ctx->io_size;
+    if (ctx->pos + ctx->io_size > ctx->disk_size)
+        ctx->pos = 0;
+    return off;
+}
+
+static int bm_seq_write(struct bench_ctx *ctx) {
+    return ddriver_pwrite(ctx->fd, ctx->buf, ctx->io_size, seq_off(ctx));
+}
+
+static int bm_seq_read(struct bench_ctx *ctx) {
+    return ddriver_pread(ctx->fd, ctx->buf, ctx->io_size, seq_off(ctx));
+}
+
+static int bm_rand_write(struct bench_ctx *ctx) {
+    return ddriver_pwrite(ctx->fd, ctx->buf, ctx->io_size, rand_off(ctx));
+}
+
+static int bm_rand_read(struct bench_ctx *ctx) {
+    return ddriver_pread(ctx->fd, ctx->buf, ctx->io_size, rand_off(ctx));
+}
+
+/* 老接口: 磁头停在上一次读写之后, 每次只传一个块 */
+static int bm_legacy_write(struct bench_ctx *ctx) {
+    if (ctx->pos + ctx->io_size > ctx->disk_size) {
+        ctx->pos = 0;
+        ddriver_seek(ctx->fd, 0, SEEK_SET);
+    }
+    ctx->pos += ctx->io_size;
+    return ddriver_write(ctx->fd, ctx->buf, ctx->io_size);
+}
+
+static int bm_legacy_read(struct bench_ctx *ctx) {
+    if (ctx->pos + ctx->io_size > ctx->disk_size) {
+        ctx->pos = 0;
+        ddriver_seek(ctx->fd, 0, SEEK_SET);
+    }
+    ctx->pos += ctx->io_size;
+    return ddriver_read(ctx->fd, ctx->buf, ctx->io_size);
+}
+
+static int bm_seek(struct bench_ctx *ctx) {
+    int ret = ddriver_seek(ctx->fd, rand_off(ctx), SEEK_SET);
+    return ret < 0 ? ret : 0;
+}
+
+/* 在磁盘两端来回跳, 每次跳完读一个块 */
+static int bm_seek_pingpong(struct bench_ctx *ctx) {
+    long long off = (ctx->pos ^= 1) ? ctx->disk_size - ctx->io_size : 0;
+    int ret = ddriver_seek(ctx->fd, off, SEEK_SET);
+
+    return ret < 0 ? ret : ddriver_read(ctx->fd, ctx->buf, ctx->io_size);
+}
+
+static int bm_reset(struct bench_ctx *ctx) {
+    return ddriver_ioctl(ctx->fd, IOC_REQ_DEVICE_RESET, NULL);
+}
+
+static const struct bench benches[] = {
+    { "BM_SeqWrite",        512,  bm_seq_write },
+    { "BM_SeqWrite",        1024, bm_seq_write },
+    { "BM_SeqWrite",        4096, bm_seq_write },
+    { "BM_SeqRead",         512,  bm_seq_read },
+    { "BM_SeqRead",         1024, bm_seq_read },
+    { "BM_SeqRead",         4096, bm_seq_read },
+    { "BM_RandWrite",       512,  bm_rand_write },
+    { "BM_RandWrite",       1024, bm_rand_write },
+    { "BM_RandWrite",       4096, bm_rand_write },
+    { "BM_RandRead",        512,  bm_rand_read },
+    { "BM_RandRead",        1024, bm_rand_read },
+    { "BM_RandRead",        4096, bm_rand_read },
+    { "BM_LegacyWrite",     512,  bm_legacy_write },
+    { "BM_LegacyRead",      512,  bm_legacy_read },
+    { "BM_Seek",            512,  bm_seek },
+    { "BM_SeekPingPong",    512,  bm_seek_pingpong },
+    { "BM_Reset",           0,    bm_reset },
+};
+
+static double clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief 像google-benchmark一样逐步放大迭代次数, 直到一轮跑满min_time
+ */
+static void run_bench(const struct bench *b, struct bench_ctx *ctx, double min_time,
+                      struct bench_result *res) {
+    long long iters = 1, next, i, bytes;
+    double real, cpu;
+    int ret;
+
+    ctx->io_size = b->arg ? b->arg : 512;
+
+    while (1) {
+        ctx->pos = 0;
+        ctx->rng = 0x2545f4914f6cdd1dULL;
+        ddriver_seek(ctx->fd, 0, SEEK_SET);
+        bytes = 0;
+        real = clock_ns(CLOCK_MONOTONIC);
+        cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+        for (i = 0; i < iters; i++) {
+            ret = b->run(ctx);
+            if (ret < 0) {
+                res->error = ret;
+                return;
+            }
+            bytes += ret;
+        }
+        real = clock_ns(CLOCK_MONOTONIC) - real;
+        cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        if (real >= min_time * 1e9 || iters >= (1LL << 30))
+            break;
+        /* 按本轮耗时估算, 最多放大10倍 */
+        next = real > 0 ? iters * (min_time * 1.4e9 / real) : iters * 10;
+        if (next > iters * 10)
+            next = iters * 10;
+        iters = next > iters ? next : iters + 1;
+    }
+    res->iterations = iters;
+    res->real_ns = real / iters;
+    res->cpu_ns = cpu / iters;
+    res->bytes_per_second = bytes * 1e9 / real;
+    res->items_per_second = iters * 1e9 / real;
+}
+
+static void print_json(FILE *fp, const char *exe, struct bench_result *res, int nr,
+                       int latency, long long disk_size) {
+    char host[256] = "unknown", date[64];
+    time_t now = time(NULL);
+    int i;
+
+    gethostname(host, sizeof(host) - 1);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    fprintf(fp, "{\n  \"context\": {\n");
+    fprintf(fp, "    \"date\": \"%s\",\n", date);
+    fprintf(fp, "    \"host_name\": \"%s\",\n", host);
+    fprintf(fp, "    \"executable\": \"%s\",\n", exe);
+    fprintf(fp, "    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(fp, "    \"ddriver_latency\": %s,\n", latency ? "true" : "false");
+    fprintf(fp, "    \"ddriver_disk_size\": %lld\n", disk_size);
+    fprintf(fp, "  },\n  \"benchmarks\": [\n");
+    for (i = 0; i < nr; i++) {
+        fprintf(fp, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n",
+                res[i].name, res[i].name);
+        fprintf(fp, "      \"run_type\": \"iteration\",\n      \"repetitions\": 1,\n");
+        if (res[i].error) {
+            fprintf(fp, "      \"error_occurred\": true,\n");
+            fprintf(fp, "      \"error_message\": \"%s\"\n", strerror(-res[i].error));
+        }
+        else {
+            fprintf(fp, "      \"iterations\": %lld,\n", res[i].iterations);
+            fprintf(fp, "      \"real_time\": %.3f,\n", res[i].real_ns);
+            fprintf(fp, "      \"cpu_time\": %.3f,\n", res[i].cpu_ns);
+            fprintf(fp, "      \"time_unit\": \"ns\",\n");
+            fprintf(fp, "      \"bytes_per_second\": %.3f,\n", res[i].bytes_per_second);
+            fprintf(fp, "      \"items_per_second\": %.3f\n", res[i].items_per_second);
+        }
+        fprintf(fp, "    }%s\n", i + 1 < nr ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void print_console(struct bench_result *res, int nr) {
+    int i;
+
+    printf("%-24s %14s %14s %12s %14s\n", "Benchmark", "Time", "CPU", "Iterations", "Throughput");
+    printf("--------------------------------------------------------------------------------\n");
+    for (i = 0; i < nr; i++) {
+        if (res[i].error) {
+            printf("%-24s ERROR: %s\n", res[i].name, strerror(-res[i].error));
+            continue;
+        }
+        printf("%-24s %11.0f ns %11.0f ns %12lld %10.2f MiB/s\n", res[i].name,
+               res[i].real_ns, res[i].cpu_ns, res[i].iterations,
+               res[i].bytes_per_second / (1024 * 1024));
+    }
+}
+
+static const char *opt_val(const char *arg, const char *name) {
+    size_t len = strlen(name);
+    return strncmp(arg, name, len) == 0 && arg[len] == '=' ? arg + len + 1 : NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_result res[BENCH_MAX];
+    struct ddriver_profile prof;
+    struct bench_ctx *ctx;
+    const char *filter = NULL, *out = NULL, *val;
+    char disk[512];
+    long long disk_size = BENCH_DEFAULT_DISK;
+    double min_time = 0.2;
+    int json = 0, latency = 0;
+    int i, nr = 0;
+    FILE *fp;
+
+    snprintf(disk, sizeof(disk), "%s/ddriver_bench", getenv("HOME") ? getenv("HOME") : "/tmp");
+    for (i = 1; i < argc; i++) {
+        if ((val = opt_val(argv[i], "--benchmark_filter")))
+            filter = val;
+        else if ((val = opt_val(argv[i], "--benchmark_min_time")))
+            min_time = atof(val);
+        else if ((val = opt_val(argv[i], "--benchmark_format")))
+            json = strcmp(val, "json") == 0;
+        else if ((val = opt_val(argv[i], "--benchmark_out")))
+            out = val;
+        else if ((val = opt_val(argv[i], "--disk")))
+            snprintf(disk, sizeof(disk), "%s", val);
+        else if ((val = opt_val(argv[i], "--disk_size")))
+            disk_size = atoll(val);
+        else if (strcmp(argv[i], "--latency") == 0)
+            latency = 1;
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    /* 驱动的日志会混进JSON, 只保留PANIC */
+    setenv("DDRIVER_LOG_LEVEL", "panic", 0);
+    ddriver_profile_parse("default", &prof);
+    prof.disk_size = disk_size;
+    if (!latency)
+        prof.flags |= DDRIVER_PROFILE_NO_LATENCY;
+
+    ctx = calloc(1, sizeof(*ctx));
+    ctx->fd = ddriver_open_ex(disk, &prof);
+    if (ctx->fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", disk, strerror(-ctx->fd));
+        return 1;
+    }
+    ctx->disk_size = disk_size;
+    memset(ctx->buf, 'a', sizeof(ctx->buf));
+
+    for (i = 0; i < (int)(sizeof(benches) / sizeof(benches[0])) && nr < BENCH_MAX; i++) {
+        memset(&res[nr], 0, sizeof(res[nr]));
+        if (benches[i].arg)
+            snprintf(res[nr].name, sizeof(res[nr].name), "%s/%d", benches[i].name, benches[i].arg);
+        else
+            snprintf(res[nr].name, sizeof(res[nr].name), "%s", benches[i].name);
+        if (filter && !strstr(res[nr].name, filter))
+            continue;
+        run_bench(&benches[i], ctx, min_time, &res[nr]);
+        nr++;
+    }
+    ddriver_close(ctx->fd);
+    free(ctx);
+
+    if (json)
+        print_json(stdout, argv[0], res, nr, latency, disk_size);
+    else
+        print_console(res, nr);
+    if (out) {
+        fp = fopen(out, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "can't write %s: %s\n", out, strerror(errno));
+            return 1;
+        }
+        print_json(fp, argv[0], res, nr, latency, disk_size);
+        fclose(fp);
+    }
+    for (i = 0; i < nr; i++) {
+        if (res[i].error)
+            return 1;
+    }
+    return 0;
+}